@@ -0,0 +1,44 @@
+# CANnuccia/src/SizeReport.cmake - Post-build size report and check
+#
+# Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+# Usage: cmake -DELF=<cn.elf> -DNM=<nm> -DSIZE=<size> -DLIMIT=<bytes>
+#              -DREPORT=<report file> -P SizeReport.cmake
+#
+# Writes the size of each function/variable in ELF (largest last) to REPORT,
+# then fails if the flash used by ELF (.text + .data) exceeds LIMIT bytes.
+
+execute_process(
+    COMMAND "${NM}" --size-sort --print-size --radix=d "${ELF}"
+    OUTPUT_FILE "${REPORT}"
+    RESULT_VARIABLE NM_RESULT
+)
+if(NOT NM_RESULT EQUAL 0)
+    message(WARNING "Could not generate the size report with ${NM}")
+endif()
+
+execute_process(
+    COMMAND "${SIZE}" -B "${ELF}"
+    OUTPUT_VARIABLE SIZE_OUTPUT
+    RESULT_VARIABLE SIZE_RESULT
+)
+# Berkeley format: a header line, then "text data bss dec hex filename"
+if(NOT SIZE_RESULT EQUAL 0
+   OR NOT SIZE_OUTPUT MATCHES "\n[ \t]*([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)")
+    message(FATAL_ERROR "Could not measure the size of ${ELF} with ${SIZE}")
+endif()
+set(TEXT_SIZE ${CMAKE_MATCH_1})
+set(DATA_SIZE ${CMAKE_MATCH_2})
+set(BSS_SIZE ${CMAKE_MATCH_3})
+math(EXPR FLASH_USED "${TEXT_SIZE} + ${DATA_SIZE}")
+math(EXPR FLASH_FREE "${LIMIT} - ${FLASH_USED}")
+
+message(STATUS "CANnuccia: ${FLASH_USED}/${LIMIT} bytes of flash (${FLASH_FREE} free), ${DATA_SIZE} + ${BSS_SIZE} bytes of RAM")
+if(FLASH_USED GREATER LIMIT)
+    message(FATAL_ERROR "CANnuccia does not fit in the ${LIMIT} bytes reserved to it (${FLASH_USED} bytes)! "
+                        "Disable some of its features or reserve more flash to it. See ${REPORT}")
+endif()
@@ -9,11 +9,49 @@
 set(AVR_PREFIX "avr" CACHE STRING "The prefix of the AVR crosscompiler toolchain")
 set(AVR_PART "atmega328p" CACHE STRING "The AVR microcontroller's part name")
 
-# 4kB bootloader is the maximum possible for ATMega328p (BOOTSZ=00).
-# With BOOTSZ=00, the whole NRWW section is occupied by the bootloader.
-# TODO: May differ for other AVR chips!
-set(AVR_FLASH_SIZE 32768 CACHE STRING "The total size of program flash, in bytes")
-set(AVR_BOOTLOADER_SIZE 4096 CACHE STRING "The size allocated to the bootloader section (via BOOTSZ), in bytes")
+# A minimal build leaves out all optional features (see common/config.h) so
+# that the bootloader fits in 2kB, returning the other 2kB to the user program.
+set(CN_MINIMAL OFF CACHE BOOL "Size-optimized build with optional features left out")
+
+# Flash and RAM geometry of the supported parts: flash size and page size (in
+# bytes), RAMEND. Parts with more than 64kB of flash are addressed via RAMPZ
+# (see avr/flash.c).
+if(AVR_PART STREQUAL "atmega328p")
+    set(AVR_PART_GEOMETRY 32768 128 0x08FF)
+elseif(AVR_PART STREQUAL "atmega1280")
+    set(AVR_PART_GEOMETRY 131072 256 0x21FF)
+elseif(AVR_PART STREQUAL "atmega2560")
+    set(AVR_PART_GEOMETRY 262144 256 0x21FF)
+else()
+    message(FATAL_ERROR "Unsupported AVR_PART \"${AVR_PART}\" (supported: atmega328p, atmega1280, atmega2560)")
+endif()
+list(GET AVR_PART_GEOMETRY 0 AVR_DEFAULT_FLASH_SIZE)
+list(GET AVR_PART_GEOMETRY 1 AVR_PAGE_SIZE)
+list(GET AVR_PART_GEOMETRY 2 AVR_DEFAULT_RAM_END)
+
+# 4kB bootloader is the maximum possible for ATMega328p (BOOTSZ=00); with
+# BOOTSZ=00, the whole NRWW section is occupied by the bootloader.
+# A minimal build fits in 2kB instead (BOOTSZ=01).
+# (both are also valid BOOTSZ settings on ATMega1280/2560, which go up to 8kB)
+if(CN_MINIMAL)
+    set(AVR_DEFAULT_BOOTLOADER_SIZE 2048)
+else()
+    set(AVR_DEFAULT_BOOTLOADER_SIZE 4096)
+endif()
+set(AVR_FLASH_SIZE ${AVR_DEFAULT_FLASH_SIZE} CACHE STRING "The total size of program flash, in bytes")
+set(AVR_RAM_END ${AVR_DEFAULT_RAM_END} CACHE STRING "The address of the last byte of RAM (RAMEND)")
+set(AVR_BOOTLOADER_SIZE ${AVR_DEFAULT_BOOTLOADER_SIZE} CACHE STRING "The size allocated to the bootloader section (via BOOTSZ), in bytes")
+
+# With direct fill, WRITEs go straight into the SPM temporary page buffer
+# instead of a copy of the page in RAM. Saves a page worth of RAM and a pass
+# over the page on commit, but WRITEs to a page must be sequential.
+set(AVR_DIRECT_FILL OFF CACHE BOOL "Stream WRITEs directly into the SPM page buffer")
+
+# The MCP25625 can be wired either to the hardware SPI (MOSI=PB3, SCK=PB5) or
+# to USART0 in Master SPI Mode (MOSI=TXD0/PD1, MISO=RXD0/PD0, SCK=XCK0/PD4).
+# The USART's transmitter is double-buffered, so bursts have no gaps between bytes.
+set(AVR_SPI_BACKEND "SPI" CACHE STRING "What the MCP25625 is wired to: SPI or USART")
+set_property(CACHE AVR_SPI_BACKEND PROPERTY STRINGS SPI USART)
 
 set(CMAKE_SYSTEM_NAME Generic)
 set(CMAKE_SYSTEM_PROCESSOR avr)
@@ -26,10 +64,12 @@ set(CMAKE_CXX_COMPILER "${AVR_PREFIX}-g++")
 set(CMAKE_CXX_COMPILER_TARGET "${AVR_PREFIX}")
 set(CMAKE_CXX_COMPILER_ID GNU)
 set(CMAKE_CXX_COMPILER_FORCED YES)
+set(CMAKE_NM "${AVR_PREFIX}-nm")
+set(CMAKE_SIZE "${AVR_PREFIX}-size")
 
-set(CMAKE_C_FLAGS_DEBUG "-g -Og -mmcu=${AVR_PART} -flto -fstrict-volatile-bitfields")
+set(CMAKE_C_FLAGS_DEBUG "-g -Og -mmcu=${AVR_PART} -flto -fstrict-volatile-bitfields -ffunction-sections -fdata-sections")
 set(CMAKE_CXX_FLAGS_DEBUG "${CMAKE_C_FLAGS_DEBUG}")
-set(CMAKE_C_FLAGS_RELEASE "-Os -mmcu=${AVR_PART} -flto -fstrict-volatile-bitfields")
+set(CMAKE_C_FLAGS_RELEASE "-Os -mmcu=${AVR_PART} -flto -fstrict-volatile-bitfields -ffunction-sections -fdata-sections")
 set(CMAKE_CXX_FLAGS_RELEASE "${CMAKE_C_FLAGS_RELEASE}")
 
 
@@ -42,20 +82,40 @@ if((BOOTLOADER_START_ADDR LESS 0) OR (BOOTLOADER_START_ADDR GREATER_EQUAL ${AVR_
     message(FATAL_ERROR "Calculated bootloader start address out of range!")
 endif()
 
+# The stack starts right below the hand-off record at the top of RAM, which is
+# CN_HANDOFF_SIZE (40) bytes in size (see common/handoff.h)
+math(EXPR BOOTLOADER_STACK_ADDR
+    "${AVR_RAM_END} - 40"
+    OUTPUT_FORMAT HEXADECIMAL
+)
+
 set(CMAKE_EXE_LINKER_FLAGS_LIST
     -flto
+    -Wl,--gc-sections
     -Wl,--section-start=.text=${BOOTLOADER_START_ADDR} # Relocate bootloader code
+    -Wl,--defsym=__stack=${BOOTLOADER_STACK_ADDR} # Keep the hand-off record off the stack
 )
 string(REPLACE ";" " " CMAKE_EXE_LINKER_FLAGS "${CMAKE_EXE_LINKER_FLAGS_LIST}")
 
+math(EXPR AVR_PAGE_MASK "0xFFFFFFFF & ~(${AVR_PAGE_SIZE} - 1)" OUTPUT_FORMAT HEXADECIMAL)
+
 # #define core macros required to build CANnuccia
-# FIXME: Do all AVRs have 128B pages?
-# FIXME IMPORTANT: Make sure the bootloader actually fits in CN_FLASH_BOOTLOADER_SIZE!!
+# NOTE: Whether the bootloader actually fits in CN_FLASH_BOOTLOADER_SIZE is
+#       checked after each build (see src/SizeReport.cmake)
 # FIXME: This should likely be moved out of the toolchain file to somewhere better!
 add_definitions(
-    -DCN_FLASH_PAGE_SIZE=0x80u # 128B pages
-    -DCN_FLASH_PAGE_MASK=0xFF80u
+    -DCN_FLASH_PAGE_SIZE=${AVR_PAGE_SIZE}u
+    -DCN_FLASH_PAGE_MASK=${AVR_PAGE_MASK}u
     -DCN_FLASH_BOOTLOADER_SIZE=${AVR_BOOTLOADER_SIZE}u # ${AVR_BOOTLOADER_SIZE} reserved to CANnuccia
     -DCN_E_MACHINE=0x0053u # AVR
     -DCN_PLATFORM_IS_AVR=1
 )
+if(CN_MINIMAL)
+    add_definitions(-DCN_MINIMAL=1)
+endif()
+if(AVR_DIRECT_FILL)
+    add_definitions(-DCN_FLASH_DIRECT_FILL=1)
+endif()
+if(AVR_SPI_BACKEND STREQUAL "USART")
+    add_definitions(-DCN_AVR_SPI_USART=1)
+endif()
@@ -0,0 +1,19 @@
+# CANnuccia/src/avr/CheckVectors.cmake - Post-build check of the AVR startup code
+#
+# Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+# Usage: cmake -DMAP=<linker map> -P CheckVectors.cmake
+#
+# Fails if the .init3 code of avr/startup.c, which moves the vector table to
+# the bootloader section, was not linked in (see avr/CMakeLists.txt): all ISRs
+# would then jump into the user program instead.
+
+file(READ "${MAP}" MAP_CONTENTS)
+if(NOT MAP_CONTENTS MATCHES "\n \\.init3[ \t]+0x[0-9a-fA-F]+[ \t]+0x[0-9a-fA-F]+[ \t]+[^\n]*startup\\.c")
+    message(FATAL_ERROR "The .init3 section of avr/startup.c is missing from ${MAP}: "
+                        "the vector table would not be moved to the bootloader section!")
+endif()
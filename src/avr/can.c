@@ -7,19 +7,60 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "common/can.h"
 
+#include "common/can_queue.h"
+#include "common/handoff.h"
+
 #ifndef F_CPU
 #   define F_CPU 16000000UL
 #endif
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
-// MCP25625's chip select, MOSI, SCK
-#define SPI_DDR DDRB
-#define SPI_PORT PORTB
+// MCP25625's chip select
+#define CS_DDR DDRB
+#define CS_PORT PORTB
 #define CS_PIN 0x80
-#define MOSI_PIN 0x08
-#define SCK_PIN 0x20
+
+// MCP25625's (active low) interrupt pin is wired to INT0 (PD2; PD0 on
+// ATMega1280/2560)
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+#   define MEGA_PINOUT 1
+#endif
+
+#ifndef CN_AVR_SPI_USART
+
+// MCP25625 on the hardware SPI: MOSI, SCK
+#define SPI_DDR DDRB
+#ifndef MEGA_PINOUT
+#   define MOSI_PIN 0x08 // (PB3)
+#   define SCK_PIN 0x20 // (PB5)
+#else
+#   define MOSI_PIN 0x04 // (PB2)
+#   define SCK_PIN 0x02 // (PB1)
+#endif
+
+/// Sets up the SPI bus used to talk to the MCP.
+inline static void spiInit(void)
+{
+    // MOSI and SCK as outputs
+    SPI_DDR |= MOSI_PIN | SCK_PIN;
+
+    // SPI enabled in master mode, CPHA=0, CPOL=0, MSB first, frequency=fOSC/2
+    SPCR = (1 << SPE) | (1 << MSTR);
+    SPSR |= (1 << SPI2X);
+}
+
+/// Resets the SPI bus and its pins to their state at chip reset.
+inline static void spiDeinit(void)
+{
+    SPCR = 0x00;
+    SPSR = 0x00;
+    SPI_DDR &= ~(MOSI_PIN | SCK_PIN);
+}
 
 /// Writes `byte` to SPI and returns the received response byte.
 inline static uint8_t spiTransfer(uint8_t byte)
@@ -29,23 +70,125 @@ inline static uint8_t spiTransfer(uint8_t byte)
     return SPDR;
 }
 
+/// Writes `n` bytes of `data` to SPI, discarding the response.
+inline static void spiWrite(unsigned n, const uint8_t data[n])
+{
+    for(unsigned i = 0; i < n; i ++)
+    {
+        spiTransfer(data[i]);
+    }
+}
+
+/// Reads `n` bytes from SPI to `outData` (writing zeroes).
+inline static void spiRead(unsigned n, uint8_t outData[n])
+{
+    for(unsigned i = 0; i < n; i ++)
+    {
+        outData[i] = spiTransfer(0x00);
+    }
+}
+
+#else
+
+// MCP25625 on USART0 in Master SPI Mode (MSPIM): MOSI=TXD0 (PD1),
+// MISO=RXD0 (PD0), SCK=XCK0 (PD4) - on ATMega1280/2560, PE1, PE0 and PE2
+// Unlike the hardware SPI, the USART has a double-buffered transmitter, so the
+// next byte can be queued while the current one is shifted out; bursts then
+// keep the bus busy without gaps between bytes.
+#ifndef MEGA_PINOUT
+#   define SPI_DDR DDRD
+#   define SCK_PIN 0x10
+#else
+#   define SPI_DDR DDRE
+#   define SCK_PIN 0x04
+#endif
+
+inline static void spiInit(void)
+{
+    // XCK0 as output: USART is the SPI master
+    UBRR0 = 0;
+    SPI_DDR |= SCK_PIN;
+
+    // MSPIM, CPHA=0, CPOL=0, MSB first, frequency=fOSC/2
+    // (UBRR0 must be zero when the transmitter is enabled)
+    UCSR0C = (1 << UMSEL01) | (1 << UMSEL00);
+    UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+    UBRR0 = 0;
+}
+
+inline static void spiDeinit(void)
+{
+    UCSR0B = 0x00;
+    UCSR0C = (1 << UCSZ01) | (1 << UCSZ00); // (reset value: async USART, 8N1)
+    SPI_DDR &= ~SCK_PIN;
+}
+
+inline static uint8_t spiTransfer(uint8_t byte)
+{
+    while(!(UCSR0A & (1 << UDRE0))) { }
+    UDR0 = byte;
+    while(!(UCSR0A & (1 << RXC0))) { }
+    return UDR0;
+}
+
+inline static void spiWrite(unsigned n, const uint8_t data[n])
+{
+    UCSR0A |= (1 << TXC0); // (clear TXC0)
+    for(unsigned i = 0; i < n; i ++)
+    {
+        while(!(UCSR0A & (1 << UDRE0))) { }
+        UDR0 = data[i];
+    }
+    while(!(UCSR0A & (1 << TXC0))) { } // Wait for the last byte to be shifted out
+
+    // Discard the responses (the receive buffer may have overrun meanwhile)
+    while(UCSR0A & (1 << RXC0))
+    {
+        (void)UDR0;
+    }
+}
+
+inline static void spiRead(unsigned n, uint8_t outData[n])
+{
+    if(n == 0)
+    {
+        return;
+    }
+
+    // Always keep one byte queued in the transmitter ahead of the one being received
+    UDR0 = 0x00;
+    for(unsigned i = 0; i < n; i ++)
+    {
+        if(i + 1 < n)
+        {
+            while(!(UCSR0A & (1 << UDRE0))) { }
+            UDR0 = 0x00;
+        }
+        while(!(UCSR0A & (1 << RXC0))) { }
+        outData[i] = UDR0;
+    }
+}
+
+#endif // CN_AVR_SPI_USART
+
 /// Puts the MCP chip select pin low.
 inline static void spiSelect(void)
 {
-    SPI_PORT &= ~CS_PIN;
+    CS_PORT &= ~CS_PIN;
 }
 
 /// Puts the MCP chip select pin high.
 inline static void spiDeselect(void)
 {
-    SPI_PORT |= CS_PIN;
+    CS_PORT |= CS_PIN;
 }
 
 
 // Register addresses and constants from MCP2565 (& MCP2510/MCP2515)'s datasheet
 #define MCP_CMD_RESET 0xC0
 #define MCP_CMD_READ 0x03
-#define MCP_CMD_READ_RXBUF 0x90
+#define MCP_CMD_READ_RXBUF 0x90 // (| RX buffer number << 2)
+#define MCP_READ_RXBUF_D0 0x02 // (READ RX BUFFER starting from RXBnD0 instead of RXBnSIDH)
 #define MCP_CMD_WRITE 0x02
 #define MCP_CMD_LOAD_TXBUF 0x40
 #define MCP_CMD_RTS 0x80
@@ -59,6 +202,11 @@ inline static void spiDeselect(void)
 #define MCP_REG_CNF3 0x28
 #define MCP_REG_RXF0SIDH 0x00
 #define MCP_REG_RXM0SIDH 0x20
+#define MCP_REG_RXM1SIDH 0x24
+#define MCP_REG_CANINTE 0x2B
+#define MCP_REG_CANINTF 0x2C
+#define MCP_REG_TXB0CTRL 0x30 // (TXB1CTRL = 0x40, TXB2CTRL = 0x50)
+#define MCP_REG_RXB0SIDH 0x61 // (RXB1SIDH = 0x71)
 
 #define MCP_MODEMASK 0xE0
 #define MCP_MODE_NORMAL 0x00
@@ -74,6 +222,12 @@ inline static void spiDeselect(void)
 #define MCP_STATUS_TX0REQ 0x04
 #define MCP_STATUS_TX1REQ 0x10
 #define MCP_STATUS_TX2REQ 0x40
+#define MCP_STATUS_TXREQ (MCP_STATUS_TX0REQ | MCP_STATUS_TX1REQ | MCP_STATUS_TX2REQ)
+
+#define MCP_CANINT_TX0 0x04
+#define MCP_CANINT_TX1 0x08
+#define MCP_CANINT_TX2 0x10
+#define MCP_CANINT_TX (MCP_CANINT_TX0 | MCP_CANINT_TX1 | MCP_CANINT_TX2)
 
 #define MCP_RXSTATUS_RXB0 0x40
 #define MCP_RXSTATUS_RXB1 0x80
@@ -83,6 +237,7 @@ inline static void spiDeselect(void)
 // See: https://www.kvaser.com/support/calculators/bit-timing-calculator/
 // TODO IMPLEMENT: User-configurable CAN speed, independent on AVR clock speed
 //                 (maybe set via a CMake variable?)
+#define MCP_CAN_RATE 1000000UL
 #if F_CPU == 16000000UL
 #   define MCP_CNF1_VAL 0x00
 #   define MCP_CNF2_VAL 0x91
@@ -110,20 +265,16 @@ inline static void mcpReadMulti(uint8_t addr, unsigned n, uint8_t outValues[stat
     spiSelect();
     spiTransfer(MCP_CMD_READ);
     spiTransfer(addr);
-    for(unsigned i = 0; i < n; i ++)
-    {
-        outValues[i] = spiTransfer(0x00);
-    }
+    spiRead(n, outValues);
     spiDeselect();
 }
 
 /// Writes to a register in the MCP CAN controller.
 inline static void mcpWrite(uint8_t addr, uint8_t value)
 {
+    const uint8_t cmd[3] = { MCP_CMD_WRITE, addr, value };
     spiSelect();
-    spiTransfer(MCP_CMD_WRITE);
-    spiTransfer(addr);
-    spiTransfer(value);
+    spiWrite(sizeof(cmd), cmd);
     spiDeselect();
 }
 
@@ -132,52 +283,75 @@ inline static void mcpWrite(uint8_t addr, uint8_t value)
 inline static void mcpWriteMulti(uint8_t addr, unsigned n, const uint8_t values[static n])
 {
     spiSelect();
-    spiTransfer(MCP_CMD_WRITE);
-    spiTransfer(addr);
-    for(unsigned i = 0; i < n; i ++)
-    {
-        spiTransfer(values[i]);
-    }
+    const uint8_t header[2] = { MCP_CMD_WRITE, addr };
+    spiWrite(sizeof(header), header);
+    spiWrite(n, values);
     spiDeselect();
 }
 
 /// Modifies specific bits of the register at `addr` in the MCP CAN controller.
 inline static void mcpModify(uint8_t addr, uint8_t mask, uint8_t value)
 {
+    const uint8_t cmd[4] = { MCP_CMD_BIT_MODIFY, addr, mask, value };
     spiSelect();
-    spiTransfer(MCP_CMD_BIT_MODIFY);
-    spiTransfer(addr);
-    spiTransfer(mask);
-    spiTransfer(value);
+    spiWrite(sizeof(cmd), cmd);
     spiDeselect();
 }
 
-/// Writes the CAN extended identifier in `id` (most significant 29 bits) in the
-/// format of the four xSIDH, xSIDL, xEID8 and xEID0 in the MCP CAN controller.
+/// Writes the CAN extended identifier in `id` (most significant 29 bits, plus
+/// IDE in bit 2 - see `cnCANSend()`) in the format of the four xSIDH, xSIDL,
+/// xEID8 and xEID0 in the MCP CAN controller.
+/// Also works for standard identifiers (IDE clear, 11-bit ID in bits 21..31),
+/// as their bits all end up in SIDH and SIDL.
 inline static void mcpPutEID(uint32_t id, uint8_t outRegs[static 4])
 {
-    outRegs[0] = (id & 0x00003FC0UL) >> 6; // ID bits 3..10 -> SIDH bits 0..7
-    outRegs[1] = MCP_RXFSIDL_EXIDE; // Set extended ID bit in SIDL
-    outRegs[1] |= (id & 0xC0000000UL) >> 30; // ID bits 27, 28 -> SIDL bits 0, 1
-    outRegs[1] |= (id & 0x00000038UL) << 2; // ID bits 0, 1, 2 -> SIDL bits 5, 6, 7
-    outRegs[2] = (id & 0x003FC000UL) >> 14; // ID bits 11..18 -> EID0 bits 0..7
-    outRegs[3] = (id & 0x3FC00000UL) >> 22; // ID bits 19..26 -> EID8 bits 0..7
+    outRegs[0] = (uint8_t)(id >> 24); // ID bits 21..28 -> SIDH bits 0..7
+    outRegs[1] = (uint8_t)((id >> 16) & 0xE0); // ID bits 18..20 -> SIDL bits 5..7
+    outRegs[1] |= (uint8_t)((id >> 19) & 0x03); // ID bits 16, 17 -> SIDL bits 0, 1
+    if(id & 0x00000004UL)
+    {
+        outRegs[1] |= MCP_RXFSIDL_EXIDE; // IDE -> extended ID bit in SIDL
+    }
+    outRegs[2] = (uint8_t)(id >> 11); // ID bits 8..15 -> EID8 bits 0..7
+    outRegs[3] = (uint8_t)(id >> 3); // ID bits 0..7 -> EID0 bits 0..7
 }
 
 /// Reads a CAN extended identifier (setting the most significant 29 bits of the
-/// return value) that have been read to `regs` in the format of the MCP CAN
-/// controller: xSIDH, xSIDL, xEID8 and xEID0.
+/// return value, plus IDE in bit 2) that have been read to `regs` in the format
+/// of the MCP CAN controller: xSIDH, xSIDL, xEID8 and xEID0.
+/// Inverse of `mcpPutEID()`.
 inline static uint32_t mcpGetEID(const uint8_t regs[static 4])
 {
     uint32_t eid = 0;
-    eid |= (uint32_t)(regs[0]) << 3; // SIDH bits 0..7 -> ID bits 3..10
-    eid |= (uint32_t)(regs[1]) << 30; // SIDL BITS 0, 1 -> ID bits 27, 28
-    eid |= (uint32_t)(regs[1]) >> 5; // SIDL bits 5, 6, 7 -> ID bits 0, 1, 2
-    eid |= (uint32_t)(regs[2]) << 14; //EID0 bits 0..7 -> ID bits 11..18
-    eid |= (uint32_t)(regs[3]) << 22; // EID8 bits 0..7 -> ID bits 19..26
+    eid |= (uint32_t)regs[0] << 24; // SIDH bits 0..7 -> ID bits 21..28
+    eid |= (uint32_t)(regs[1] & 0xE0) << 16; // SIDL bits 5..7 -> ID bits 18..20
+    eid |= (uint32_t)(regs[1] & 0x03) << 19; // SIDL bits 0, 1 -> ID bits 16, 17
+    if(regs[1] & MCP_RXFSIDL_EXIDE)
+    {
+        eid |= (uint32_t)regs[2] << 11; // EID8 bits 0..7 -> ID bits 8..15
+        eid |= (uint32_t)regs[3] << 3; // EID0 bits 0..7 -> ID bits 0..7
+        eid |= 0x00000004UL; // Extended ID bit in SIDL -> IDE
+    }
+    else
+    {
+        // Standard (11-bit) frame: the ID is all in SIDH/SIDL, as bits 21..31
+        // of the return value like bxCAN would place it; EID8, EID0 and bits
+        // 0, 1 of SIDL are meaningless
+        eid &= 0xFFE00000UL;
+    }
     return eid;
 }
 
+/// Reads the MCP CAN controller's quick status byte (`MCP_STATUS_*`).
+inline static uint8_t mcpReadStatus(void)
+{
+    spiSelect();
+    spiTransfer(MCP_CMD_READ_STATUS);
+    uint8_t status = spiTransfer(0x00);
+    spiDeselect();
+    return status;
+}
+
 /// Changes the mode of the MCP CAN controller to a different `MCP_MODE_*`.
 /// Returns true if the change happened successfully or false otherwise.
 inline static int mcpChangeMode(uint8_t newMode)
@@ -186,20 +360,25 @@ inline static int mcpChangeMode(uint8_t newMode)
     return (mcpRead(MCP_REG_CANCTRL) & MCP_MODEMASK) == newMode;
 }
 
-/// Writes the given id and mask pair to MCP CAN's filter 0.
-static void mcpSetFilter0(uint32_t id, uint32_t mask)
+/// The addresses of the MCP's RXF0SIDH..RXF5SIDH registers; RXF0 and RXF1 are
+/// RXB0's filters, RXF2..RXF5 are RXB1's.
+static const uint8_t MCP_RXF_ADDRS[6] = { 0x00, 0x04, 0x08, 0x10, 0x14, 0x18 };
+
+/// Writes `id` to the MCP's filter `rxf` (0..5) and `mask` to the mask of the
+/// RX buffer the filter belongs to. The MCP must be in configuration mode.
+static void mcpSetFilter(unsigned rxf, uint32_t id, uint32_t mask)
 {
     uint8_t regs[4];
     mcpPutEID(id, regs);
-    mcpWriteMulti(MCP_REG_RXF0SIDH, sizeof(regs), regs);
+    mcpWriteMulti(MCP_RXF_ADDRS[rxf], sizeof(regs), regs);
     mcpPutEID(mask, regs);
-    mcpWriteMulti(MCP_REG_RXM0SIDH, sizeof(regs), regs);
+    mcpWriteMulti(rxf < 2 ? MCP_REG_RXM0SIDH : MCP_REG_RXM1SIDH, sizeof(regs), regs);
 }
 
-/// Initializes the MCP CAN controller attached to SPI,
-/// setting its baud rate and filter.
+/// Initializes the MCP CAN controller attached to SPI, setting its baud rate.
+/// No message is accepted until filters are set.
 /// Returns true on success or false on error.
-static int mcpSetup(uint32_t id, uint32_t mask)
+static int mcpSetup(void)
 {
     // Reset the CAN chip and wait a bit until it restarts
     spiSelect();
@@ -217,11 +396,19 @@ static int mcpSetup(uint32_t id, uint32_t mask)
     mcpWrite(MCP_REG_CNF2, MCP_CNF2_VAL);
     mcpWrite(MCP_REG_CNF3, MCP_CNF3_VAL);
 
-    // Apply filter id & mask to MCP's CAN filter 0.
-    mcpSetFilter0(id, mask);
+    // After a reset, masks are all zero (i.e. accept any message); make all
+    // filters match only an (unused) id instead, until they are set.
+    for(unsigned rxf = 0; rxf < sizeof(MCP_RXF_ADDRS); rxf ++)
+    {
+        mcpSetFilter(rxf, 0xFFFFFFFCUL, 0xFFFFFFFCUL);
+    }
+
+    // NOTE: RXB0CTRL and RXB1CTRL should be 0x00 after the reset that was
+    // issued - i.e. set to use filters to filter ingoing messages, no rollover
+    // (data lane messages never end up in RXB1), no RTR
 
-    // NOTE: RXB0CTRL should be 0x00 after the reset that was issued - i.e. set
-    // to use filter 0 to filter ingoing messages, no rollover, no RTR
+    // Pull the interrupt pin low whenever a TX buffer becomes empty
+    mcpWrite(MCP_REG_CANINTE, MCP_CANINT_TX);
 
     return mcpChangeMode(MCP_MODE_NORMAL);
 }
@@ -229,151 +416,384 @@ static int mcpSetup(uint32_t id, uint32_t mask)
 
 static int inited = 0;
 
-int cnCANInit(uint32_t id, uint32_t mask)
+/// The mode the MCP runs in outside of configuration mode: `MCP_MODE_NORMAL`,
+/// or `MCP_MODE_LOOPBACK` (see `cnCANSetLoopback()`).
+static uint8_t runMode = MCP_MODE_NORMAL;
+
+/// The id and mask last passed to `cnCANInit()`.
+static uint32_t filterId = 0, filterMask = 0;
+
+/// Messages queued by `cnCANSend()`, waiting for a free TX buffer.
+static CNcanFrame txFrames[CN_CAN_TXQ_LEN];
+static CNcanQueue txQueue = CN_CAN_QUEUE_INIT(txFrames);
+
+/// The priority (TXP) to give to the next message loaded into a TX buffer, plus one.
+/// The MCP sends pending TX buffers by priority first and buffer number second;
+/// to send messages in the order they were queued in, each message loaded while
+/// others are pending gets a strictly lower priority. After a message gets
+/// priority 0, no more are loaded until all TX buffers are empty again.
+static uint8_t txNextPrio = 4;
+
+/// Loads `frame` into TX buffer `mailboxId` with priority `prio`, then
+/// requests it to be sent out.
+static void mcpLoadTx(uint8_t mailboxId, uint8_t prio, const CNcanFrame *frame)
 {
-    if(!inited)
+    mcpWrite(MCP_REG_TXB0CTRL + (uint8_t)(mailboxId << 4), prio);
+
+    uint8_t buffer[6];
+
+    // buffer[0] = command
+    buffer[0] = MCP_CMD_LOAD_TXBUF | (uint8_t)(mailboxId << 1);
+
+    // buffer[1..4] = TXB_SIDH, SIDL, EID8, EID0
+    mcpPutEID(frame->id, buffer + 1);
+
+    // buffer[5] = DLC
+    buffer[5] = frame->len;
+    if(frame->id & CN_CAN_RTR)
     {
-        // MOSI, SCK and CS as outputs; CS=hi
-        SPI_PORT |= CS_PIN;
-        SPI_DDR |= MOSI_PIN | SCK_PIN | CS_PIN;
+        buffer[5] |= MCP_BDLC_RTR;
+    }
 
-        // SPI enabled in master mode, CPHA=0, CPOL=0, MSB first, frequency=fOSC/2
-        SPCR = (1 << SPE) | (1 << MSTR);
-        SPSR |= (1 << SPI2X);
+    // Write destination id, data length code and only the `len` bytes of
+    // payload that are actually used, all in one go
+    spiSelect();
+    spiWrite(sizeof(buffer), buffer);
+    spiWrite(frame->len, frame->data);
+    spiDeselect();
 
-        inited = mcpSetup(id, mask);
-        return inited;
+    // Request the written-to mailbox to be sent out
+    spiSelect();
+    spiTransfer(MCP_CMD_RTS | (uint8_t)(0x01 << mailboxId));
+    spiDeselect();
+}
+
+/// Moves as many queued messages as possible to free TX buffers.
+/// Must be called with interrupts disabled.
+static void txDrain(void)
+{
+    uint8_t status = mcpReadStatus();
+    if(!(status & MCP_STATUS_TXREQ))
+    {
+        txNextPrio = 4;
     }
-    else
+
+    const CNcanFrame *frame;
+    while(txNextPrio > 0 && (frame = cnCANQueueFront(&txQueue)))
     {
-        // Just change filters
-        if(!mcpChangeMode(MCP_MODE_CONFIG))
+        uint8_t mailboxId;
+        if(!(status & MCP_STATUS_TX0REQ))
         {
-            return 0;
+            mailboxId = 0;
+        }
+        else if(!(status & MCP_STATUS_TX1REQ))
+        {
+            mailboxId = 1;
+        }
+        else if(!(status & MCP_STATUS_TX2REQ))
+        {
+            mailboxId = 2;
+        }
+        else
+        {
+            // No TX mailbox free; `INT0_vect` will resume draining later
+            break;
         }
-        mcpSetFilter0(id, mask);
-        return mcpChangeMode(MCP_MODE_NORMAL);
+
+        txNextPrio --;
+        mcpLoadTx(mailboxId, txNextPrio, frame);
+        status |= (uint8_t)(MCP_STATUS_TX0REQ << (mailboxId << 1));
+        cnCANQueuePop(&txQueue);
     }
 }
 
-int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len])
+/// Triggered by the MCP CAN controller when a TX buffer becomes empty.
+ISR(INT0_vect)
 {
-    len = len > 8 ? len : 8; // Cap length to maximum
-
-    // Check if any transmission mailbox is free
-    spiSelect();
-    spiTransfer(MCP_CMD_READ_STATUS);
-    uint8_t status = spiTransfer(0x00);
-    spiDeselect();
+    mcpModify(MCP_REG_CANINTF, MCP_CANINT_TX, 0x00); // Acknowledge the interrupt
+    txDrain();
+}
 
-    uint8_t mailboxId;
-    if(!(status & MCP_STATUS_TX0REQ))
+int cnCANInit(uint32_t id, uint32_t mask)
+{
+    if(!inited)
     {
-        mailboxId = 0;
+        // CS as output; CS=hi
+        CS_PORT |= CS_PIN;
+        CS_DDR |= CS_PIN;
+        spiInit();
+
+        inited = mcpSetup();
+
+        // INT0 triggers on low level, as the MCP keeps its interrupt pin low
+        // until all its interrupt flags are cleared
+        EICRA &= ~((1 << ISC01) | (1 << ISC00));
+        EIMSK |= (1 << INT0);
+        sei();
+
+        if(!inited)
+        {
+            return 0;
+        }
     }
-    else if(!(status & MCP_STATUS_TX1REQ))
+
+    filterId = id;
+    filterMask = mask;
+    return cnCANSetFilter(CN_CAN_LANE_CONTROL, 0, id, mask);
+}
+
+int cnCANSetFilter(unsigned lane, unsigned n, uint32_t id, uint32_t mask)
+{
+    // RXF0..RXF1 are the data lane's (RXB0), RXF2..RXF5 the control lane's (RXB1)
+    unsigned rxf;
+    if(lane == CN_CAN_LANE_DATA && n < CN_CAN_DATA_FILTERS)
     {
-        mailboxId = 1;
+        rxf = n;
     }
-    else if(!(status & MCP_STATUS_TX2REQ))
+    else if(lane == CN_CAN_LANE_CONTROL && n < CN_CAN_CONTROL_FILTERS)
     {
-        mailboxId = 2;
+        rxf = CN_CAN_DATA_FILTERS + n;
     }
     else
     {
-        // No TX mailbox free = can't send any message
-        return -1;
+        return 0;
     }
 
-    uint8_t buffer[13];
+    // Filters can only be changed in configuration mode
+    int changed = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if(mcpChangeMode(MCP_MODE_CONFIG))
+        {
+            mcpSetFilter(rxf, id, mask);
+            changed = mcpChangeMode(runMode);
+        }
+    }
+    return changed;
+}
 
-    // buffer[0..3] = TXB_SIDH, SIDL, EID8, EID0
-    mcpPutEID(id, buffer);
+int cnCANSetLoopback(int on)
+{
+    int changed = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // (going through configuration mode, like when filters are changed)
+        runMode = on ? MCP_MODE_LOOPBACK : MCP_MODE_NORMAL;
+        changed = inited && mcpChangeMode(MCP_MODE_CONFIG) && mcpChangeMode(runMode);
+    }
+    return changed;
+}
 
-    // buffer[4] = DLC
-    buffer[4] = (uint8_t)len;
-    if(id & CN_CAN_RTR)
+int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len])
+{
+    // Queue full: wait for `INT0_vect` to make room, but give up eventually if
+    // messages can't be sent (i.e. no one ACKs them)
+    CNcanFrame *frame;
+    for(uint32_t spins = 0; !(frame = cnCANQueueBack(&txQueue)); spins ++)
     {
-        buffer[4] |= MCP_BDLC_RTR;
+        if(spins >= 100000UL)
+        {
+            return -1;
+        }
     }
 
-    // buffer[5..12] = payload
+    len = len <= 8 ? len : 8; // Cap length to maximum
+    frame->id = id;
+    frame->len = (uint8_t)len;
     for(unsigned i = 0; i < len; i ++)
     {
-        buffer[5 + i] = data[i];
+        frame->data[i] = data[i];
     }
 
-    // Write destination id, data length code and data all in one go
-    spiSelect();
-    spiTransfer(MCP_CMD_LOAD_TXBUF | (uint8_t)(mailboxId << 1));
-    for(unsigned i = 0; i < sizeof(buffer); i ++)
+    // Queue the message, then send it out right away if a TX buffer is free
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        spiTransfer(buffer[i]);
+        cnCANQueuePush(&txQueue);
+        txDrain();
     }
-    spiDeselect();
-
-    // Request the written-to mailbox to be sent out
-    spiSelect();
-    spiTransfer(MCP_CMD_RTS | (uint8_t)(0x01 << mailboxId));
-    spiDeselect();
 
     return (int)len;
 }
 
-int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+void cnCANFlush(void)
 {
-    // Check if any receiver mailbox is full; give precedence to mailbox 0 over 1
+    // Give up eventually if messages can't be sent (i.e. no one ACKs them)
+    for(uint32_t spins = 0; spins < 100000UL; spins ++)
+    {
+        uint8_t status;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            status = mcpReadStatus();
+        }
+        if(cnCANQueueEmpty(&txQueue) && !(status & MCP_STATUS_TXREQ))
+        {
+            break;
+        }
+    }
+}
+
+/// The RX buffer of the message last returned by `cnCANPeek()` (0 for RXB0,
+/// 1 for RXB1), or -1 if none.
+static int8_t peekedRxb = -1;
+
+/// The payload length of the message in `peekedRxb`.
+static uint8_t peekedLen = 0;
+
+/// Implements `cnCANPeek()`; must be called with interrupts disabled.
+static int mcpPeek(uint32_t *recvId)
+{
+    // Check if any receiver mailbox is full
     spiSelect();
     spiTransfer(MCP_CMD_RX_STATUS);
     uint8_t rxStatus = spiTransfer(0x00);
     spiDeselect();
 
-    uint8_t rxMailboxId;
-    if(rxStatus & MCP_RXSTATUS_RXB0)
+    // Control lane (RXB1) first, data lane (RXB0) second
+    if(rxStatus & MCP_RXSTATUS_RXB1)
     {
-        rxMailboxId = 0;
+        peekedRxb = 1;
     }
-    else if(rxStatus & MCP_RXSTATUS_RXB1)
+    else if(rxStatus & MCP_RXSTATUS_RXB0)
     {
-        rxMailboxId = 1;
+        peekedRxb = 0;
     }
     else
     {
         // No pending message
+        peekedRxb = -1;
+        return -1;
+    }
+
+    // [0..3] = RXB_SIDH, SIDL, EID8, EID0; [4] = DLC (incl. RTR bit)
+    // (a plain READ, unlike READ RX BUFFER, leaves the mailbox full)
+    uint8_t regs[5];
+    mcpReadMulti((uint8_t)(MCP_REG_RXB0SIDH + (peekedRxb << 4)), sizeof(regs), regs);
+    uint32_t id = mcpGetEID(regs);
+    if(regs[4] & MCP_BDLC_RTR)
+    {
+        id |= CN_CAN_RTR;
+    }
+    if(recvId)
+    {
+        *recvId = id;
+    }
+
+    unsigned len = regs[4] & 0x0F;
+    peekedLen = (uint8_t)(len <= 8 ? len : 8);
+    return peekedLen;
+}
+
+/// Implements `cnCANRecvInto()`; must be called with interrupts disabled.
+static int mcpRecvInto(unsigned maxLen, uint8_t data[maxLen])
+{
+    if(peekedRxb < 0 && mcpPeek(0) < 0)
+    {
         return -1;
     }
 
-    // Read all mailbox registers in one go
+    // Read the payload straight from RXBnD0 onwards; only read the bytes that
+    // are needed
     spiSelect();
-    spiTransfer(MCP_CMD_READ_RXBUF | (uint8_t)(rxMailboxId << 1));
+    spiTransfer(MCP_CMD_READ_RXBUF | MCP_READ_RXBUF_D0 | (uint8_t)(peekedRxb << 2));
+    unsigned len = peekedLen < maxLen ? peekedLen : maxLen;
+    spiRead(len, data);
+    spiDeselect(); // (RXnIF in CANINTF is cleared automatically, marking the mailbox as read)
 
-    // [0..3] = RXB_SIDH, SIDL, EID8, EID0
-    uint8_t regs[4];
-    for(unsigned i = 0; i < sizeof(regs); i ++)
+    peekedRxb = -1;
+    return (int)len;
+}
+
+int cnCANPeek(uint32_t *recvId)
+{
+    // (the MCP is also accessed by `INT0_vect`)
+    int len;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        regs[i] = spiTransfer(0x00);
+        len = mcpPeek(recvId);
     }
-    if(recvId)
+    return len;
+}
+
+int cnCANRecvInto(unsigned maxLen, uint8_t data[maxLen])
+{
+    int len;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        *recvId = mcpGetEID(regs);
+        len = mcpRecvInto(maxLen, data);
     }
+    return len;
+}
 
-    // [4] = DLC (incl. RTR bit)
-    uint8_t dlc = spiTransfer(0x00);
-    if((dlc & MCP_BDLC_RTR) && recvId)
+int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+{
+    int len;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        *recvId |= CN_CAN_RTR;
+        len = mcpPeek(recvId) >= 0 ? mcpRecvInto(maxLen, data) : -1;
     }
-    unsigned recvdLen = dlc & 0x0F;
+    return len;
+}
 
-    // [5..(5+dataLen)] = payload
-    unsigned len = 0;
-    for(len = 0; len < recvdLen && len < maxLen; len ++)
+void cnCANHandoff(volatile struct CNhandoff *handoff)
+{
+    // Stop the MCP from pulling its interrupt pin low and disable INT0; the
+    // user program sets up its own interrupts
+    int up = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        data[len] = spiTransfer(0x00);
+        EIMSK &= ~(1 << INT0);
+        if(inited && mcpChangeMode(MCP_MODE_CONFIG))
+        {
+            // Leave only the filter described by the record in effect (control
+            // filter 0, in RXB1): the data lane's filters match an unused id
+            // again, and the other control filters - which share RXB1's mask -
+            // become copies of it
+            for(unsigned rxf = 0; rxf < sizeof(MCP_RXF_ADDRS); rxf ++)
+            {
+                if(rxf < CN_CAN_DATA_FILTERS)
+                {
+                    mcpSetFilter(rxf, 0xFFFFFFFCUL, 0xFFFFFFFCUL);
+                }
+                else
+                {
+                    mcpSetFilter(rxf, filterId, filterMask);
+                }
+            }
+            mcpWrite(MCP_REG_CANINTE, 0x00);
+            mcpWrite(MCP_REG_CANINTF, 0x00); // (also drops any message still in RXB0/RXB1)
+            up = mcpChangeMode(MCP_MODE_NORMAL);
+        }
     }
 
-    spiDeselect(); // (RXnIF in CANINTF is cleared automatically, marking the mailbox as read)
+    handoff->sysClockHz = F_CPU;
+    handoff->canClockHz = F_CPU; // (the MCP runs at the same clock as the AVR)
+    handoff->canRate = MCP_CAN_RATE;
+    handoff->canBitTiming = MCP_CNF1_VAL
+                            | ((uint32_t)MCP_CNF2_VAL << 8)
+                            | ((uint32_t)MCP_CNF3_VAL << 16);
+    handoff->canFilterId = filterId;
+    handoff->canFilterMask = filterMask;
+    handoff->devIdFlags = up ? CN_HANDOFF_CAN_UP : 0;
+}
 
-    return (int)len;
+void cnCANDeinit(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        EIMSK &= ~(1 << INT0);
+        EICRA &= ~((1 << ISC01) | (1 << ISC00));
+
+        // Resetting the MCP puts it back in configuration mode (off the bus),
+        // with all of its registers at their default values
+        spiSelect();
+        spiTransfer(MCP_CMD_RESET);
+        spiDeselect();
+        runMode = MCP_MODE_NORMAL;
+
+        spiDeinit();
+
+        // CS as input, but keep its pull-up so that the MCP stays deselected
+        CS_DDR &= ~CS_PIN;
+    }
+    inited = 0;
 }
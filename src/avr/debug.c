@@ -23,3 +23,13 @@ void cnDebugLed(int on)
     // Onboard LED not present.
     CN_UNUSED(on);
 }
+
+#if CN_WITH_STARTUP_BENCH
+
+void cnDebugBenchStamp(unsigned n)
+{
+    // No free-running counter to measure with.
+    CN_UNUSED(n);
+}
+
+#endif // CN_WITH_STARTUP_BENCH
@@ -7,23 +7,62 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "common/flash.h"
 
+#include <avr/io.h>
 #include <avr/boot.h>
 #include <avr/eeprom.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
-// FIXME: Values are hardcoded for ATMega328p!
-#define FLASH_SIZE 0x8000 // 32kB
+// Flash geometry comes from the part being compiled for (`-mmcu`)
+#define FLASH_SIZE ((CNflashAddr)FLASHEND + 1u)
 
-uintptr_t cnFlashSize(void)
+#if CN_FLASH_PAGE_SIZE != SPM_PAGESIZE
+#   error "CN_FLASH_PAGE_SIZE does not match the page size of the part (SPM_PAGESIZE)"
+#endif
+
+// Parts with more than 64kB of flash (e.g. ATMega2560) address it with RAMPZ
+// as the high byte of the Z pointer, for both SPM and ELPM
+#if FLASHEND > 0xFFFF
+#   define FLASH_FAR 1
+#endif
+
+// EEPROM layout: byte 0x00 is the device id, bytes 0x01..0x0C the unique id
+// (serial number), the page journal starts at 0x10.
+// Erased EEPROM reads as all ones, so an erased journal has no image and no
+// committed pages; committing page `n` clears bit `n % 8` of `marks[n / 8]`.
+#define EEPROM_DEVID_ADDR ((const uint8_t *)0x00)
+#define EEPROM_UID_ADDR ((const uint8_t *)0x01)
+#define EEPROM_JOURNAL_ADDR 0x10
+
+#if CN_WITH_JOURNAL
+
+struct Journal
+{
+    uint32_t imageId;
+    uint8_t marks[FLASH_SIZE / CN_FLASH_PAGE_SIZE / 8];
+    uint16_t digestPages; ///< 0xFFFF if no digest is stored.
+    uint8_t digest[CN_SHA256_SIZE];
+};
+#define JOURNAL ((struct Journal *)EEPROM_JOURNAL_ADDR)
+
+#endif // CN_WITH_JOURNAL
+
+
+CNflashAddr cnFlashStart(void)
+{
+    return 0x0000;
+}
+
+CNflashAddr cnFlashSize(void)
 {
     return FLASH_SIZE;
 }
 
-int cnFlashPageWriteable(uintptr_t addr)
+int cnFlashPageWriteable(CNflashAddr addr)
 {
     // On AVR the application goes from 0x0000 to the start of the bootloader;
     // the bootloader is at the end of flash.
-    return (addr + CN_FLASH_PAGE_SIZE) < (FLASH_SIZE - CN_FLASH_BOOTLOADER_SIZE);
+    return (addr + CN_FLASH_PAGE_SIZE) <= (FLASH_SIZE - CN_FLASH_BOOTLOADER_SIZE);
 }
 
 /// A software "lock" for flash memory.
@@ -37,24 +76,136 @@ int cnFlashUnlock(void)
     return 1;
 }
 
+static void waitForFlash(void);
+
 int cnFlashLock(void)
 {
+    waitForFlash(); // (let the last page write finish)
     flashLocked = 1;
     return 1;
 }
 
 /// The address of the page currently being programmed.
-static uintptr_t curPageAddr = 0;
+static CNflashAddr curPageAddr = 0;
+
+/// Set to true between `cnFlashBeginWrite()` and `cnFlashEndWrite()`.
+/// (`curPageAddr` can't be used for this, as 0x0000 is a valid page address)
+static int writing = 0;
+
+// Page writes are asynchronous: `cnFlashEndWrite()` only starts erasing the
+// page, then the SPM_READY ISR writes it and re-enables the RWW section, each
+// step being started when the previous one is done (~4ms each for erase and
+// write). The bootloader runs from the NRWW section, so meanwhile it keeps
+// receiving the next page - only reading the RWW section (the user program)
+// and EEPROM, or filling the temporary page buffer, has to wait.
+// The SPM_READY ISR only runs if the vector table was moved to the bootloader
+// section (see avr/startup.c; checked after each build by CheckVectors.cmake),
+// otherwise `waitForFlash()` would wait forever.
+// The page is journaled by the main code once the write is done, the next time
+// it waits for flash: EEPROM writes take ~3.4ms per byte, too long to spend in
+// the ISR, and would race with the EEPROM accesses of the main code.
+
+/// The steps of an asynchronous page write.
+enum
+{
+    SPM_IDLE, ///< No page write in progress.
+    SPM_ERASE, ///< Erasing `spmPageAddr`.
+    SPM_WRITE, ///< Writing the temporary page buffer to `spmPageAddr`.
+    SPM_RWW_ENABLE, ///< Re-enabling the RWW section.
+};
+
+/// The current step of the asynchronous page write.
+static volatile uint8_t spmStep = SPM_IDLE;
+
+/// The page being written asynchronously.
+static CNflashAddr spmPageAddr = 0;
+
+#if CN_WITH_JOURNAL
+
+/// The page to journal when the asynchronous page write is done, or -1.
+/// (pages are only journaled once they are actually in flash)
+static int16_t spmPendingMark = -1;
+
+static void markPage(unsigned page);
+
+#endif // CN_WITH_JOURNAL
+
+/// Starts the SPM operation `spmcsr` (some `__BOOT_*` bits) on the page at
+/// `addr`, with the SPM_READY interrupt enabled to signal its completion.
+/// Interrupts must be disabled: SPM has to follow the write to SPMCSR within
+/// 4 cycles.
+inline static void spmAsync(uint8_t spmcsr, CNflashAddr addr)
+{
+#ifdef FLASH_FAR
+    // (the SPM_READY ISR saves RAMPZ, as it uses Z)
+    RAMPZ = (uint8_t)(addr >> 16);
+#endif
+    __asm__ __volatile__("sts %0, %1\n\t"
+                         "spm\n\t"
+                         : // (no outputs)
+                         : "i"(_SFR_MEM_ADDR(__SPM_REG)),
+                           "r"((uint8_t)(spmcsr | _BV(SPMIE))),
+                           "z"((uint16_t)addr));
+}
+
+ISR(SPM_READY_vect)
+{
+    switch(spmStep)
+    {
+    case SPM_ERASE:
+        spmStep = SPM_WRITE;
+        spmAsync(__BOOT_PAGE_WRITE, spmPageAddr);
+        break;
+
+    case SPM_WRITE:
+        spmStep = SPM_RWW_ENABLE;
+        spmAsync(__BOOT_RWW_ENABLE, 0);
+        break;
+
+    default:
+        // Page write done; SPM_READY would keep firing while SPMIE is set
+        SPMCSR = 0;
+        spmStep = SPM_IDLE;
+        break;
+    }
+}
+
+/// Waits for the asynchronous page write in progress, if any, to be done, then
+/// journals the page if `cnJournalMark()` was called meanwhile.
+/// Must be called before any EEPROM access.
+static void waitForFlash(void)
+{
+    while(spmStep != SPM_IDLE) { }
+#if CN_WITH_JOURNAL
+    if(spmPendingMark >= 0)
+    {
+        // (EEPROM is idle: it is never written while SPM is in progress)
+        markPage((unsigned)spmPendingMark);
+        spmPendingMark = -1;
+    }
+#endif
+}
 
-int cnFlashBeginWrite(uintptr_t addr)
+int cnFlashBeginWrite(CNflashAddr addr)
 {
+    // The temporary page buffer is in use until the previous page is written,
+    // and filling it while EEPROM is being written (by a journal mark) could
+    // discard it
+    waitForFlash();
+    eeprom_busy_wait();
+
+    // Clear any leftover from the temporary page buffer, so that all words
+    // that will not be filled in are 0xFFFF
+    boot_rww_enable_safe();
+
     curPageAddr = addr;
+    writing = 1;
     return 1;
 }
 
 unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
 {
-    if(!curPageAddr)
+    if(!writing)
     {
         // `cnFlashBeginWrite()` has not been called
         return 0;
@@ -64,7 +215,10 @@ unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
     // at a time; MSB is written to the highest address, LSB to the lowest.
     const uint16_t *src = (const uint16_t *)data;
 
-    unsigned bytesWritten, addr = curPageAddr + offset; // Byte address where to write in flash
+    // (only the offset into the page matters to the page buffer, so the low 16
+    // bits of the address do)
+    unsigned bytesWritten;
+    uint16_t addr = (uint16_t)(curPageAddr + offset); // Byte address where to write in flash
     for(bytesWritten = 0;
         bytesWritten < size && (bytesWritten + offset) < CN_FLASH_PAGE_SIZE;
         bytesWritten += 2, addr += 2)
@@ -78,30 +232,168 @@ unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
 
 int cnFlashEndWrite(void)
 {
-    if(!curPageAddr || flashLocked)
+    if(!writing || flashLocked)
     {
         // `cnFlashBeginWrite()` has not been called or flash is locked
         return 0;
     }
 
-    // Disable interrupts for safety
+    // Start copying the bootloader temporary page buffer to the target page;
+    // the SPM_READY ISR takes it from there
+    eeprom_busy_wait(); // (SPM can not start while EEPROM is being written)
     uint8_t sregBak = SREG;
     cli();
+    spmPageAddr = curPageAddr;
+    spmStep = SPM_ERASE;
+    spmAsync(__BOOT_PAGE_ERASE, curPageAddr);
+    SREG = sregBak;
+
+    writing = 0;
+    return 1;
+}
+
+void cnFlashRead(CNflashAddr addr, unsigned len, uint8_t out[len])
+{
+    // The RWW section reads as garbage after a page erase/write, until it is
+    // re-enabled (which `cnFlashBeginWrite()` and page writes also do, so there
+    // is no need to - and it would be wrong to - clear the page buffer while
+    // writing)
+    waitForFlash();
+    if(!writing && boot_rww_busy())
+    {
+        boot_rww_enable_safe();
+    }
+    for(unsigned i = 0; i < len; i ++)
+    {
+#ifdef FLASH_FAR
+        out[i] = pgm_read_byte_far(addr + i);
+#else
+        out[i] = pgm_read_byte((uint16_t)(addr + i));
+#endif
+    }
+}
+
+#if CN_WITH_JOURNAL
+
+uint32_t cnJournalImageId(void)
+{
+    waitForFlash(); // (EEPROM may be written by a pending journal mark)
+    return eeprom_read_dword(&JOURNAL->imageId);
+}
+
+int cnJournalReset(uint32_t imageId)
+{
+    if(flashLocked)
+    {
+        return 0;
+    }
+
+    // EEPROM must not be written to while a SPM operation is in progress
+    // NOTE: Writing to EEPROM also discards the temporary page buffer!
+    waitForFlash();
 
-    // Copy the bootloader temporary page buffer to the target page
-    boot_page_erase_safe(curPageAddr);
-    boot_page_write_safe(curPageAddr);
+    // Drop the old image id first, so that a reset that gets interrupted
+    // leaves an empty journal behind instead of stale marks
+    eeprom_update_dword(&JOURNAL->imageId, CN_JOURNAL_NO_IMAGE);
+    for(unsigned i = 0; i < sizeof(JOURNAL->marks); i ++)
+    {
+        eeprom_update_byte(&JOURNAL->marks[i], 0xFF);
+    }
+    eeprom_update_word(&JOURNAL->digestPages, 0xFFFF);
+    eeprom_update_dword(&JOURNAL->imageId, imageId);
+    return 1;
+}
+
+/// Clears the journal mark of `page`, starting an EEPROM write.
+static void markPage(unsigned page)
+{
+    uint8_t marks = eeprom_read_byte(&JOURNAL->marks[page / 8]);
+    marks &= ~(uint8_t)(1 << (page % 8));
+    eeprom_update_byte(&JOURNAL->marks[page / 8], marks);
+}
 
-    // Re-enable interrupts
+int cnJournalMark(unsigned page)
+{
+    if(page >= sizeof(JOURNAL->marks) * 8 || flashLocked)
+    {
+        return 0;
+    }
+
+    // If the page is still being written, leave it to `waitForFlash()` to
+    // journal it when done (which also keeps EEPROM and SPM from overlapping)
+    uint8_t sregBak = SREG;
+    cli();
+    int pending = spmStep != SPM_IDLE;
+    if(pending)
+    {
+        spmPendingMark = (int16_t)page;
+    }
     SREG = sregBak;
 
-    curPageAddr = 0;
+    if(!pending)
+    {
+        waitForFlash(); // (journals the page before, if still pending)
+        markPage(page);
+    }
+    return 1;
+}
+
+int cnJournalMarked(unsigned page)
+{
+    if(page >= sizeof(JOURNAL->marks) * 8)
+    {
+        return 0;
+    }
+    waitForFlash();
+    uint8_t marks = eeprom_read_byte(&JOURNAL->marks[page / 8]);
+    return !(marks & (1 << (page % 8)));
+}
+
+#if CN_WITH_DIGEST
+
+int cnJournalSetDigest(unsigned nPages, const uint8_t digest[static CN_SHA256_SIZE])
+{
+    if(flashLocked)
+    {
+        return 0;
+    }
+
+    waitForFlash();
+
+    // Invalidate the old digest first, so that an interrupted update does not
+    // leave a digest behind that does not match its page count
+    eeprom_update_word(&JOURNAL->digestPages, 0xFFFF);
+    eeprom_update_block(digest, JOURNAL->digest, CN_SHA256_SIZE);
+    eeprom_update_word(&JOURNAL->digestPages, (uint16_t)nPages);
     return 1;
 }
 
+unsigned cnJournalDigest(uint8_t outDigest[static CN_SHA256_SIZE])
+{
+    waitForFlash();
+    uint16_t nPages = eeprom_read_word(&JOURNAL->digestPages);
+    if(nPages == 0xFFFF)
+    {
+        return 0;
+    }
+    eeprom_read_block(outDigest, JOURNAL->digest, CN_SHA256_SIZE);
+    return nPages;
+}
+
+#endif // CN_WITH_DIGEST
+
+#endif // CN_WITH_JOURNAL
+
 uint8_t cnReadDevId(void)
 {
-    return eeprom_read_byte((const uint8_t *)0x00);
+    waitForFlash();
+    return eeprom_read_byte(EEPROM_DEVID_ADDR);
+}
+
+void cnReadUid(uint8_t outUid[static CN_UID_SIZE])
+{
+    waitForFlash();
+    eeprom_read_block(outUid, EEPROM_UID_ADDR, CN_UID_SIZE);
 }
 
 
@@ -109,16 +401,19 @@ typedef void(*ResetHandler)(void);
 
 __attribute__((noreturn)) void cnJumpToProgram(void)
 {
-    // FIXME IMPLEMENT: Reset all modified registers to their default values:
-    // - Disable the debug LED GPIO pin
-    // - Disable SPI (used for the CAN chip)
-    // - Reset the timer's registers
-    //
-    // Could use the "watchdog timer reset" trick to do so.
+    // NOTE: SPI, the MCP and timer 1 are taken care of by common code before
+    //       getting here (see `cnCANHandoff()`, `cnCANDeinit()` and `cnTimerStop()`).
+    //       There is no debug LED on AVR.
 
     // Re-enable the RWW section as we have to boot from it
     boot_rww_enable_safe();
 
+    // Stop all of the bootloader's ISRs and move the vector table back to the
+    // user program's (see avr/startup.c)
+    cli();
+    MCUCR = (1 << IVCE);
+    MCUCR = 0;
+
     // See you on the other side...
     __asm__ __volatile__("JMP 0");
 
@@ -0,0 +1,20 @@
+// CANnuccia/src/avr/startup.c - AVR startup code, run before main()
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <avr/io.h>
+
+/// Moves the interrupt vector table to the start of the bootloader section,
+/// so that interrupts trigger the bootloader's ISRs and not the user program's.
+/// Placed in .init3, i.e. run by avr-libc's startup code before `main()`.
+/// NOTE: `cnJumpToProgram()` moves the vector table back.
+__attribute__((naked, used, section(".init3"))) static void moveVectorsToBoot(void)
+{
+    // IVSEL has to be written within 4 cycles of setting IVCE
+    MCUCR = (1 << IVCE);
+    MCUCR = (1 << IVSEL);
+}
@@ -14,6 +14,7 @@
 #include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/delay.h>
 
 /// The function to run on timer timeout, as set by `cnTimerStart()`.
 static CNtimeoutFunc timeoutFunc = NULL;
@@ -21,8 +22,12 @@ static CNtimeoutFunc timeoutFunc = NULL;
 /// Does the timer have to be stopped when the ISR is run?
 static int timerOneshot = 0;
 
+/// The value timer 1 counts up from, so that it overflows after the delay.
+static uint16_t timerReload = 0;
+
 ISR(TIMER1_OVF_vect)
 {
+    TCNT1 = timerReload; // (for the next period, if not oneshot)
     if(timeoutFunc)
     {
         timeoutFunc();
@@ -84,9 +89,11 @@ int cnTimerStart(uint32_t delayUs, int oneshot, CNtimeoutFunc onTimeout)
         pscId = (N_PSCS - 1);
     }
 
-    // Enable timer interrupt, set target count, set prescaler (triggering the timer)
+    // Enable timer interrupt, set target count, set prescaler (triggering the timer);
+    // the timer counts up, overflowing `cnt` ticks after `timerReload`
+    timerReload = (uint16_t)(0x10000UL - cnt);
     TIMSK1 |= (1 << TOIE1);
-    TCNT1 = (cnt & 0xFFFFUL);
+    TCNT1 = timerReload;
     TCCR1B = PSC_REGS[pscId];
     sei();
 
@@ -103,3 +110,13 @@ void cnTimerStop(void)
 
     timeoutFunc = NULL;
 }
+
+void cnDelayUs(uint16_t delayUs)
+{
+    // `_delay_us()` needs a compile-time constant; the loop overhead makes for
+    // a slightly longer delay, which is fine
+    while(delayUs --)
+    {
+        _delay_us(1);
+    }
+}
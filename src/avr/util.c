@@ -9,9 +9,8 @@
 
 #include <util/crc16.h>
 
-uint16_t cnCRC16(unsigned len, const uint8_t data[len])
+uint16_t cnCRC16Update(uint16_t crc, unsigned len, const uint8_t data[len])
 {
-    uint16_t crc = 0x0000; // (as per XModem CRC16)
     for(unsigned i = 0; i < len; i ++)
     {
         crc = _crc_xmodem_update(crc, data[i]);
@@ -0,0 +1,241 @@
+// CANnuccia/src/common/bench.c - Entry point of cn_bench, the self-benchmark firmware
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// cn_bench is flashed in place of the bootloader, on a board with no other CAN
+// node attached. It measures, on the chip it runs on:
+// - How many frames per second go through `cnCANSend()` and `cnCANRecv()`, with
+//   the CAN controller in loopback mode (see `cnCANSetLoopback()`)
+// - How many CPU cycles per byte `cnCRC16()` takes
+// - How long page erase and program take, on a scratch page: the last page
+//   writeable by the user program, whose contents are lost
+// then takes the CAN controller out of loopback mode and sends the results out
+// as `CN_CAN_MSG_BENCH_RESULT` messages (see common/can_msgs.h) once a second,
+// forever. Meanwhile, the debug LED blinks slowly if all went well or quickly
+// if frames were lost or the scratch page did not read back as written.
+
+#include "common/cc.h"
+#include "common/config.h"
+#include "common/util.h"
+#include "common/can.h"
+#include "common/can_msgs.h"
+#include "common/flash.h"
+#include "common/timer.h"
+#include "common/debug.h"
+
+#if defined(CN_PLATFORM_IS_STM32)
+#   define CPU_HZ 72000000u
+#elif defined(CN_PLATFORM_IS_AVR)
+#   ifndef F_CPU
+#       define F_CPU 16000000UL
+#   endif
+#   define CPU_HZ F_CPU
+#else
+#   define CPU_HZ 0u // (unknown; cycles per byte are reported as 0)
+#endif
+
+/// How long each throughput figure is measured for, in ms.
+#define WINDOW_MS 1000u
+
+/// The maximum number of frames sent but not received back yet.
+#define FRAMES_IN_FLIGHT 3u
+
+/// How long to wait for frames still in flight at the end of a window, in ms.
+#define DRAIN_MS 10u
+
+/// The size of the buffer to CRC16, in bytes.
+#define CRC_BUF_SIZE 128u
+
+/// The number of times the scratch page is erased and programmed.
+#define FLASH_REPS 8u
+
+/// Milliseconds since the timer was started, see `onTick()`.
+static volatile uint32_t ticksMs = 0;
+
+/// This device's id, as read from flash/EEPROM on startup.
+static uint8_t devId;
+
+/// The results, indexed by `CN_CAN_BENCH_*`.
+static uint32_t results[CN_CAN_BENCH_FIGURES];
+
+/// Data to send, CRC and program to flash.
+static uint8_t pattern[CN_FLASH_PAGE_SIZE];
+
+/// Called every millisecond by the timer.
+/// (called from the timer's ISR, which can fire while flash is busy)
+static CN_RAMFUNC void onTick(void)
+{
+    ticksMs ++;
+}
+
+/// Returns `ticksMs`; reads it until two reads agree, as the timer's ISR may
+/// change it halfway through a (non-atomic) read.
+static uint32_t now(void)
+{
+    uint32_t ms;
+    while((ms = ticksMs) != ticksMs) { }
+    return ms;
+}
+
+/// Sends 8-byte frames and receives them back for `WINDOW_MS`.
+/// Fills in `CN_CAN_BENCH_FRAMES_PER_S` and `CN_CAN_BENCH_FRAMES_LOST`.
+static void benchFrames(void)
+{
+    const uint32_t msgId = cnCANDevMask(CN_CAN_MSG_BENCH_RESULT, devId);
+    uint32_t sent = 0, received = 0, recvId;
+    uint8_t data[8];
+
+    uint32_t start = now();
+    while(now() - start < WINDOW_MS)
+    {
+        if(sent - received < FRAMES_IN_FLIGHT)
+        {
+            cnCANSend(msgId, sizeof(data), pattern);
+            sent ++;
+        }
+        if(cnCANRecv(&recvId, sizeof(data), data) >= 0)
+        {
+            received ++;
+        }
+    }
+    results[CN_CAN_BENCH_FRAMES_PER_S] = received * 1000u / WINDOW_MS;
+
+    start = now();
+    while(received < sent && now() - start < DRAIN_MS)
+    {
+        if(cnCANRecv(&recvId, sizeof(data), data) >= 0)
+        {
+            received ++;
+        }
+    }
+    results[CN_CAN_BENCH_FRAMES_LOST] = sent - received;
+}
+
+/// CRCs `CRC_BUF_SIZE` bytes at a time for `WINDOW_MS`.
+/// Fills in `CN_CAN_BENCH_CRC_BYTES_PER_S` and `CN_CAN_BENCH_CRC_CYCLES_X100`.
+static void benchCRC(void)
+{
+    volatile uint16_t crc; // (so that the CRCs are not optimized out)
+    uint32_t bytes = 0;
+    uint32_t start = now();
+    while(now() - start < WINDOW_MS)
+    {
+        crc = cnCRC16(CRC_BUF_SIZE, pattern);
+        bytes += CRC_BUF_SIZE;
+    }
+    (void)crc;
+
+    uint32_t bytesPerS = bytes * 1000u / WINDOW_MS;
+    results[CN_CAN_BENCH_CRC_BYTES_PER_S] = bytesPerS;
+    results[CN_CAN_BENCH_CRC_CYCLES_X100] = bytesPerS ? (uint32_t)((uint64_t)CPU_HZ * 100u / bytesPerS) : 0;
+}
+
+/// Returns the address of the last page writeable by the user program.
+static CNflashAddr scratchPage(void)
+{
+    CNflashAddr addr = cnFlashStart() + cnFlashSize() - CN_FLASH_PAGE_SIZE;
+    while(addr > cnFlashStart() && !cnFlashPageWriteable(addr))
+    {
+        addr -= CN_FLASH_PAGE_SIZE;
+    }
+    return addr;
+}
+
+/// Erases and programs the scratch page `FLASH_REPS` times.
+/// Fills in `CN_CAN_BENCH_ERASE_US`, `CN_CAN_BENCH_PROGRAM_US` and
+/// `CN_CAN_BENCH_FLASH_ERRORS`.
+static void benchFlash(void)
+{
+    const CNflashAddr addr = scratchPage();
+    uint32_t eraseMs = 0, programMs = 0, errors = 0;
+
+    cnFlashUnlock();
+    for(unsigned rep = 0; rep < FLASH_REPS; rep ++)
+    {
+        uint32_t t0 = now();
+        int ok = cnFlashBeginWrite(addr);
+        uint32_t t1 = now();
+        ok = ok && cnFlashFill(0, sizeof(pattern), pattern) == sizeof(pattern);
+        ok = ok && cnFlashEndWrite();
+
+        // (on AVR, pages are written in the background; reading them back
+        // waits for the write to be done)
+        uint8_t readBack[sizeof(pattern)];
+        cnFlashRead(addr, sizeof(readBack), readBack);
+        uint32_t t2 = now();
+
+        eraseMs += t1 - t0;
+        programMs += t2 - t1;
+        for(unsigned i = 0; ok && i < sizeof(pattern); i ++)
+        {
+            ok = readBack[i] == pattern[i];
+        }
+        errors += !ok;
+    }
+    cnFlashLock();
+
+    results[CN_CAN_BENCH_ERASE_US] = eraseMs * 1000u / FLASH_REPS;
+    results[CN_CAN_BENCH_PROGRAM_US] = programMs * 1000u / FLASH_REPS;
+    results[CN_CAN_BENCH_FLASH_ERRORS] = errors;
+}
+
+/// Sends all results out, one `CN_CAN_MSG_BENCH_RESULT` message each.
+static void sendResults(void)
+{
+    uint8_t data[5];
+    for(unsigned i = 0; i < CN_CAN_BENCH_FIGURES; i ++)
+    {
+        data[0] = (uint8_t)i;
+        cnWriteU32LE(data + 1, results[i]);
+        cnCANSend(cnCANDevMask(CN_CAN_MSG_BENCH_RESULT, devId), sizeof(data), data);
+    }
+}
+
+int main(void)
+{
+    devId = cnReadDevId();
+    cnDebugInit();
+    cnDebugLed(1); // (on while benchmarking)
+
+    for(unsigned i = 0; i < sizeof(pattern); i ++)
+    {
+        pattern[i] = (uint8_t)(i * 13u + 7u); // (no halfword is left erased)
+    }
+
+    // Only receive what is looped back
+    const uint32_t msgId = cnCANDevMask(CN_CAN_MSG_BENCH_RESULT, devId);
+    cnCANInit(msgId, 0xFFFFFFFEu);
+    cnCANSetLoopback(1);
+    cnTimerStart(1000, 0, onTick);
+
+    benchFrames();
+    benchCRC();
+    benchFlash();
+
+    cnCANSetLoopback(0);
+
+    // Report forever; slow blink if all went well, fast blink otherwise
+    const int failed = results[CN_CAN_BENCH_FRAMES_LOST] || !results[CN_CAN_BENCH_FRAMES_PER_S]
+                       || results[CN_CAN_BENCH_FLASH_ERRORS];
+    const uint32_t blinkMs = failed ? 100u : 500u;
+    uint32_t lastReport = now() - 1000u, lastBlink = now();
+    int led = 0;
+    for(;;)
+    {
+        if(now() - lastReport >= 1000u)
+        {
+            sendResults();
+            lastReport = now();
+        }
+        if(now() - lastBlink >= blinkMs)
+        {
+            led = !led;
+            cnDebugLed(led);
+            lastBlink = now();
+        }
+    }
+}
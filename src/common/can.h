@@ -17,26 +17,99 @@
 /// The target CAN bit rate rate.
 extern const unsigned CN_CAN_RATE;
 
+#ifndef CN_CAN_BUSES
+/// The number of CAN buses (i.e. CAN controllers) the target can talk to.
+/// Bus 0 is the one CANnuccia is programmed from; the functions below that
+/// take no `bus` act on it.
+#   define CN_CAN_BUSES 1
+#endif
+
+#ifndef CN_CAN_RXQ_LEN
+/// On STM32: the maximum number of messages received on each lane that are
+/// queued in RAM by the RX interrupts, on top of the 3 each FIFO holds.
+/// Must be a power of two, up to 128.
+#   define CN_CAN_RXQ_LEN 16
+#endif
+
+#ifndef CN_CAN_TXQ_LEN
+/// The maximum number of messages queued by `cnCANSend()`.
+/// Must be a power of two, up to 128.
+#   define CN_CAN_TXQ_LEN 8
+#endif
+
+/// Ingoing messages are received on one of two lanes, depending on which
+/// filter they match (see `cnCANSetFilter()`); each lane has its own hardware
+/// buffers, and `cnCANRecv()` always returns messages from the control lane
+/// first. This way, a burst of bulk data can not delay control messages.
+///
+/// On STM32: the control lane is bxCAN's FIFO 0, the data lane is FIFO 1.
+/// On AVR: the control lane is the MCP's RXB1, the data lane is RXB0.
+#define CN_CAN_LANE_CONTROL 0
+#define CN_CAN_LANE_DATA 1
+
+#ifndef CN_CAN_DATA_LANE_DEPTH
+/// The number of messages the data lane can hold before `cnCANRecv()` has to
+/// be called, or 0 if it is practically unlimited.
+#   if defined(CN_PLATFORM_IS_STM32)
+#       define CN_CAN_DATA_LANE_DEPTH (CN_CAN_RXQ_LEN + 3) // (RX queue + bxCAN's FIFO 1)
+#   elif defined(CN_PLATFORM_IS_LINUX)
+#       define CN_CAN_DATA_LANE_DEPTH 0 // (the socket's receive buffer)
+#   else
+#       define CN_CAN_DATA_LANE_DEPTH 1 // (the MCP's RXB0)
+#   endif
+#endif
+
+#ifndef CN_CAN_CONTROL_FILTERS
+/// The number of filters of the control lane.
+#   if defined(CN_PLATFORM_IS_AVR)
+#       define CN_CAN_CONTROL_FILTERS 4 // (the MCP's RXF2..RXF5)
+#   else
+#       define CN_CAN_CONTROL_FILTERS 5
+#   endif
+#endif
+
+/// The number of filters of the data lane.
+#define CN_CAN_DATA_FILTERS 2
+
 /// Initializes the CAN bus.
-/// `id` and `mask` will be used to setup an ingoing message filter; CAN
-/// messages will be read only if `messageId & mask == id & mask`.
-/// The highest 29 bits of `mask` mask the CAN id; the lowest 3 bits
-/// mask IDE, RTR and TXRQ.
+/// `id` and `mask` will be used to setup filter 0 of the control lane, see
+/// `cnCANSetFilter()`; no other filter is set.
 /// Returns true on success or false on error.
 ///
 /// A repeated call to `cnCANInit()` just changes the filter's (id, mask) pair,
 /// without having to reinitialize the bus.
 int cnCANInit(uint32_t id, uint32_t mask);
 
-/// Sends a CAN message.
+/// Sets (or changes) filter `n` of lane `lane` (a `CN_CAN_LANE_*`).
+/// Messages matching the filter, i.e. for which `messageId & mask == id & mask`,
+/// will be received on that lane. The highest 29 bits of `mask` mask the CAN
+/// id; the lowest 3 bits mask IDE, RTR and TXRQ.
+/// The bus must have been initialized with `cnCANInit()` beforehand.
+/// Returns true on success or false on error (e.g. `n` out of range).
+///
+/// On AVR: all filters of a lane share the same mask (the MCP only has one mask
+///         per RX buffer); the mask passed last applies to all of them.
+int cnCANSetFilter(unsigned lane, unsigned n, uint32_t id, uint32_t mask);
+
+/// Queues a CAN message for sending.
 /// `len` bytes of `data` are sent with the message; if `len > 8`, only the first
 /// 8 bytes are sent.
 /// The lowest 29 bits of `id` are the CAN id; the lowest 3 bits are IDE, RTR and
-/// unused respectively.
-/// Returns the number of bytes effectively sent, or a negative value on error.
+/// unused respectively. If IDE is clear, the id is a standard 11-bit one and
+/// only the highest 11 bits of `id` are used.
+/// Returns the number of bytes effectively queued, or a negative value on error.
+///
+/// Messages are sent in the order they were queued in, from an ISR that is
+/// triggered whenever the CAN controller has a free TX mailbox; if the queue
+/// is full, this function waits for a message to be sent before queueing. Like
+/// `cnCANFlush()`, it gives up eventually if no message can be sent (i.e. no
+/// one ACKs them), returning a negative value without queueing.
 int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len]);
 
-/// Polls for a received CAN message.
+/// Waits until all messages queued via `cnCANSend()` have been sent.
+void cnCANFlush(void);
+
+/// Polls for a received CAN message, from the control lane first.
 /// The lowest 29 bits of `*recvId` will be set to the id of the message, and
 /// up to `maxLen` bytes of its payload will be copied to `data`. The lowest 3
 /// bits of `*recvId` will be set to IDE, RTR and undefined.
@@ -44,4 +117,76 @@ int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len]);
 /// message was received or if an error occurred.
 int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen]);
 
+/// Polls for a received CAN message like `cnCANRecv()`, but only sets
+/// `*recvId` to its id without receiving it: the message stays pending until
+/// `cnCANRecvInto()` is called.
+/// Returns the length of its payload, or a negative value if no message was
+/// received or if an error occurred.
+///
+/// Together with `cnCANRecvInto()`, this lets the caller pick where the
+/// payload has to go depending on the id, so that it can be copied straight to
+/// its destination instead of going through an intermediate buffer.
+int cnCANPeek(uint32_t *recvId);
+
+/// Receives the message last returned by `cnCANPeek()`, copying up to `maxLen`
+/// bytes of its payload to `data` (which needs not be aligned in any way).
+/// If no message was peeked at, receives the next message like `cnCANRecv()`
+/// would, discarding its id.
+/// Returns the number of bytes effectively read, or a negative value if no
+/// message was received or if an error occurred.
+int cnCANRecvInto(unsigned maxLen, uint8_t data[maxLen]);
+
+/// Puts the CAN controller in loopback mode (if `on`) or back to normal mode.
+/// In loopback mode, sent messages are received back (if they match a filter)
+/// and nothing is received from the bus; used to test and benchmark a board
+/// with no other CAN node attached (see common/bench.c).
+/// The bus must have been initialized with `cnCANInit()` beforehand.
+/// Returns true on success or false on error.
+///
+/// On STM32: sets LBKM and SILM in BTR, so that nothing is sent on the bus either.
+/// On AVR: switches the MCP to its loopback mode; nothing is sent on the bus.
+/// On Linux: sent messages are still sent on the interface too.
+int cnCANSetLoopback(int on);
+
+struct CNhandoff; // (see common/handoff.h)
+
+/// Fills in the CAN-related fields of the hand-off record `handoff` (including
+/// its flags) with the current state of the CAN controller, then disables all
+/// CAN interrupts, leaving the controller running for the user program.
+void cnCANHandoff(volatile struct CNhandoff *handoff);
+
+/// Resets the CAN controller - and the pins and buses used to talk to it - to
+/// their state at chip reset. Call `cnCANInit()` again to use CAN again.
+void cnCANDeinit(void);
+
+#if CN_CAN_BUSES > 1
+
+// Multi-bus targets also implement the following, which act on any bus `bus`
+// (0..CN_CAN_BUSES-1) and otherwise work like their single-bus counterparts.
+// Bus 0 is handed off or deinitialized along with the rest of CAN, all other
+// buses are always deinitialized.
+
+/// See `cnCANInit()`.
+int cnCANBusInit(unsigned bus, uint32_t id, uint32_t mask);
+
+/// See `cnCANSetFilter()`.
+int cnCANBusSetFilter(unsigned bus, unsigned lane, unsigned n, uint32_t id, uint32_t mask);
+
+/// See `cnCANSend()`.
+int cnCANBusSend(unsigned bus, uint32_t id, unsigned len, const uint8_t data[len]);
+
+/// See `cnCANFlush()`.
+void cnCANBusFlush(unsigned bus);
+
+/// See `cnCANRecv()`.
+int cnCANBusRecv(unsigned bus, uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen]);
+
+/// See `cnCANPeek()`.
+int cnCANBusPeek(unsigned bus, uint32_t *recvId);
+
+/// See `cnCANRecvInto()`.
+int cnCANBusRecvInto(unsigned bus, unsigned maxLen, uint8_t data[maxLen]);
+
+#endif // CN_CAN_BUSES > 1
+
 #endif // CAN_H
@@ -11,6 +11,21 @@
 #include <stdint.h>
 
 
+// CN_CAN_STD_IDS can optionally be defined by the build system to use standard
+// (11-bit) CAN identifiers instead of extended (29-bit) ones. Standard frames
+// are 20 bits shorter, which is worth ~15% of the bus time of a WRITE; however,
+// only 6 bits are left for the device id there (so device ids must be in
+// 0x00..0x3E), and CANnuccia's messages take up the whole 11-bit id space.
+//
+// Either way, ids are kept in the same 32-bit word layout as bxCAN's: the CAN
+// id in the highest bits (29 for extended ids, 11 for standard ones), then IDE
+// (bit 2, set for extended ids), RTR (bit 1) and an unused bit 0.
+
+#ifndef CN_CAN_STD_IDS
+
+// Extended ids: 0xCA00n000 for master -> device and 0xCB00n000 for device ->
+// master messages, where `n` is the command. The device id is in bits 4..11.
+
 /// The CAN filter mask to use in conjunction with `CN_CAN_TX_FILTER_ID`.
 #define CN_CAN_TX_FILTER_MASK 0xFF000FFCu
 
@@ -18,6 +33,28 @@
 /// `cnCANDevMask()` a device id into this before use.
 #define CN_CAN_TX_FILTER_ID 0xCA000004u
 
+/// The CAN filter mask to use in conjunction with the `CN_CAN_*_LANE_ID*`
+/// filters; like `CN_CAN_TX_FILTER_MASK`, but also matches the top two bits of
+/// the command (bits 14, 15) and checks that bits 16..19 are zero.
+#define CN_CAN_LANE_FILTER_MASK 0xFF0FCFFCu
+
+// The CAN filters used to route outgoing (master -> device) messages to the
+// control and data lanes (see `cnCANSetFilter()`). The data lane carries the
+// commands that act on the selected page - and QUERY_JOURNAL, as it shares
+// the same top bits - which must be processed in the order they were sent in.
+// `cnCANDevMask()` a device id into these before use.
+#define CN_CAN_CONTROL_LANE_ID0 0xCA000004u // Commands 0x0..0x3
+#define CN_CAN_CONTROL_LANE_ID1 0xCA00C004u // Commands 0xC..0xF
+#define CN_CAN_DATA_LANE_ID0    0xCA004004u // Commands 0x4..0x7
+#define CN_CAN_DATA_LANE_ID1    0xCA008004u // Commands 0x8..0xB
+
+// The CAN filters used to match broadcast (master -> all devices) messages,
+// to be used with `CN_CAN_LANE_FILTER_MASK`; broadcasts always go to the
+// control lane. Broadcast messages have bit 16 set and all device id bits
+// clear; do not `cnCANDevMask()` these.
+#define CN_CAN_BROADCAST_LANE_ID0 0xCA010004u // Commands 0x0..0x3
+#define CN_CAN_BROADCAST_LANE_ID1 0xCA01C004u // Commands 0xC..0xF
+
 /// The CAN filter mask to use in conjunction with `CN_CAN_RX_FILTER_ID`.
 #define CN_CAN_RX_FILTER_MASK 0xFF000FFCu
 
@@ -28,7 +65,7 @@
 
 /// Builds a CAN ID/mask by ORing a 8-bit device address (<< 4) into a 32-bit
 /// base mask. Also sets the IDE bit (to mark a 29-bit filter, not a 11-bit one).
-inline uint32_t cnCANDevMask(uint32_t mask, uint8_t devID)
+inline static uint32_t cnCANDevMask(uint32_t mask, uint8_t devID)
 {
     return ((uint32_t)mask | ((uint32_t)devID << 4) | 0x00000004u);
 }
@@ -40,28 +77,196 @@ inline uint32_t cnCANDevMask(uint32_t mask, uint8_t devID)
 /// IDE (bit 2), RTR (bit 1) and TXRQ (bit 0) are ignored.
 #define CN_CAN_MSGID_MASK 0xFFFFF000u
 
+/// Extracts the command (bits 12..15) out of the id of a CANnuccia message,
+/// i.e. the `n` in `0xCA00n000`; the broadcast bit (16) is left out.
+/// Only valid for messages that passed the `CN_CAN_TX_FILTER_ID` filter; it is
+/// cheaper to dispatch on this byte than on the whole 32-bit id.
+#define CN_CAN_CMD(msgId) ((uint8_t)(((msgId) >> 12) & 0x0Fu))
+
+/// The id of command `n` sent by the master to a device.
+#define CN_CAN_MASTER_MSG(n) (0xCA000000u | ((uint32_t)(n) << 12))
+
+/// The id of the reply to command `n` sent by a device to the master.
+#define CN_CAN_DEVICE_MSG(n) (0xCB000000u | ((uint32_t)(n) << 12))
+
+/// The bits of a CAN id/mask that hold the device id.
+#define CN_CAN_DEV_MASK 0x00000FF0u
+
+/// Extracts the device id out of the id of a CANnuccia message.
+#define CN_CAN_DEV(msgId) ((uint8_t)((msgId) >> 4))
+
+/// Returns true if `msgId` is the id of a broadcast message.
+#define CN_CAN_IS_BROADCAST(msgId) (((msgId) & 0x00010000u) != 0)
+
+/// Turns the id of a master -> device message into the id of its broadcast
+/// version.
+#define CN_CAN_BROADCAST(msgId) ((msgId) | 0x00010004u)
+
+#else // CN_CAN_STD_IDS
+
+// Standard ids: bit 10 is the direction (0 for master -> device, 1 for device
+// -> master), bits 6..9 are the command and bits 0..5 the device id. In the
+// 32-bit word layout, that is bit 31, bits 27..30 and bits 21..26 respectively.
+
+/// The CAN filter mask to use in conjunction with `CN_CAN_TX_FILTER_ID`.
+/// Matches the direction, the device id and IDE (which must be clear).
+#define CN_CAN_TX_FILTER_MASK 0x87E00004u
+
+/// The CAN filter used to match outgoing (master -> device) messages.
+/// `cnCANDevMask()` a device id into this before use.
+#define CN_CAN_TX_FILTER_ID 0x00000000u
+
+/// The CAN filter mask to use in conjunction with the `CN_CAN_*_LANE_ID*`
+/// filters; like `CN_CAN_TX_FILTER_MASK`, but also matches the top two bits of
+/// the command (bits 29, 30).
+#define CN_CAN_LANE_FILTER_MASK 0xE7E00004u
+
+// The CAN filters used to route outgoing (master -> device) messages to the
+// control and data lanes; see the extended id variant above.
+#define CN_CAN_CONTROL_LANE_ID0 0x00000000u // Commands 0x0..0x3
+#define CN_CAN_CONTROL_LANE_ID1 0x60000000u // Commands 0xC..0xF
+#define CN_CAN_DATA_LANE_ID0    0x20000000u // Commands 0x4..0x7
+#define CN_CAN_DATA_LANE_ID1    0x40000000u // Commands 0x8..0xB
+
+// The CAN filters used to match broadcast (master -> all devices) messages;
+// see the extended id variant above. Broadcast messages are sent to device id
+// 0x3F; do not `cnCANDevMask()` these.
+#define CN_CAN_BROADCAST_LANE_ID0 0x07E00000u // Commands 0x0..0x3
+#define CN_CAN_BROADCAST_LANE_ID1 0x67E00000u // Commands 0xC..0xF
+
+/// The CAN filter mask to use in conjunction with `CN_CAN_RX_FILTER_ID`.
+#define CN_CAN_RX_FILTER_MASK 0x87E00004u
+
+/// The CAN filter used to match ingoing (device -> master) messages.
+/// `cnCANDevMask()` a device id into this before use.
+#define CN_CAN_RX_FILTER_ID 0x80000000u
+
+
+/// Builds a CAN ID/mask by ORing a 6-bit device address (<< 21) into a 32-bit
+/// base mask. IDE is left clear (to mark a 11-bit filter, not a 29-bit one).
+inline static uint32_t cnCANDevMask(uint32_t mask, uint8_t devID)
+{
+    return ((uint32_t)mask | ((uint32_t)(devID & 0x3Fu) << 21));
+}
+
+/// The CAN ID mask used to check if a message is of a certain type, i.e. if
+/// `(msgId & CN_CAN_ID_MASK) == CN_CAN_MSG_x`
+///
+/// Masks the direction and the command bits only.
+#define CN_CAN_MSGID_MASK 0xF8000000u
+
+/// Extracts the command (bits 27..30) out of the id of a CANnuccia message.
+/// Only valid for messages that passed the `CN_CAN_TX_FILTER_ID` filter.
+#define CN_CAN_CMD(msgId) ((uint8_t)(((msgId) >> 27) & 0x0Fu))
+
+/// The id of command `n` sent by the master to a device.
+#define CN_CAN_MASTER_MSG(n) ((uint32_t)(n) << 27)
+
+/// The id of the reply to command `n` sent by a device to the master.
+#define CN_CAN_DEVICE_MSG(n) (0x80000000u | ((uint32_t)(n) << 27))
+
+/// The bits of a CAN id/mask that hold the device id.
+#define CN_CAN_DEV_MASK 0x07E00000u
+
+/// Extracts the device id out of the id of a CANnuccia message.
+#define CN_CAN_DEV(msgId) ((uint8_t)(((msgId) >> 21) & 0x3Fu))
+
+/// Returns true if `msgId` is the id of a broadcast message.
+#define CN_CAN_IS_BROADCAST(msgId) (((msgId) & 0x07E00000u) == 0x07E00000u)
+
+/// Turns the id of a master -> device message into the id of its broadcast
+/// version.
+#define CN_CAN_BROADCAST(msgId) ((msgId) | 0x07E00000u)
+
+#endif // CN_CAN_STD_IDS
+
 
 // IDs of a outgoing (master -> device) CAN message. See CANnuccia specs.
-// `cnCANDevMask()` a device id into these before use. Note that the lowest 12
+// `cnCANDevMask()` a device id into these before use. Note that the device id
 // bits are unset.
-#define CN_CAN_MSG_PROG_REQ      0xCA001000u
-#define CN_CAN_MSG_PROG_DONE     0xCA002000u
-#define CN_CAN_MSG_UNLOCK        0xCA003000u
-#define CN_CAN_MSG_SELECT_PAGE   0xCA004000u
-#define CN_CAN_MSG_SEEK          0xCA005000u
-#define CN_CAN_MSG_WRITE         0xCA006000u
-#define CN_CAN_MSG_CHECK_WRITES  0xCA007000u
-#define CN_CAN_MSG_COMMIT_WRITES 0xCA008000u
+#define CN_CAN_MSG_ENUMERATE     CN_CAN_MASTER_MSG(0x0) // (broadcast only)
+#define CN_CAN_MSG_PROG_REQ      CN_CAN_MASTER_MSG(0x1)
+#define CN_CAN_MSG_PROG_DONE     CN_CAN_MASTER_MSG(0x2)
+#define CN_CAN_MSG_UNLOCK        CN_CAN_MASTER_MSG(0x3)
+#define CN_CAN_MSG_SELECT_PAGE   CN_CAN_MASTER_MSG(0x4)
+#define CN_CAN_MSG_SEEK          CN_CAN_MASTER_MSG(0x5)
+#define CN_CAN_MSG_WRITE         CN_CAN_MASTER_MSG(0x6)
+#define CN_CAN_MSG_CHECK_WRITES  CN_CAN_MASTER_MSG(0x7)
+#define CN_CAN_MSG_COMMIT_WRITES CN_CAN_MASTER_MSG(0x8)
+#define CN_CAN_MSG_QUERY_JOURNAL CN_CAN_MASTER_MSG(0x9)
+#define CN_CAN_MSG_FILL          CN_CAN_MASTER_MSG(0xA)
+#define CN_CAN_MSG_ISOTP_WRITE   CN_CAN_MASTER_MSG(0xB)
+#define CN_CAN_MSG_IDENTIFY      CN_CAN_MASTER_MSG(0xC)
+#define CN_CAN_MSG_READ_RANGE    CN_CAN_MASTER_MSG(0xD)
+#define CN_CAN_MSG_HOLD          CN_CAN_MASTER_MSG(0xE) // (usually broadcast)
+#define CN_CAN_MSG_BIND          CN_CAN_MASTER_MSG(0xF) // (broadcast only)
 
 // IDs of an ingoing (device -> master) CAN message. See CANnuccia specs.
-// `cnCANDevMask()` a device id into these before use. Note that the lowest 12
+// `cnCANDevMask()` a device id into these before use. Note that the device id
 // bits are unset.
-#define CN_CAN_MSG_PROG_REQ_RESP    0xCB001000u
-#define CN_CAN_MSG_PROG_DONE_ACK    0xCB002000u
-#define CN_CAN_MSG_UNLOCKED         0xCB003000u
-#define CN_CAN_MSG_PAGE_SELECTED    0xCB004000u
-#define CN_CAN_MSG_WRITES_CHECKED   0xCB007000u
-#define CN_CAN_MSG_WRITES_COMMITTED 0xCB008000u
+#define CN_CAN_MSG_ENUMERATE_RESP   CN_CAN_DEVICE_MSG(0x0)
+#define CN_CAN_MSG_PROG_REQ_RESP    CN_CAN_DEVICE_MSG(0x1)
+#define CN_CAN_MSG_PROG_DONE_ACK    CN_CAN_DEVICE_MSG(0x2)
+#define CN_CAN_MSG_UNLOCKED         CN_CAN_DEVICE_MSG(0x3)
+#define CN_CAN_MSG_PAGE_SELECTED    CN_CAN_DEVICE_MSG(0x4)
+#define CN_CAN_MSG_IDENTITY         CN_CAN_DEVICE_MSG(0x5)
+#define CN_CAN_MSG_BIND_ACK         CN_CAN_DEVICE_MSG(0x6)
+#define CN_CAN_MSG_WRITES_CHECKED   CN_CAN_DEVICE_MSG(0x7)
+#define CN_CAN_MSG_WRITES_COMMITTED CN_CAN_DEVICE_MSG(0x8)
+#define CN_CAN_MSG_JOURNAL          CN_CAN_DEVICE_MSG(0x9)
+#define CN_CAN_MSG_ISOTP_FLOW       CN_CAN_DEVICE_MSG(0xB)
+#define CN_CAN_MSG_IMAGE_DIGEST     CN_CAN_DEVICE_MSG(0xC)
+#define CN_CAN_MSG_RANGE_DATA       CN_CAN_DEVICE_MSG(0xD)
+#define CN_CAN_MSG_RANGE_END        CN_CAN_DEVICE_MSG(0xE)
+#define CN_CAN_MSG_BENCH_RESULT     CN_CAN_DEVICE_MSG(0xF) // (cn_bench only)
+
+/// The number of `CN_CAN_MSG_IMAGE_DIGEST` messages sent in reply to a
+/// PROG_DONE; each carries a sequence number (U8) and 7 bytes of the digest
+/// record (SHA-256 digest, number of pages it covers as a U16, flags).
+#define CN_CAN_DIGEST_MSGS 5
+
+// Flags of a digest record.
+#define CN_CAN_DIGEST_STORED  0x01 // Read back from the page journal
+#define CN_CAN_DIGEST_PARTIAL 0x02 // Pages committed before a reset not included
+
+/// The number of pages whose journal state is reported by a single
+/// `CN_CAN_MSG_JOURNAL` message.
+#define CN_CAN_JOURNAL_PAGES_PER_MSG 48
+
+// Payload (U8) of a `CN_CAN_MSG_HOLD` message.
+#define CN_CAN_HOLD_RELEASE 0x00 // Restart the bootloader timeout
+#define CN_CAN_HOLD_ENGAGE  0x01 // Stop the bootloader timeout
+
+// Operations of a `CN_CAN_MSG_BIND` message (its first byte), which binds
+// session ids to devices by their unique id (see `cnReadUid()`):
+// - SCAN: word of the unique id (U8), bit (U8), guess (U32). Devices that are
+//   not bound yet, and whose unique id matched all guesses so far, reply with
+//   a `CN_CAN_MSG_BIND_ACK` from device id `CN_CAN_BIND_SCAN_DEV` if bits
+//   bit..31 of the word match those of the guess. All replies are identical,
+//   so they do not collide. When bit 0 is matched, the device moves on to the
+//   next word. Bit `CN_CAN_BIND_SCAN_RESTART` (re)starts the scan from word 0.
+// - ASSIGN: session id (U8). The device whose whole unique id was matched
+//   takes the session id as its device id, and replies with a
+//   `CN_CAN_MSG_BIND_ACK` from it. Devices can not tell whether the session id
+//   is in use: the master has to pick one that is neither bound nor the own
+//   device id of any device on the bus that is not bound.
+// - RELEASE: all bound devices go back to their own device id.
+#define CN_CAN_BIND_SCAN    0x00
+#define CN_CAN_BIND_ASSIGN  0x01
+#define CN_CAN_BIND_RELEASE 0x02
+#define CN_CAN_BIND_SCAN_RESTART 0x80
+#define CN_CAN_BIND_SCAN_DEV     0x00
+
+// Figures reported by cn_bench (see common/bench.c), one per
+// `CN_CAN_MSG_BENCH_RESULT` message: the figure (U8), then its value (U32).
+#define CN_CAN_BENCH_FRAMES_PER_S    0x00 // 8-byte frames sent and received back per second
+#define CN_CAN_BENCH_FRAMES_LOST     0x01 // Frames sent but never received back
+#define CN_CAN_BENCH_CRC_BYTES_PER_S 0x02 // Bytes per second through `cnCRC16()`
+#define CN_CAN_BENCH_CRC_CYCLES_X100 0x03 // CPU cycles per byte through `cnCRC16()`, times 100
+#define CN_CAN_BENCH_ERASE_US        0x04 // Time to begin writing a page (`cnFlashBeginWrite()`)
+#define CN_CAN_BENCH_PROGRAM_US      0x05 // Time to fill and write a page, until flash is readable again
+#define CN_CAN_BENCH_FLASH_ERRORS    0x06 // Pages that did not read back as written
+#define CN_CAN_BENCH_FIGURES         7
 
 
 #endif // CAN_MSGS_H
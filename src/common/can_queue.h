@@ -0,0 +1,81 @@
+// CANnuccia/src/common/can_queue.h - Queues of CAN frames, shared by CAN drivers
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef CAN_QUEUE_H
+#define CAN_QUEUE_H
+
+#include <stdint.h>
+#include "common/cc.h"
+
+/// A CAN frame, as stored in a `CNcanQueue`.
+typedef struct CNcanFrame
+{
+    uint32_t id; ///< CAN id, IDE and RTR - in the same format as `cnCANSend()`'s.
+    uint8_t len; ///< Payload length, 0..8.
+    uint8_t data[8]; ///< Payload; only the first `len` bytes are meaningful.
+
+} CNcanFrame;
+
+/// A FIFO ring buffer of CAN frames.
+/// Safe to use from one producer and one consumer at a time (for example, the
+/// main loop and an ISR) without any other locking. Its functions are always
+/// inlined, so that they can be used by `CN_RAMFUNC`s.
+typedef struct CNcanQueue
+{
+    volatile uint8_t head; ///< Free-running index of the next frame to be popped.
+    volatile uint8_t tail; ///< Free-running index of the next frame to be pushed.
+    uint8_t mask; ///< Number of frames in `frames` minus one.
+    CNcanFrame *frames; ///< Storage for the frames; its size must be a power of two <= 128.
+
+} CNcanQueue;
+
+/// Initializer for a `CNcanQueue` that stores its frames in the `frames` array.
+#define CN_CAN_QUEUE_INIT(frames) \
+    { 0, 0, (uint8_t)(sizeof(frames) / sizeof((frames)[0]) - 1), (frames) }
+
+/// Returns true if `queue` holds no frames.
+inline static CN_ALWAYS_INLINE int cnCANQueueEmpty(const CNcanQueue *queue)
+{
+    return queue->head == queue->tail;
+}
+
+/// Returns the slot where the next frame is to be pushed to `queue`, or NULL
+/// if the queue is full. Fill it in then call `cnCANQueuePush()`.
+inline static CN_ALWAYS_INLINE CNcanFrame *cnCANQueueBack(CNcanQueue *queue)
+{
+    uint8_t count = (uint8_t)(queue->tail - queue->head);
+    if(count > queue->mask)
+    {
+        return 0;
+    }
+    return &queue->frames[queue->tail & queue->mask];
+}
+
+/// Pushes the frame that was filled in via `cnCANQueueBack()` to `queue`.
+inline static CN_ALWAYS_INLINE void cnCANQueuePush(CNcanQueue *queue)
+{
+    queue->tail ++;
+}
+
+/// Returns the frame at the front of `queue`, or NULL if the queue is empty.
+/// Call `cnCANQueuePop()` when done with it.
+inline static CN_ALWAYS_INLINE CNcanFrame *cnCANQueueFront(CNcanQueue *queue)
+{
+    if(cnCANQueueEmpty(queue))
+    {
+        return 0;
+    }
+    return &queue->frames[queue->head & queue->mask];
+}
+
+/// Pops the frame at the front of `queue`.
+inline static CN_ALWAYS_INLINE void cnCANQueuePop(CNcanQueue *queue)
+{
+    queue->head ++;
+}
+
+#endif // CAN_QUEUE_H
@@ -14,6 +14,29 @@
 /// Makes a function/variable reside in section `sec` (and marks it as always used).
 #define CN_SECTION(sec) __attribute__((section(sec), used))
 
+/// Makes a function run from RAM, on targets where flash can not be read
+/// while it is being erased or programmed (STM32F1): it is copied to RAM at
+/// startup, together with .data, and never inlined into code left in flash.
+/// RAM is out of range of a direct branch from flash there, so calls to it
+/// are made through a register (`long_call`) in the file it is defined in, and
+/// through the linker's long branch veneers (placed next to the caller) from
+/// the others.
+/// Functions called by a `CN_RAMFUNC` while flash is busy must be
+/// `CN_RAMFUNC`s too, or `CN_ALWAYS_INLINE`.
+#if defined(CN_PLATFORM_IS_STM32)
+#   define CN_RAMFUNC __attribute__((section(".ramfunc"), noinline, long_call))
+#else
+#   define CN_RAMFUNC
+#endif
+
+/// Makes an `inline` function always inlined, even when not optimizing; for
+/// the helpers of `CN_RAMFUNC`s, which would otherwise be emitted in flash.
+#define CN_ALWAYS_INLINE __attribute__((always_inline))
+
+/// Fails compilation if the constant expression `cond` is false; `name`
+/// describes the check. (C99 has no `_Static_assert`)
+#define CN_STATIC_ASSERT(cond, name) typedef char cnStaticAssert_##name[(cond) ? 1 : -1]
+
 /// Makes a function argument as unused.
 #define CN_UNUSED(arg) ((void)arg)
 
@@ -0,0 +1,135 @@
+// CANnuccia/src/common/config.h - Optional features of CANnuccia
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Each CN_WITH_x macro is either 1 (feature compiled in) or 0 (feature left
+// out). They can be overridden one by one by the build system (see the
+// `CN_FEATURES` CMake option); by default the features that fit in the 4kB
+// reserved to the bootloader are enabled, unless CN_MINIMAL is defined (see the
+// `CN_MINIMAL` option in the toolchain files), in which case only what is
+// needed to upload a program is. The larger features are off by default, even
+// in non-minimal builds; enabling them may need a larger bootloader section.
+
+#ifdef CN_MINIMAL
+#   define CN_WITH_DEFAULT_ 0
+#else
+#   define CN_WITH_DEFAULT_ 1
+#endif
+
+/// The persistent page journal, used to resume interrupted uploads, and the
+/// QUERY_JOURNAL command.
+#ifndef CN_WITH_JOURNAL
+#   define CN_WITH_JOURNAL CN_WITH_DEFAULT_
+#endif
+
+/// The FILL command.
+#ifndef CN_WITH_FILL
+#   define CN_WITH_FILL CN_WITH_DEFAULT_
+#endif
+
+/// The READ_RANGE command, to read flash contents back.
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_READBACK
+#   define CN_WITH_READBACK 0
+#endif
+
+/// The HOLD command, usually broadcast by the master to keep all devices in the
+/// bootloader (no timeout) during an update, then to release them.
+#ifndef CN_WITH_HOLD
+#   define CN_WITH_HOLD CN_WITH_DEFAULT_
+#endif
+
+/// The BIND command: session ids bound to devices by their unique id, for
+/// buses with more devices than device ids or with devices whose id was never
+/// provisioned.
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_BIND
+#   define CN_WITH_BIND 0
+#endif
+
+/// The debug LED, lit while the bootloader is running.
+#ifndef CN_WITH_DEBUG_LED
+#   define CN_WITH_DEBUG_LED CN_WITH_DEFAULT_
+#endif
+
+/// The hand-off record (see common/handoff.h): the clock and the CAN
+/// controller are left running for the user program, which can reuse them.
+/// Without it, all peripherals are reset before jumping to the user program.
+#ifndef CN_WITH_HANDOFF
+#   define CN_WITH_HANDOFF CN_WITH_DEFAULT_
+#endif
+
+/// The SHA-256 digest of the uploaded image, computed as pages are committed
+/// (see common/sha256.h) and reported on PROG_DONE.
+/// Needs the copy of the page in RAM, so it is not available with
+/// `CN_FLASH_DIRECT_FILL`.
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_DIGEST
+#   define CN_WITH_DIGEST 0
+#elif CN_WITH_DIGEST && defined(CN_FLASH_DIRECT_FILL)
+#   error "CN_WITH_DIGEST can not be used with CN_FLASH_DIRECT_FILL"
+#endif
+
+/// The IDENTIFY command, reporting the identity of the image last uploaded in
+/// full. Needs the page journal and the image digest, where it is recorded;
+/// on by default whenever both are.
+#ifndef CN_WITH_IDENTIFY
+#   define CN_WITH_IDENTIFY (CN_WITH_JOURNAL && CN_WITH_DIGEST)
+#elif CN_WITH_IDENTIFY && !(CN_WITH_JOURNAL && CN_WITH_DIGEST)
+#   error "CN_WITH_IDENTIFY needs CN_WITH_JOURNAL and CN_WITH_DIGEST"
+#endif
+
+/// The ISOTP_WRITE command: ISO-TP (ISO 15765-2) messages written to the
+/// selected page, so that a whole page can be sent as a single message.
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_ISOTP
+#   define CN_WITH_ISOTP 0
+#endif
+
+#if CN_WITH_ISOTP
+/// The block size (BS) advertised to ISO-TP senders: how many consecutive
+/// frames they can send before waiting for the next flow control frame.
+/// By default, as many as the data lane can hold (see
+/// `CN_CAN_DATA_LANE_DEPTH`), so that a burst can never overrun it.
+#   ifndef CN_ISOTP_BLOCK_SIZE
+#       define CN_ISOTP_BLOCK_SIZE CN_CAN_DATA_LANE_DEPTH
+#   endif
+/// The minimum separation time (STmin) between consecutive frames advertised
+/// to ISO-TP senders, encoded as per ISO 15765-2 (0x00..0x7F: milliseconds,
+/// 0xF1..0xF9: 100..900 microseconds).
+#   ifndef CN_ISOTP_STMIN
+#       define CN_ISOTP_STMIN 0x00
+#   endif
+#endif
+
+/// Gateway mode: messages for the devices whose id matches
+/// `CN_GATEWAY_DEV_ID` under `CN_GATEWAY_DEV_MASK` (and broadcasts) are
+/// relayed from CAN bus 0 to bus 1, and their replies back. Needs a target
+/// with more than one CAN bus (see `CN_CAN_BUSES`).
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_GATEWAY
+#   define CN_WITH_GATEWAY 0
+#endif
+
+#if CN_WITH_GATEWAY
+#   ifndef CN_GATEWAY_DEV_ID
+#       define CN_GATEWAY_DEV_ID 0x80
+#   endif
+#   ifndef CN_GATEWAY_DEV_MASK
+#       define CN_GATEWAY_DEV_MASK 0x80
+#   endif
+#endif
+
+/// Startup time benchmark figures, see `cnDebugBenchStamp()`.
+/// Off by default, even in non-minimal builds.
+#ifndef CN_WITH_STARTUP_BENCH
+#   define CN_WITH_STARTUP_BENCH 0
+#endif
+
+#endif // CONFIG_H
@@ -8,6 +8,8 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include "common/config.h"
+
 /// Initializes debug functionalities on the target MCU.
 /// Returns true on success or false on error.
 int cnDebugInit(void);
@@ -16,4 +18,19 @@ int cnDebugInit(void);
 /// `cnDebugInit()` must have been called beforehand.
 void cnDebugLed(int on);
 
+#if CN_WITH_STARTUP_BENCH
+
+/// Records the time elapsed since chip reset, in microseconds, as the `n`-th
+/// (0 or 1) startup benchmark figure.
+/// Used by the bootloader to record the time it takes to start listening for
+/// CAN messages (0) and to jump to the user program (1).
+///
+/// On STM32: measured with the DWT cycle counter; stored to backup registers
+///           BKP_DR(2n+1) (low half) and BKP_DR(2n+2) (high half), which
+///           survive the jump to the user program and resets.
+/// On AVR: not implemented, there is no free-running counter to measure with.
+void cnDebugBenchStamp(unsigned n);
+
+#endif // CN_WITH_STARTUP_BENCH
+
 #endif // DEBUG_H
@@ -9,6 +9,8 @@
 #define FLASH_H
 
 #include <stdint.h>
+#include "common/config.h"
+#include "common/sha256.h"
 
 #ifndef CN_FLASH_PAGE_SIZE
 #   error "CN_FLASH_PAGE_SIZE must be defined by the build system"
@@ -22,10 +24,22 @@
 #   error "CN_FLASH_BOOTLOADER_SIZE must be defined by the build system"
 #endif
 
+// CN_FLASH_DIRECT_FILL can optionally be defined by the build system (on AVR)
+// to have WRITEs go straight to the flash controller's page buffer via
+// `cnFlashFill()` as they arrive, instead of being buffered in RAM until the
+// page is committed. See common/page.h.
+
+/// An address in flash memory (or a size of it).
+/// 32 bits on all targets: on AVR, pointers are only 16 bits wide, while flash
+/// can be larger than 64kB (see `RAMPZ`).
+typedef uint32_t CNflashAddr;
+
+/// Returns the address of the first byte of flash memory.
+CNflashAddr cnFlashStart(void);
 
 /// Returns the total size of flash memory, in bytes.
 /// Divide by `CN_FLASH_PAGE_SIZE` to get the total number of pages.
-uintptr_t cnFlashSize(void);
+CNflashAddr cnFlashSize(void);
 
 /// Unlocks flash memory for writing.
 /// Returns true on success or false on error.
@@ -38,7 +52,7 @@ int cnFlashLock(void);
 /// Returns true if the page in flash that starts at `addr` (the address of
 /// its first byte) is writeable, false if it should not be written to (it is
 /// part of the bootloader, out-of-bounds, ...)
-int cnFlashPageWriteable(uintptr_t addr);
+int cnFlashPageWriteable(CNflashAddr addr);
 
 /// Begins a write/erase cycle for the page starting at `addr` in flash, preparing
 /// data to be filled in with `cnFlashFill()`.
@@ -47,8 +61,9 @@ int cnFlashPageWriteable(uintptr_t addr);
 ///
 /// On STM32: unlocks flash for writing, erases the flash page at `addr` and
 ///           sets `FLASH_CR->PG`.
-/// On AVR: erases the flash page at `addr`.
-int cnFlashBeginWrite(uintptr_t addr);
+/// On AVR: clears the internal scrap page; the flash page at `addr` is
+///         erased by `cnFlashEndWrite()`.
+int cnFlashBeginWrite(CNflashAddr addr);
 
 /// Copies `size` bytes of `data`, offset by `offset` bytes into the page currently
 /// being written to - see `cnFlashBeginWrite()`.
@@ -62,15 +77,80 @@ unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size]);
 /// Returns true on success or false on error.
 ///
 /// On STM32: clears `FLASH_CR->PG`.
-/// On AVR: copies the internal scrap page to the actual page to program in flash.
+/// On AVR: erases the page to program in flash, then copies the internal scrap
+///         page to it.
 int cnFlashEndWrite(void);
 
+/// Copies `len` bytes of flash memory starting at `addr` to `out`.
+///
+/// On STM32: flash is memory-mapped, this is a plain copy.
+/// On AVR: reads flash via LPM (ELPM on parts with more than 64kB of flash),
+///         re-enabling the RWW section first if a page was written to since.
+void cnFlashRead(CNflashAddr addr, unsigned len, uint8_t out[len]);
+
+#if CN_WITH_JOURNAL
+
+/// Returns the id of the image whose upload is being tracked by the page journal,
+/// or `CN_JOURNAL_NO_IMAGE` if the journal is empty.
+///
+/// The page journal is persistent: it records which pages were committed
+/// for an image, so that an interrupted upload can be resumed after a reset.
+uint32_t cnJournalImageId(void);
+
+/// The image id of an empty page journal.
+#define CN_JOURNAL_NO_IMAGE 0xFFFFFFFFu
+
+/// Clears the page journal and starts tracking the upload of image `imageId`.
+/// Unlock flash with `cnFlashUnlock()` before use.
+/// Returns true on success or false on error.
+///
+/// On STM32: erases the journal page (the last page in flash).
+/// On AVR: rewrites the journal in EEPROM.
+int cnJournalReset(uint32_t imageId);
+
+/// Marks the `page`-th page in flash as committed in the page journal.
+/// Returns true on success or false on error.
+int cnJournalMark(unsigned page);
+
+/// Returns true if the `page`-th page in flash is marked as committed in the
+/// page journal.
+int cnJournalMarked(unsigned page);
+
+#if CN_WITH_DIGEST
+
+/// Stores `digest`, the SHA-256 digest of `nPages` pages of the image tracked
+/// by the page journal, so that it can be reported again without re-hashing
+/// them. The digest is dropped by `cnJournalReset()`.
+/// Unlock flash with `cnFlashUnlock()` before use.
+/// Returns true on success or false on error.
+///
+/// On STM32: only one digest can be stored per `cnJournalReset()`.
+int cnJournalSetDigest(unsigned nPages, const uint8_t digest[static CN_SHA256_SIZE]);
+
+/// Reads the digest stored by `cnJournalSetDigest()` to `outDigest`.
+/// Returns the number of pages it covers, or 0 if no digest is stored.
+unsigned cnJournalDigest(uint8_t outDigest[static CN_SHA256_SIZE]);
+
+#endif // CN_WITH_DIGEST
+
+#endif // CN_WITH_JOURNAL
+
 /// Reads this CANnuccia device's id.
 ///
 /// On STM32: reads the Data0 option byte.
 /// On AVR: reads the byte from EEPROM at address 0x00.
 uint8_t cnReadDevId(void);
 
+/// The size of a device's unique id, in bytes.
+#define CN_UID_SIZE 12
+
+/// Reads this CANnuccia device's unique id to `outUid`.
+///
+/// On STM32: reads the factory-programmed 96-bit unique device id.
+/// On AVR: reads the serial number from EEPROM at addresses 0x01..0x0C (which
+///         has to be unique, and written once - like the device id).
+void cnReadUid(uint8_t outUid[static CN_UID_SIZE]);
+
 /// Jumps from the bootloader to the user program.
 void cnJumpToProgram(void);
 
@@ -0,0 +1,104 @@
+// CANnuccia/src/common/handoff.h - Peripheral state handed off to the user program
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// This header can also be included by user programs (it only needs
+// <stdint.h>) to find out how CANnuccia left the clock tree and the CAN
+// controller configured, and skip initializing them again.
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+/// The hand-off record, written by CANnuccia right before jumping to the user
+/// program when built with `CN_WITH_HANDOFF`.
+///
+/// All fields are 32-bit, native endianness; see `cnHandoffValid()`.
+typedef struct CNhandoff
+{
+    uint32_t magic; ///< `CN_HANDOFF_MAGIC` if the record is valid.
+    uint32_t sysClockHz; ///< System (CPU) clock frequency, in Hz.
+    uint32_t canClockHz; ///< Clock frequency of the CAN controller, in Hz.
+    uint32_t canRate; ///< CAN bit rate, in bits/s.
+
+    /// Raw bit timing register(s) of the CAN controller.
+    /// On STM32: the value of bxCAN's BTR.
+    /// On AVR: the MCP's CNF1 (bits 0..7), CNF2 (bits 8..15) and CNF3 (bits 16..23).
+    uint32_t canBitTiming;
+
+    /// Id and mask of the CAN filter that was set, see `cnCANInit()`.
+    /// This is the only filter left active: the bootloader's other filters
+    /// (data lane, broadcasts...) are disabled before the hand-off.
+    /// On STM32: bxCAN filter bank 2, routing to FIFO 0.
+    /// On AVR: the MCP's RXB1 (RXF2 and its mask; RXF3..RXF5 are copies of it).
+    uint32_t canFilterId;
+    uint32_t canFilterMask; ///< See `canFilterId`.
+
+    /// Bits 0..7: the device id; bits 8..15: `CN_HANDOFF_x` flags.
+    uint32_t devIdFlags;
+
+    uint32_t check; ///< See `cnHandoffCheck()`.
+
+} CNhandoff;
+
+/// "CNH1"
+#define CN_HANDOFF_MAGIC 0x31484E43u
+
+/// Set in `devIdFlags` if the CAN controller was left running (in normal
+/// mode, with its bit timing and filter set), with all of its interrupts
+/// disabled.
+#define CN_HANDOFF_CAN_UP 0x0100u
+
+/// The space reserved to the hand-off record, in bytes.
+/// (`sizeof(CNhandoff)` rounded up to 8 bytes, so that a stack right below it
+/// stays 8-byte aligned as per AAPCS)
+#define CN_HANDOFF_SIZE 40u
+
+// The hand-off record lives at the very top of RAM, right above the stack of
+// CANnuccia. User programs that read it have to place their own initial stack
+// pointer below it too (i.e. at `CN_HANDOFF_ADDR`).
+#ifndef CN_HANDOFF_ADDR
+#   if defined(CN_PLATFORM_IS_AVR) || defined(__AVR__)
+#       include <avr/io.h>
+#       define CN_HANDOFF_ADDR (RAMEND + 1 - CN_HANDOFF_SIZE)
+#   elif defined(CN_PLATFORM_IS_LINUX)
+        // (a plain variable, see linux/flash.c)
+        extern CNhandoff cnLinuxHandoff;
+#       define CN_HANDOFF_ADDR ((uintptr_t)&cnLinuxHandoff)
+#   else
+        // STM32F103: RAM starts at 0x20000000, its size depends on the part
+        // (set by the toolchain file; user programs for parts other than the
+        // STM32F103C8/CB, with 20kB, have to define it too)
+#       ifndef CN_STM32_RAM_SIZE
+#           define CN_STM32_RAM_SIZE 0x5000u
+#       endif
+#       define CN_HANDOFF_ADDR (0x20000000u + CN_STM32_RAM_SIZE - CN_HANDOFF_SIZE)
+#   endif
+#endif
+
+/// Points to the hand-off record.
+#define CN_HANDOFF ((volatile CNhandoff *)CN_HANDOFF_ADDR)
+
+/// Returns the value the `check` field of `handoff` must have: the negated XOR
+/// of all other fields.
+inline static uint32_t cnHandoffCheck(const volatile CNhandoff *handoff)
+{
+    return ~(handoff->magic ^ handoff->sysClockHz ^ handoff->canClockHz
+             ^ handoff->canRate ^ handoff->canBitTiming
+             ^ handoff->canFilterId ^ handoff->canFilterMask
+             ^ handoff->devIdFlags);
+}
+
+/// Returns true if `handoff` holds a valid hand-off record; RAM contents are
+/// random after a power-on reset, and CANnuccia invalidates the record when it
+/// is built to reset all peripherals instead.
+inline static int cnHandoffValid(const volatile CNhandoff *handoff)
+{
+    return handoff->magic == CN_HANDOFF_MAGIC && handoff->check == cnHandoffCheck(handoff);
+}
+
+#endif // HANDOFF_H
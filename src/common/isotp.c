@@ -0,0 +1,205 @@
+// CANnuccia/src/common/isotp.c - Implementation of common/isotp.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/isotp.h"
+
+#include "common/config.h"
+
+#if CN_WITH_ISOTP
+
+// Frame types (high nibble of the PCI byte).
+#define PCI_SF 0x00u
+#define PCI_FF 0x10u
+#define PCI_CF 0x20u
+#define PCI_FC 0x30u
+#define PCI_TYPE_MASK 0xF0u
+
+void cnIsoTpRxInit(CNisotpRx *rx, unsigned maxLen, uint8_t blockSize, uint8_t stMin)
+{
+    rx->maxLen = (uint16_t)(maxLen < CN_ISOTP_MAX_LEN ? maxLen : CN_ISOTP_MAX_LEN);
+    rx->remaining = 0;
+    rx->seq = 0;
+    rx->blockSize = blockSize;
+    rx->stMin = stMin;
+    rx->blockLeft = 0;
+    rx->fcStatus = CN_ISOTP_FC_CTS;
+}
+
+unsigned cnIsoTpRxFrame(CNisotpRx *rx, unsigned len, const uint8_t frame[len],
+                        const uint8_t **outData, unsigned *outLen)
+{
+    *outData = frame + 1;
+    *outLen = 0;
+    if(len == 0)
+    {
+        return CN_ISOTP_RX_ERROR;
+    }
+
+    unsigned pciLen = frame[0] & 0x0Fu;
+    switch(frame[0] & PCI_TYPE_MASK)
+    {
+    case PCI_SF:
+        rx->remaining = 0;
+        if(pciLen == 0 || pciLen > len - 1 || pciLen > rx->maxLen)
+        {
+            return CN_ISOTP_RX_ERROR;
+        }
+        *outLen = pciLen;
+        return CN_ISOTP_RX_FIRST | CN_ISOTP_RX_DONE;
+
+    case PCI_FF:
+        rx->remaining = 0;
+        if(len < 8)
+        {
+            // (a FF always fills the frame)
+            return CN_ISOTP_RX_ERROR;
+        }
+        pciLen = (pciLen << 8) | frame[1];
+        if(pciLen > rx->maxLen)
+        {
+            rx->fcStatus = CN_ISOTP_FC_OVERFLOW;
+            return CN_ISOTP_RX_ERROR | CN_ISOTP_RX_SEND_FC;
+        }
+        if(pciLen < 8)
+        {
+            return CN_ISOTP_RX_ERROR;
+        }
+        *outData = frame + 2;
+        *outLen = 6;
+        rx->remaining = (uint16_t)(pciLen - 6);
+        rx->seq = 1;
+        rx->blockLeft = rx->blockSize;
+        rx->fcStatus = CN_ISOTP_FC_CTS;
+        return CN_ISOTP_RX_FIRST | CN_ISOTP_RX_SEND_FC;
+
+    case PCI_CF:
+    {
+        if(rx->remaining == 0)
+        {
+            // (no message in progress; a stray CF)
+            return CN_ISOTP_RX_ERROR;
+        }
+        unsigned expected = rx->remaining < 7 ? rx->remaining : 7;
+        if(pciLen != rx->seq || len - 1 < expected)
+        {
+            rx->remaining = 0;
+            return CN_ISOTP_RX_ERROR;
+        }
+        *outLen = expected;
+        rx->remaining -= (uint16_t)expected;
+        rx->seq = (rx->seq + 1) & 0x0Fu;
+        if(rx->remaining == 0)
+        {
+            return CN_ISOTP_RX_DONE;
+        }
+        if(rx->blockLeft && -- rx->blockLeft == 0)
+        {
+            rx->blockLeft = rx->blockSize;
+            return CN_ISOTP_RX_SEND_FC;
+        }
+        return 0;
+    }
+
+    default:
+        // (FCs are for the sender; anything else is not ISO-TP)
+        return CN_ISOTP_RX_ERROR;
+    }
+}
+
+unsigned cnIsoTpFlowControl(const CNisotpRx *rx, uint8_t outFrame[static 3])
+{
+    outFrame[0] = (uint8_t)(PCI_FC | rx->fcStatus);
+    outFrame[1] = rx->blockSize;
+    outFrame[2] = rx->stMin;
+    return 3;
+}
+
+void cnIsoTpTxInit(CNisotpTx *tx, unsigned len, const uint8_t data[len])
+{
+    tx->data = data;
+    tx->len = (uint16_t)(len < CN_ISOTP_MAX_LEN ? len : CN_ISOTP_MAX_LEN);
+    tx->sent = 0;
+    tx->seq = 0;
+    tx->blockLeft = 0;
+    tx->waitFC = 0;
+    tx->stMin = 0;
+}
+
+unsigned cnIsoTpTxFrame(CNisotpTx *tx, uint8_t outFrame[static 8])
+{
+    if(cnIsoTpTxDone(tx) || tx->waitFC)
+    {
+        return 0;
+    }
+
+    unsigned pciLen, n;
+    if(tx->sent == 0 && tx->len <= 7)
+    {
+        outFrame[0] = (uint8_t)(PCI_SF | tx->len);
+        pciLen = 1;
+        n = tx->len;
+    }
+    else if(tx->sent == 0)
+    {
+        outFrame[0] = (uint8_t)(PCI_FF | (tx->len >> 8));
+        outFrame[1] = (uint8_t)tx->len;
+        pciLen = 2;
+        n = 6;
+        tx->seq = 1;
+        tx->waitFC = 1;
+    }
+    else
+    {
+        outFrame[0] = (uint8_t)(PCI_CF | tx->seq);
+        pciLen = 1;
+        n = (unsigned)(tx->len - tx->sent) < 7 ? (unsigned)(tx->len - tx->sent) : 7;
+        tx->seq = (tx->seq + 1) & 0x0Fu;
+        if(tx->blockLeft && -- tx->blockLeft == 0)
+        {
+            tx->waitFC = 1;
+        }
+    }
+
+    for(unsigned i = 0; i < n; i ++)
+    {
+        outFrame[pciLen + i] = tx->data[tx->sent + i];
+    }
+    tx->sent += (uint16_t)n;
+    if(cnIsoTpTxDone(tx))
+    {
+        tx->waitFC = 0;
+    }
+    return pciLen + n;
+}
+
+int cnIsoTpTxFlowControl(CNisotpTx *tx, unsigned len, const uint8_t frame[len])
+{
+    if(len < 3 || (frame[0] & PCI_TYPE_MASK) != PCI_FC)
+    {
+        return 0;
+    }
+    switch(frame[0] & 0x0Fu)
+    {
+    case CN_ISOTP_FC_CTS:
+        tx->blockLeft = frame[1];
+        tx->stMin = frame[2];
+        tx->waitFC = 0;
+        return 1;
+
+    case CN_ISOTP_FC_WAIT:
+        tx->waitFC = 1;
+        return 1;
+
+    default:
+        // Overflow (or an invalid status): abort
+        tx->sent = tx->len;
+        tx->waitFC = 0;
+        return 0;
+    }
+}
+
+#endif // CN_WITH_ISOTP
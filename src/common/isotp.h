@@ -0,0 +1,119 @@
+// CANnuccia/src/common/isotp.h - ISO-TP (ISO 15765-2) segmentation and reassembly
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Classic CAN frames (up to 8 bytes), normal addressing: the first byte of each
+// frame is the protocol control information (PCI), the rest is payload.
+// - Single frame (SF):      0x0L, L payload bytes (1..7)
+// - First frame (FF):       0x1H 0xLL, 6 payload bytes; the message is 0xHLL
+//                           bytes long (8..4095)
+// - Consecutive frame (CF): 0x2N, up to 7 payload bytes; N is a sequence number,
+//                           1 for the CF right after the FF, wrapping to 0 after 15
+// - Flow control (FC):      0x3S BS STmin, sent by the receiver after the FF and
+//                           after every BS CFs (never again if BS is 0); S is a
+//                           `CN_ISOTP_FC_*` status, STmin is the minimum time
+//                           between CFs (see `cnIsoTpSTminUs()`)
+//
+// Payload is never buffered here: each frame is handed over as soon as it is
+// received, so a receiver can put the bytes where they belong right away.
+#ifndef ISOTP_H
+#define ISOTP_H
+
+#include <stdint.h>
+
+/// The maximum length of an ISO-TP message over classic CAN, in bytes.
+#define CN_ISOTP_MAX_LEN 4095u
+
+// Flow control statuses.
+#define CN_ISOTP_FC_CTS 0x0u ///< Continue to send.
+#define CN_ISOTP_FC_WAIT 0x1u ///< Wait for another FC.
+#define CN_ISOTP_FC_OVERFLOW 0x2u ///< Message too long, abort.
+
+/// The receiving side of an ISO-TP connection, see `cnIsoTpRxInit()`.
+typedef struct CNisotpRx
+{
+    uint16_t maxLen; ///< Longer messages are refused with `CN_ISOTP_FC_OVERFLOW`.
+    uint16_t remaining; ///< Bytes of the current message not received yet; 0 if none.
+    uint8_t seq; ///< Sequence number of the next CF.
+    uint8_t blockSize; ///< BS to advertise in FCs.
+    uint8_t stMin; ///< STmin to advertise in FCs.
+    uint8_t blockLeft; ///< CFs left in the current block; 0 if unlimited.
+    uint8_t fcStatus; ///< Status of the FC to send, a `CN_ISOTP_FC_*`.
+
+} CNisotpRx;
+
+// Flags returned by `cnIsoTpRxFrame()`.
+#define CN_ISOTP_RX_FIRST 0x01u ///< The frame starts a new message.
+#define CN_ISOTP_RX_DONE 0x02u ///< The frame ends the message.
+#define CN_ISOTP_RX_SEND_FC 0x04u ///< A FC has to be sent, see `cnIsoTpFlowControl()`.
+#define CN_ISOTP_RX_ERROR 0x08u ///< The frame was unexpected, or the message is too long.
+
+/// Sets up `rx` to receive messages of up to `maxLen` bytes, advertising
+/// `blockSize` and `stMin` to the sender.
+void cnIsoTpRxInit(CNisotpRx *rx, unsigned maxLen, uint8_t blockSize, uint8_t stMin);
+
+/// Processes a received ISO-TP frame. Returns a combination of
+/// `CN_ISOTP_RX_*` flags, and sets `*outData` and `*outLen` to the payload
+/// bytes the frame carries (none on error); they follow the ones of the
+/// previous frame, unless `CN_ISOTP_RX_FIRST` is set.
+///
+/// A SF or FF always starts a new message, dropping the one in progress (if
+/// any); a CF out of sequence drops the message in progress.
+unsigned cnIsoTpRxFrame(CNisotpRx *rx, unsigned len, const uint8_t frame[len],
+                        const uint8_t **outData, unsigned *outLen);
+
+/// Writes the FC frame to send when `CN_ISOTP_RX_SEND_FC` is returned to
+/// `outFrame`. Returns its length, in bytes.
+unsigned cnIsoTpFlowControl(const CNisotpRx *rx, uint8_t outFrame[static 3]);
+
+/// The sending side of an ISO-TP connection, see `cnIsoTpTxInit()`.
+typedef struct CNisotpTx
+{
+    const uint8_t *data; ///< The message being sent.
+    uint16_t len; ///< Length of the message.
+    uint16_t sent; ///< Bytes of the message sent so far.
+    uint8_t seq; ///< Sequence number of the next CF.
+    uint8_t blockLeft; ///< CFs left before waiting for a FC; 0 if unlimited.
+    uint8_t waitFC; ///< True if waiting for a FC.
+    uint8_t stMin; ///< STmin advertised by the receiver, see `cnIsoTpSTminUs()`.
+
+} CNisotpTx;
+
+/// Sets up `tx` to send the `len` (up to `CN_ISOTP_MAX_LEN`) bytes of `data`,
+/// which must stay valid until the message is sent.
+void cnIsoTpTxInit(CNisotpTx *tx, unsigned len, const uint8_t data[len]);
+
+/// Writes the next frame to send to `outFrame`. Returns its length, in bytes,
+/// or 0 if the message was sent already or a FC has to be received first.
+unsigned cnIsoTpTxFrame(CNisotpTx *tx, uint8_t outFrame[static 8]);
+
+/// Processes a FC frame received from the receiver.
+/// Returns false if the receiver aborted the message (or the FC is invalid).
+int cnIsoTpTxFlowControl(CNisotpTx *tx, unsigned len, const uint8_t frame[len]);
+
+/// Returns true if all of the message was sent.
+inline static int cnIsoTpTxDone(const CNisotpTx *tx)
+{
+    return tx->sent >= tx->len;
+}
+
+/// Converts a STmin value to microseconds (reserved values count as 127ms, as
+/// per ISO 15765-2).
+inline static uint32_t cnIsoTpSTminUs(uint8_t stMin)
+{
+    if(stMin <= 0x7Fu)
+    {
+        return stMin * 1000u;
+    }
+    else if(stMin >= 0xF1u && stMin <= 0xF9u)
+    {
+        return (stMin - 0xF0u) * 100u;
+    }
+    return 127000u;
+}
+
+#endif // ISOTP_H
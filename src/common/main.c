@@ -7,10 +7,16 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <stddef.h>
+#include "common/cc.h"
+#include "common/config.h"
 #include "common/util.h"
 #include "common/can.h"
 #include "common/can_msgs.h"
 #include "common/flash.h"
+#include "common/handoff.h"
+#include "common/isotp.h"
+#include "common/page.h"
+#include "common/sha256.h"
 #include "common/timer.h"
 #include "common/debug.h"
 
@@ -24,77 +30,667 @@ volatile static enum
 
 } state = IDLE;
 
-/// Data about the currently-selected page.
-static struct Page
-{
-    volatile uintptr_t addr; ///< Points to the first byte in flash of the page.
-    volatile uintptr_t writeOffset; ///< WRITE head byte offset into the selected page.
-    uint8_t writes[CN_FLASH_PAGE_SIZE]; ///< All WRITEs to be committed to the selected page.
+/// This device's id, as read from flash/EEPROM on startup (or the session id
+/// it was bound to, see `bind()`).
+static uint8_t devId;
+
+/// The payload of the reply to send back to the master, see `reply()`.
+static uint8_t outMsgData[8];
+
+#if CN_WITH_JOURNAL
+
+/// The id of the image being uploaded, as sent by the master with PROG_REQ.
+/// Pages committed to flash are recorded under this id in the page journal,
+/// so that an interrupted upload can be resumed; no journaling happens if it
+/// is `CN_JOURNAL_NO_IMAGE`.
+static uint32_t imageId = CN_JOURNAL_NO_IMAGE;
+
+#endif // CN_WITH_JOURNAL
+
+#if CN_WITH_DIGEST
+
+/// SHA-256 of the pages committed since the upload started (with PROG_REQ),
+/// each hashed as its address (U32 LE) followed by its contents, in the order
+/// they were committed in.
+static CNsha256 digest;
+
+/// The number of page commits hashed into `digest`.
+static unsigned digestPages = 0;
+
+/// `CN_CAN_DIGEST_*` flags of `digest`.
+static uint8_t digestFlags = 0;
+
+#endif // CN_WITH_DIGEST
+
+#if CN_WITH_ISOTP
+
+/// Reassembles the ISO-TP messages of ISOTP_WRITE, whose payload is written
+/// to the selected page as it arrives (so no buffer is needed for it).
+static CNisotpRx isoTp;
+
+#endif // CN_WITH_ISOTP
+
+#if CN_WITH_BIND
+
+/// The number of 32-bit words in a unique id.
+#define UID_WORDS (CN_UID_SIZE / 4)
 
-} selPage = {0};
+/// `scanWord` of a device that is not taking part in a BIND scan.
+#define NOT_SCANNING 0xFF
+
+/// This device's unique id, read when a BIND scan starts.
+static uint8_t uid[CN_UID_SIZE];
+
+/// The word of `uid` that the guesses of the BIND scan are matched against
+/// (`UID_WORDS` once all were matched), or `NOT_SCANNING`.
+static uint8_t scanWord = NOT_SCANNING;
+
+/// Set to true while `devId` is a session id bound by BIND.
+static int bound = 0;
+
+#endif // CN_WITH_BIND
 
 /// The timeout in microseconds after which to the bootloader stops listening
 /// for CAN messages
 #define BOOTLOADER_TIMEOUT_US 3000000
 
+/// The time slot (in microseconds) of the replies to an ENUMERATE: device `n`
+/// waits for `n % 16` slots before replying, then arbitration on the CAN id
+/// sorts out the replies of the devices in the same slot.
+#define ENUMERATE_SLOT_US 150
+
+// Broadcasts are dispatched on `CN_CAN_CMD()` like all other messages: it must
+// decode each broadcast command to the same value as the command itself
+// (checked here for either id layout, see `CN_CAN_STD_IDS`)
+#define CHECK_BROADCAST_CMD(msg, name) \
+    CN_STATIC_ASSERT(CN_CAN_CMD(CN_CAN_BROADCAST(msg)) == CN_CAN_CMD(msg) \
+                     && CN_CAN_IS_BROADCAST(CN_CAN_BROADCAST(msg)) \
+                     && !CN_CAN_IS_BROADCAST(msg), broadcastCmd_##name)
+CHECK_BROADCAST_CMD(CN_CAN_MSG_ENUMERATE, ENUMERATE);
+CHECK_BROADCAST_CMD(CN_CAN_MSG_IDENTIFY, IDENTIFY);
+CHECK_BROADCAST_CMD(CN_CAN_MSG_HOLD, HOLD);
+CHECK_BROADCAST_CMD(CN_CAN_MSG_BIND, BIND);
+#undef CHECK_BROADCAST_CMD
+
 
 /// Executed when the bootloader times out, exits the CAN message pump.
-static void onTimeout(void)
+/// (called from the timer's ISR, which can fire while flash is busy)
+static CN_RAMFUNC void onTimeout(void)
 {
     state = DONE;
 }
 
+/// Sends the first `len` bytes of `outMsgData` back to the master as a message
+/// of type `msgId`.
+/// (All replies go through here, so that the code to build and send them is
+/// only emitted once)
+static void reply(uint32_t msgId, unsigned len)
+{
+    cnCANSend(cnCANDevMask(msgId, devId), len, outMsgData);
+}
+
+#if CN_WITH_HOLD
+
+/// Handles a HOLD message with `len` bytes of payload `data`: stops the
+/// bootloader timeout (`CN_CAN_HOLD_ENGAGE`), or restarts it from scratch
+/// (`CN_CAN_HOLD_RELEASE`). Only affects devices that are not being
+/// programmed, i.e. still waiting for a PROG_REQ; no reply is sent, as HOLDs
+/// are usually broadcast to the whole bus.
+static void hold(unsigned len, const uint8_t data[len])
+{
+    if(state != IDLE || len < 1)
+    {
+        return;
+    }
+    if(data[0] == CN_CAN_HOLD_ENGAGE)
+    {
+        cnTimerStop();
+    }
+    else if(data[0] == CN_CAN_HOLD_RELEASE)
+    {
+        cnTimerStart(BOOTLOADER_TIMEOUT_US, 1, onTimeout);
+    }
+}
+
+#endif // CN_WITH_HOLD
+
+#if CN_WITH_BIND
+
+/// Moves the CAN filters of the messages from master to this device to device
+/// id `id`.
+static void listenAs(uint8_t id)
+{
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 0, cnCANDevMask(CN_CAN_CONTROL_LANE_ID0, id), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 1, cnCANDevMask(CN_CAN_CONTROL_LANE_ID1, id), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_DATA, 0, cnCANDevMask(CN_CAN_DATA_LANE_ID0, id), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_DATA, 1, cnCANDevMask(CN_CAN_DATA_LANE_ID1, id), CN_CAN_LANE_FILTER_MASK);
+}
+
+/// Handles a BIND SCAN for bits `bit`..31 of word `word` of the unique id,
+/// acknowledging it if they match `guess`; see `CN_CAN_BIND_SCAN`.
+static void bindScan(unsigned word, unsigned bit, uint32_t guess)
+{
+    if(bound)
+    {
+        return;
+    }
+    if(bit == CN_CAN_BIND_SCAN_RESTART)
+    {
+        cnReadUid(uid);
+        scanWord = 0;
+    }
+    else if(word != scanWord || word >= UID_WORDS || bit > 31
+            || (cnReadU32LE(uid + word * 4) ^ guess) >> bit)
+    {
+        return;
+    }
+    else if(bit == 0)
+    {
+        scanWord ++; // (the whole word matched)
+    }
+    // (the same message as all other matching devices, bit for bit)
+    cnCANSend(cnCANDevMask(CN_CAN_MSG_BIND_ACK, CN_CAN_BIND_SCAN_DEV), 0, outMsgData);
+}
+
+/// Handles a BIND message with `len` bytes of payload `data`. Binding a
+/// session id stops the bootloader timeout, as the master is about to program
+/// the device.
+static void bind(unsigned len, const uint8_t data[len])
+{
+    if(len < 1)
+    {
+        return;
+    }
+    switch(data[0])
+    {
+    case CN_CAN_BIND_SCAN:
+        if(len == 7)
+        {
+            bindScan(data[1], data[2], cnReadU32LE(data + 3));
+        }
+        break;
+
+    case CN_CAN_BIND_ASSIGN:
+        if(len == 2 && scanWord == UID_WORDS)
+        {
+            scanWord = NOT_SCANNING;
+            bound = 1;
+            devId = data[1];
+            listenAs(devId);
+            if(state == IDLE)
+            {
+                cnTimerStop();
+            }
+            reply(CN_CAN_MSG_BIND_ACK, 0);
+        }
+        break;
+
+    case CN_CAN_BIND_RELEASE:
+        scanWord = NOT_SCANNING;
+        if(bound)
+        {
+            bound = 0;
+            devId = cnReadDevId();
+            listenAs(devId);
+        }
+        break;
+    }
+}
+
+#endif // CN_WITH_BIND
+
+#if CN_WITH_JOURNAL
+
+/// Returns the index of the page in flash that starts at `addr`.
+static unsigned pageIndex(CNflashAddr addr)
+{
+    return (unsigned)((addr - cnFlashStart()) / CN_FLASH_PAGE_SIZE);
+}
+
+/// Returns true if the page journal is tracking the upload of `imageId`.
+static int journalValid(void)
+{
+    return imageId != CN_JOURNAL_NO_IMAGE && cnJournalImageId() == imageId;
+}
+
+/// Makes the page journal track the upload of `imageId`, clearing it if it was
+/// tracking a different image (or if the upload is not tracked at all, as the
+/// journal would not match the contents of flash anymore). Flash must be
+/// unlocked.
+static void syncJournal(void)
+{
+    if(imageId != CN_JOURNAL_NO_IMAGE && !journalValid())
+    {
+        if(!cnJournalReset(imageId))
+        {
+            // Could not reset the journal; don't journal this upload at all
+            imageId = CN_JOURNAL_NO_IMAGE;
+        }
+    }
+    else if(imageId == CN_JOURNAL_NO_IMAGE && cnJournalImageId() != CN_JOURNAL_NO_IMAGE)
+    {
+        cnJournalReset(CN_JOURNAL_NO_IMAGE);
+    }
+}
+
+#endif // CN_WITH_JOURNAL
+
+/// Returns the index of the first writeable page that has not been committed
+/// yet for `imageId`, or the total number of pages if all have been.
+/// (Without the page journal: the index of the first writeable page)
+static unsigned resumePage(void)
+{
+    unsigned nPages = (unsigned)(cnFlashSize() / CN_FLASH_PAGE_SIZE);
+#if CN_WITH_JOURNAL
+    int valid = journalValid();
+#endif
+    for(unsigned page = 0; page < nPages; page ++)
+    {
+        CNflashAddr addr = cnFlashStart() + (CNflashAddr)page * CN_FLASH_PAGE_SIZE;
+#if CN_WITH_JOURNAL
+        if(cnFlashPageWriteable(addr) && !(valid && cnJournalMarked(page)))
+#else
+        if(cnFlashPageWriteable(addr))
+#endif
+        {
+            return page;
+        }
+    }
+    return nPages;
+}
+
+#if CN_WITH_DIGEST
+
+/// Returns true if no page at all is marked as committed for `imageId` in the
+/// page journal (or if there is no page journal).
+static int journalEmpty(void)
+{
+#if CN_WITH_JOURNAL
+    unsigned nPages = (unsigned)(cnFlashSize() / CN_FLASH_PAGE_SIZE);
+    for(unsigned page = 0; journalValid() && page < nPages; page ++)
+    {
+        if(cnJournalMarked(page))
+        {
+            return 0;
+        }
+    }
+#endif
+    return 1;
+}
+
+/// Hashes the page that was just committed into `digest`; `addrBytes` is its
+/// address as a U32 LE.
+static void hashPage(const uint8_t addrBytes[static 4])
+{
+    if(digestPages == 0 && !journalEmpty())
+    {
+        // Resuming an interrupted upload, the pages committed before the reset
+        // could only be hashed by reading them back
+        digestFlags |= CN_CAN_DIGEST_PARTIAL;
+    }
+    cnSHA256Update(&digest, 4, addrBytes);
+    cnSHA256Update(&digest, CN_FLASH_PAGE_SIZE, cnPageData());
+    digestPages ++;
+}
+
+/// Sends the digest record of the uploaded image to the master, storing it in
+/// the page journal if it covers the whole upload. If no page was committed
+/// since PROG_REQ, the digest record stored in the journal for the image is
+/// sent instead (if any; otherwise, one that covers 0 pages is).
+static void sendDigest(void)
+{
+    // Digest record: SHA-256 digest, number of pages: U16, flags: U8
+    uint8_t record[CN_CAN_DIGEST_MSGS * 7] = { 0 };
+    unsigned nPages = digestPages;
+    if(nPages > 0)
+    {
+        cnSHA256Final(&digest, record);
+#if CN_WITH_JOURNAL
+        if(state == UNLOCKED && journalValid() && !(digestFlags & CN_CAN_DIGEST_PARTIAL))
+        {
+            cnJournalSetDigest(nPages, record);
+        }
+#endif
+    }
+#if CN_WITH_JOURNAL
+    else if(journalValid())
+    {
+        nPages = cnJournalDigest(record);
+        digestFlags = CN_CAN_DIGEST_STORED;
+    }
+#endif
+    cnWriteU16LE(record + CN_SHA256_SIZE, (uint16_t)nPages);
+    record[CN_SHA256_SIZE + 2] = digestFlags;
+
+    for(unsigned i = 0; i < CN_CAN_DIGEST_MSGS; i ++)
+    {
+        outMsgData[0] = (uint8_t)i;
+        for(unsigned j = 0; j < 7; j ++)
+        {
+            outMsgData[1 + j] = record[i * 7 + j];
+        }
+        reply(CN_CAN_MSG_IMAGE_DIGEST, 8);
+    }
+}
+
+#endif // CN_WITH_DIGEST
+
+#if CN_WITH_IDENTIFY
+
+/// Replies with the identity of the image last uploaded in full, as recorded
+/// in the page journal - so that the master can tell if it is the one it is
+/// about to upload (see tools/cnimg/cnimg.h) without uploading anything:
+/// 1. Image id: U32 (`CN_JOURNAL_NO_IMAGE` if unknown)
+/// 2. Number of pages in the image: U16 (0 if unknown)
+/// 3. Bytes 4..5 of the image digest (the image id being bytes 0..3)
+/// The identity is only known after an upload tracked by the journal ended
+/// with a PROG_DONE and a complete image digest; it is forgotten as soon as a
+/// different (or untracked) upload unlocks flash.
+static void identify(void)
+{
+    uint8_t stored[CN_SHA256_SIZE] = { 0 };
+    unsigned nPages = cnJournalDigest(stored);
+    cnWriteU32LE(outMsgData, nPages ? cnJournalImageId() : CN_JOURNAL_NO_IMAGE);
+    cnWriteU16LE(outMsgData + 4, (uint16_t)nPages);
+    outMsgData[6] = stored[4];
+    outMsgData[7] = stored[5];
+    reply(CN_CAN_MSG_IDENTITY, 8);
+}
+
+#endif // CN_WITH_IDENTIFY
+
+#if CN_WITH_READBACK
+
+/// Streams `len` bytes of flash starting at `addr` (clamped to the bounds of
+/// flash) back to the master, as RANGE_DATA messages:
+/// 1. Sequence number (wraps around): U8
+/// 2. Up to 7 bytes of flash contents
+/// followed by a RANGE_END message:
+/// 1. Number of bytes that were sent: U32
+/// 2. CRC16 of all bytes that were sent: U16
+/// Replies are queued back to back, so that all TX mailboxes of the CAN
+/// controller are kept busy (see `cnCANSend()`).
+static void readRange(uint32_t addr, uint32_t len)
+{
+    CNflashAddr start = cnFlashStart(), end = start + cnFlashSize();
+    if(addr < start || addr >= end)
+    {
+        len = 0;
+    }
+    else if(len > end - addr)
+    {
+        len = end - addr;
+    }
+
+    uint16_t crc = CN_CRC16_INITVAL;
+    uint8_t seq = 0;
+    for(uint32_t sent = 0; sent < len; )
+    {
+        unsigned n = (len - sent) < 7 ? (unsigned)(len - sent) : 7;
+        outMsgData[0] = seq ++;
+        cnFlashRead(addr + sent, n, outMsgData + 1);
+        crc = cnCRC16Update(crc, n, outMsgData + 1);
+        reply(CN_CAN_MSG_RANGE_DATA, 1 + n);
+        sent += n;
+    }
+
+    cnWriteU32LE(outMsgData, len);
+    cnWriteU16LE(outMsgData + 4, crc);
+    reply(CN_CAN_MSG_RANGE_END, 6);
+}
+
+#endif // CN_WITH_READBACK
+
+#if CN_WITH_GATEWAY
+
+#if CN_CAN_BUSES < 2
+#   error "CN_WITH_GATEWAY needs a target with more than one CAN bus"
+#endif
+#if CN_CAN_CONTROL_FILTERS < 5
+#   error "CN_WITH_GATEWAY needs a target with 5 control lane filters"
+#endif
+
+/// The CAN bus the devices behind the gateway are on.
+#define GATEWAY_BUS 1
+
+/// Sets up the CAN filters of gateway mode: messages for the devices behind
+/// the gateway on bus 0, and their replies on `GATEWAY_BUS`.
+static void gatewayInit(void)
+{
+    const uint32_t devMask = cnCANDevMask(0, CN_GATEWAY_DEV_MASK);
+
+    // All relayed messages go through the same filter (so the same hardware
+    // buffer), which keeps them in the order they were sent in
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 4, cnCANDevMask(CN_CAN_TX_FILTER_ID, CN_GATEWAY_DEV_ID),
+                   (CN_CAN_TX_FILTER_MASK & ~CN_CAN_DEV_MASK) | devMask);
+    cnCANBusInit(GATEWAY_BUS, cnCANDevMask(CN_CAN_RX_FILTER_ID, CN_GATEWAY_DEV_ID),
+                 (CN_CAN_RX_FILTER_MASK & ~CN_CAN_DEV_MASK) | devMask);
+}
+
+/// Relays a message received on bus 0 to the devices behind the gateway.
+static void gatewayRelay(uint32_t msgId, unsigned len, const uint8_t data[len])
+{
+    if(state == IDLE && !CN_CAN_IS_BROADCAST(msgId))
+    {
+        // Devices behind the gateway are being programmed; stay around (until
+        // a PROG_DONE for the gateway itself)
+        cnTimerStop();
+        state = LOCKED;
+    }
+    // (if the TX queue of `GATEWAY_BUS` is full, this waits for it to drain;
+    // meanwhile, bus 0 keeps receiving to its hardware buffers)
+    cnCANBusSend(GATEWAY_BUS, msgId, len, data);
+}
+
+/// Relays all replies received from the devices behind the gateway to bus 0.
+static void gatewayRelayReplies(void)
+{
+    uint32_t msgId;
+    uint8_t data[8];
+    int len;
+    while((len = cnCANBusRecv(GATEWAY_BUS, &msgId, sizeof(data), data)) >= 0)
+    {
+        cnCANSend(msgId, (unsigned)len, data);
+    }
+}
+
+#endif // CN_WITH_GATEWAY
+
+/// Prepares the peripherals used by the bootloader for the user program:
+/// either leaves them running and describes them in the hand-off record, or
+/// resets them (invalidating the record).
+static void handOff(void)
+{
+    cnTimerStop();
+
+#if CN_WITH_HANDOFF
+#if CN_WITH_BIND
+    // The user program knows nothing about session ids; hand off the filters
+    // of the device's own id
+    if(bound)
+    {
+        bound = 0;
+        devId = cnReadDevId();
+        listenAs(devId);
+    }
+#endif
+
+    volatile CNhandoff *handoff = CN_HANDOFF;
+    handoff->magic = CN_HANDOFF_MAGIC;
+    cnCANHandoff(handoff);
+    handoff->devIdFlags |= cnReadDevId(); // (not a session id, see above)
+    handoff->check = cnHandoffCheck(handoff);
+#else
+    cnCANDeinit();
+    CN_HANDOFF->magic = 0x00000000u;
+#endif
+}
+
 int main(void)
 {
+#if CN_WITH_DEBUG_LED
     cnDebugInit();
     cnDebugLed(1);
+#endif
 
-    // Only listen to CAN messages from master to this device
-    uint8_t devId = cnReadDevId();
-    uint32_t txFilterId = cnCANDevMask(CN_CAN_TX_FILTER_ID, devId);
-    cnCANInit(txFilterId, CN_CAN_TX_FILTER_MASK);
+    // Only listen to CAN messages from master to this device; commands that
+    // act on the selected page go to the data lane, all others to the control
+    // lane, so that the former can not hold up the latter
+    devId = cnReadDevId();
+    cnCANInit(cnCANDevMask(CN_CAN_CONTROL_LANE_ID0, devId), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 1, cnCANDevMask(CN_CAN_CONTROL_LANE_ID1, devId), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_DATA, 0, cnCANDevMask(CN_CAN_DATA_LANE_ID0, devId), CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_DATA, 1, cnCANDevMask(CN_CAN_DATA_LANE_ID1, devId), CN_CAN_LANE_FILTER_MASK);
+    // Also listen to broadcasts (to the control lane)
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 2, CN_CAN_BROADCAST_LANE_ID0, CN_CAN_LANE_FILTER_MASK);
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 3, CN_CAN_BROADCAST_LANE_ID1, CN_CAN_LANE_FILTER_MASK);
+#if CN_WITH_ISOTP
+    cnIsoTpRxInit(&isoTp, CN_FLASH_PAGE_SIZE, CN_ISOTP_BLOCK_SIZE, CN_ISOTP_STMIN);
+#endif
+#if CN_WITH_GATEWAY
+    gatewayInit();
+#endif
 
     // Set the bootloader timeout: if no PROG_REQ has arrived by that time, stop
     // the CAN message pump and jump to the user program.
     cnTimerStart(BOOTLOADER_TIMEOUT_US, 1, onTimeout);
 
+#if CN_WITH_STARTUP_BENCH
+    cnDebugBenchStamp(0); // (ready to listen for CAN messages)
+#endif
+
     // CAN message pump (main loop)
     // See the CANnuccia specs for what each message is supposed to do
-    uint32_t inMsgId, outMsgId;
-    uint8_t inMsgData[8], outMsgData[8];
+    uint32_t inMsgId;
+    uint8_t inMsgData[8];
     int inMsgDataLen;
-    uint16_t selPageWritesCRC = 0; // CRC of the WRITEs in `selPageWrites`
 
     state = IDLE;
     while(state != DONE)
     {
-        inMsgDataLen = cnCANRecv(&inMsgId, sizeof(inMsgData), inMsgData);
-        if(inMsgDataLen < 0)
+#if CN_WITH_GATEWAY
+        gatewayRelayReplies();
+#endif
+
+        if(cnCANPeek(&inMsgId) < 0)
         {
             // No message from master to us
             continue;
         }
 
-        switch(inMsgId & CN_CAN_MSGID_MASK)
+#ifndef CN_FLASH_DIRECT_FILL
+        if(CN_CAN_CMD(inMsgId) == CN_CAN_CMD(CN_CAN_MSG_WRITE)
+           && !CN_CAN_IS_BROADCAST(inMsgId) && CN_CAN_DEV(inMsgId) == devId)
         {
-        case CN_CAN_MSG_PROG_REQ:
+            // WRITEs are the bulk of an upload: receive their payload straight
+            // into the selected page, at the WRITE head
+            unsigned room;
+            uint8_t *head = cnPageWriteHead(&room);
+            inMsgDataLen = cnCANRecvInto(room, head);
+            if(inMsgDataLen > 0)
+            {
+                cnPageAdvance((unsigned)inMsgDataLen);
+            }
+            continue;
+        }
+#endif
+
+        inMsgDataLen = cnCANRecvInto(sizeof(inMsgData), inMsgData);
+        if(inMsgDataLen < 0)
+        {
+            continue;
+        }
+
+#if CN_WITH_GATEWAY
+        if(CN_CAN_IS_BROADCAST(inMsgId) || CN_CAN_DEV(inMsgId) != devId)
+        {
+            // Broadcasts are both relayed and handled here
+            gatewayRelay(inMsgId, (unsigned)inMsgDataLen, inMsgData);
+            if(!CN_CAN_IS_BROADCAST(inMsgId))
+            {
+                continue;
+            }
+        }
+#endif
+
+        if(CN_CAN_IS_BROADCAST(inMsgId))
+        {
+            if(CN_CAN_CMD(inMsgId) == CN_CAN_CMD(CN_CAN_MSG_ENUMERATE))
+            {
+                // Answer with our id and stats (like after a PROG_REQ):
+                // 1. Device id: U8
+                // 2. log2(size of a flash page): U8
+                // 3. Total number of flash pages: U16
+                // 4. ELF machine type (e_machine): U16
+                // The master can tell the replies apart by their CAN id.
+                cnDelayUs((uint16_t)((devId % 16) * ENUMERATE_SLOT_US));
+                outMsgData[0] = devId;
+                outMsgData[1] = (uint8_t)cnLog2I(CN_FLASH_PAGE_SIZE);
+                cnWriteU16LE(outMsgData + 2, (uint16_t)(cnFlashSize() / CN_FLASH_PAGE_SIZE));
+                cnWriteU16LE(outMsgData + 4, CN_E_MACHINE);
+                reply(CN_CAN_MSG_ENUMERATE_RESP, 6);
+            }
+#if CN_WITH_IDENTIFY
+            else if(CN_CAN_CMD(inMsgId) == CN_CAN_CMD(CN_CAN_MSG_IDENTIFY))
+            {
+                // (replies are spread out in time like ENUMERATE's)
+                cnDelayUs((uint16_t)((devId % 16) * ENUMERATE_SLOT_US));
+                identify();
+            }
+#endif
+#if CN_WITH_HOLD
+            else if(CN_CAN_CMD(inMsgId) == CN_CAN_CMD(CN_CAN_MSG_HOLD))
+            {
+                hold((unsigned)inMsgDataLen, inMsgData);
+            }
+#endif
+#if CN_WITH_BIND
+            else if(CN_CAN_CMD(inMsgId) == CN_CAN_CMD(CN_CAN_MSG_BIND))
+            {
+                bind((unsigned)inMsgDataLen, inMsgData);
+            }
+#endif
+            continue;
+        }
+
+        // (only the command byte matters, the rest of the id was matched by
+        // the CAN filter already)
+        switch(CN_CAN_CMD(inMsgId))
+        {
+        case CN_CAN_CMD(CN_CAN_MSG_PROG_REQ):
             if(state == IDLE)
             {
                 cnTimerStop();
                 state = LOCKED;
+#if CN_WITH_DIGEST
+                cnSHA256Init(&digest);
+#endif
+            }
+#if CN_WITH_JOURNAL
+            if(inMsgDataLen >= 4)
+            {
+                // The master wants to upload image with the given id (CRC);
+                // resume its upload if it was interrupted
+                imageId = cnReadU32LE(inMsgData);
+                if(state == UNLOCKED)
+                {
+                    syncJournal();
+                }
             }
+#endif
             // Always answer with stats after a PROG_REQ (even if we already were not IDLE):
             // 1. log2(size of a flash page): U8
             // 2. Total number of flash pages: U16
             // 3. ELF machine type (e_machine): U16
-            outMsgId = cnCANDevMask(CN_CAN_MSG_PROG_REQ_RESP, devId);
+            // 4. Index of the first page not yet committed for the image: U16
             outMsgData[0] = (uint8_t)cnLog2I(CN_FLASH_PAGE_SIZE);
             cnWriteU16LE(outMsgData + 1, (uint16_t)(cnFlashSize() / CN_FLASH_PAGE_SIZE));
             cnWriteU16LE(outMsgData + 3, CN_E_MACHINE);
-            cnCANSend(outMsgId, 5, outMsgData);
+            cnWriteU16LE(outMsgData + 5, (uint16_t)resumePage());
+            reply(CN_CAN_MSG_PROG_REQ_RESP, 7);
             break;
 
-        case CN_CAN_MSG_UNLOCK:
+        case CN_CAN_CMD(CN_CAN_MSG_UNLOCK):
             if(state >= LOCKED)
             {
                 // Send a MSG_UNLOCKED if we are already unlocked or if unlocking is successfull
@@ -107,13 +703,15 @@ int main(void)
                 if(unlocked)
                 {
                     state = UNLOCKED;
-                    outMsgId = cnCANDevMask(CN_CAN_MSG_UNLOCKED, devId);
-                    cnCANSend(outMsgId, 0, NULL);
+#if CN_WITH_JOURNAL
+                    syncJournal();
+#endif
+                    reply(CN_CAN_MSG_UNLOCKED, 0);
                 }
             }
             break;
 
-        case CN_CAN_MSG_SELECT_PAGE:
+        case CN_CAN_CMD(CN_CAN_MSG_SELECT_PAGE):
             if(inMsgDataLen == 4)
             {
                 uint32_t newPageAddr = cnReadU32LE(inMsgData);
@@ -124,75 +722,163 @@ int main(void)
 
                 if(cnFlashPageWriteable(newPageAddr))
                 {
-                    selPage.addr = newPageAddr;
+                    cnPageSelect(newPageAddr);
+#if CN_WITH_ISOTP
+                    // (drop any ISO-TP message in progress for the old page)
+                    cnIsoTpRxInit(&isoTp, CN_FLASH_PAGE_SIZE, CN_ISOTP_BLOCK_SIZE, CN_ISOTP_STMIN);
+#endif
 
-                    outMsgId = cnCANDevMask(CN_CAN_MSG_PAGE_SELECTED, devId);
-                    cnWriteU32LE(outMsgData, selPage.addr); // (send the PAGE_MASKed-out address)
-                    cnCANSend(outMsgId, 4, outMsgData);
+                    cnWriteU32LE(outMsgData, cnPageAddr()); // (send the PAGE_MASKed-out address)
+                    reply(CN_CAN_MSG_PAGE_SELECTED, 4);
                 }
             }
             break;
 
-        case CN_CAN_MSG_SEEK:
+        case CN_CAN_CMD(CN_CAN_MSG_SEEK):
             if(inMsgDataLen == 4)
             {
-                uint32_t newOffset = cnReadU32LE(inMsgData);
-                if(newOffset < sizeof(selPage.writes))
-                {
-                    selPage.writeOffset = newOffset;
-                }
+                cnPageSeek(cnReadU32LE(inMsgData));
             }
             break;
 
-        case CN_CAN_MSG_WRITE:
-            for(int i = 0;
-                i < inMsgDataLen && selPage.writeOffset < sizeof(selPage.writes);
-                i ++)
+        case CN_CAN_CMD(CN_CAN_MSG_WRITE):
+            cnPageWrite((unsigned)inMsgDataLen, inMsgData);
+            break;
+
+#if CN_WITH_FILL
+        case CN_CAN_CMD(CN_CAN_MSG_FILL):
+            if(inMsgDataLen == 5)
             {
-                selPage.writes[selPage.writeOffset] = inMsgData[i];
-                selPage.writeOffset ++;
+                // Expand a run of repeated bytes in the selected page:
+                // 1. Byte offset of the run into the page: U16
+                // 2. Length of the run, in bytes: U16
+                // 3. The byte to repeat: U8
+                // The WRITE head is moved to the end of the run.
+                cnPageFill(cnReadU16LE(inMsgData), cnReadU16LE(inMsgData + 2), inMsgData[4]);
             }
             break;
+#endif
 
-        case CN_CAN_MSG_CHECK_WRITES:
-            selPageWritesCRC = cnCRC16(sizeof(selPage.writes), selPage.writes);
+#if CN_WITH_ISOTP
+        case CN_CAN_CMD(CN_CAN_MSG_ISOTP_WRITE):
+        {
+            // An ISO-TP frame; the payload of the message (up to a whole page)
+            // is written at the WRITE head, as if by a sequence of WRITEs.
+            // Flow control frames are sent back as ISOTP_FLOW messages.
+            const uint8_t *payload;
+            unsigned payloadLen;
+            unsigned flags = cnIsoTpRxFrame(&isoTp, (unsigned)inMsgDataLen, inMsgData, &payload, &payloadLen);
+            cnPageWrite(payloadLen, payload);
+            if(flags & CN_ISOTP_RX_SEND_FC)
+            {
+                reply(CN_CAN_MSG_ISOTP_FLOW, cnIsoTpFlowControl(&isoTp, outMsgData));
+            }
+            break;
+        }
+#endif
 
-            outMsgId = cnCANDevMask(CN_CAN_MSG_WRITES_CHECKED, devId);
-            cnWriteU16LE(outMsgData, selPageWritesCRC);
-            cnCANSend(outMsgId, 2, outMsgData);
+        case CN_CAN_CMD(CN_CAN_MSG_CHECK_WRITES):
+            cnWriteU16LE(outMsgData, cnPageCRC());
+            reply(CN_CAN_MSG_WRITES_CHECKED, 2);
             break;
 
-        case CN_CAN_MSG_COMMIT_WRITES:
+        case CN_CAN_CMD(CN_CAN_MSG_COMMIT_WRITES):
             if(state == UNLOCKED)
             {
-                if(!cnFlashBeginWrite(selPage.addr))
+                if(!cnPageCommit())
                 {
                     break;
                 }
-                cnFlashFill(0, sizeof(selPage.writes), selPage.writes);
-                if(!cnFlashEndWrite())
+
+                cnWriteU32LE(outMsgData, cnPageAddr());
+#if CN_WITH_DIGEST
+                hashPage(outMsgData); // (before the page gets journaled)
+#endif
+#if CN_WITH_JOURNAL
+                if(imageId != CN_JOURNAL_NO_IMAGE)
                 {
-                    break;
+                    cnJournalMark(pageIndex(cnPageAddr()));
+                }
+#endif
+                reply(CN_CAN_MSG_WRITES_COMMITTED, 4);
+            }
+            break;
+
+#if CN_WITH_JOURNAL
+        case CN_CAN_CMD(CN_CAN_MSG_QUERY_JOURNAL):
+            if(state >= LOCKED && inMsgDataLen == 2)
+            {
+                // Answer with the journal state of a range of pages:
+                // 1. Index of the first page in the range: U16
+                // 2. Bitmap of pages committed for the image: 6 * U8 (LSB first)
+                unsigned firstPage = cnReadU16LE(inMsgData);
+                int valid = journalValid();
+                cnWriteU16LE(outMsgData, (uint16_t)firstPage);
+                for(unsigned i = 0; i < CN_CAN_JOURNAL_PAGES_PER_MSG / 8; i ++)
+                {
+                    outMsgData[2 + i] = 0x00;
                 }
+                for(unsigned i = 0; valid && i < CN_CAN_JOURNAL_PAGES_PER_MSG; i ++)
+                {
+                    if(cnJournalMarked(firstPage + i))
+                    {
+                        outMsgData[2 + i / 8] |= (uint8_t)(1 << (i % 8));
+                    }
+                }
+
+                reply(CN_CAN_MSG_JOURNAL, 8);
+            }
+            break;
+#endif
 
-                outMsgId = cnCANDevMask(CN_CAN_MSG_WRITES_COMMITTED, devId);
-                cnWriteU32LE(outMsgData, selPage.addr);
-                cnCANSend(outMsgId, 4, outMsgData);
+#if CN_WITH_READBACK
+        case CN_CAN_CMD(CN_CAN_MSG_READ_RANGE):
+            if(state >= LOCKED && inMsgDataLen == 8)
+            {
+                // Read back a range of flash:
+                // 1. Address of the first byte to read: U32
+                // 2. Number of bytes to read: U32
+                readRange(cnReadU32LE(inMsgData), cnReadU32LE(inMsgData + 4));
             }
             break;
+#endif
+
+#if CN_WITH_IDENTIFY
+        case CN_CAN_CMD(CN_CAN_MSG_IDENTIFY):
+            identify();
+            break;
+#endif
+
+#if CN_WITH_HOLD
+        case CN_CAN_CMD(CN_CAN_MSG_HOLD):
+            hold((unsigned)inMsgDataLen, inMsgData);
+            break;
+#endif
 
-        case CN_CAN_MSG_PROG_DONE:
-            outMsgId = cnCANDevMask(CN_CAN_MSG_PROG_DONE_ACK, devId);
-            cnCANSend(outMsgId, 0, NULL);
+        case CN_CAN_CMD(CN_CAN_MSG_PROG_DONE):
+#if CN_WITH_DIGEST
+            sendDigest();
+#endif
+            reply(CN_CAN_MSG_PROG_DONE_ACK, 0);
             state = DONE;
             break;
         }
     }
 
+#if CN_WITH_DEBUG_LED
     cnDebugLed(0);
+#endif
+#if CN_WITH_GATEWAY
+    cnCANBusFlush(GATEWAY_BUS);
+#endif
+    cnCANFlush(); // (send out any pending reply, e.g. PROG_DONE_ACK)
+    handOff();
 
     // At this point we've either been issued a `PROG_DONE` msg or the bootloader
     // timed out; in both cases the bootloader is done running!
     cnFlashLock();
+#if CN_WITH_STARTUP_BENCH
+    cnDebugBenchStamp(1); // (about to jump to the user program)
+#endif
     cnJumpToProgram();
 }
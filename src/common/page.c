@@ -0,0 +1,253 @@
+// CANnuccia/src/common/page.c - Implementation of common/page.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/page.h"
+
+#include "common/flash.h"
+#include "common/util.h"
+
+/// Points to the first byte in flash of the selected page.
+static CNflashAddr pageAddr = 0;
+
+/// WRITE head byte offset into the selected page.
+static uintptr_t writeOffset = 0;
+
+CNflashAddr cnPageAddr(void)
+{
+    return pageAddr;
+}
+
+#ifndef CN_FLASH_DIRECT_FILL
+
+// Buffered mode: all writes go to a copy of the page in RAM, which is then
+// copied to flash in one go on commit.
+
+/// All WRITEs to be committed to the selected page.
+static uint8_t writes[CN_FLASH_PAGE_SIZE];
+
+/// Bit `n % 8` of `dirty[n / 8]` is set if halfword `n` of `writes` was
+/// written to since the page was selected; only dirty halfwords are filled in
+/// on commit, the rest of the page being left erased.
+static uint8_t dirty[CN_FLASH_PAGE_SIZE / 16];
+
+/// Marks the halfword containing byte `offset` of `writes` as dirty.
+inline static void markDirty(uintptr_t offset)
+{
+    dirty[offset / 16] |= (uint8_t)(1 << ((offset / 2) % 8));
+}
+
+/// Returns true if halfword `hw` of `writes` is dirty.
+inline static int isDirty(unsigned hw)
+{
+    return dirty[hw / 8] & (1 << (hw % 8));
+}
+
+void cnPageSelect(CNflashAddr addr)
+{
+    pageAddr = addr;
+    writeOffset = 0;
+    for(unsigned i = 0; i < sizeof(writes); i ++)
+    {
+        writes[i] = 0xFF;
+    }
+    for(unsigned i = 0; i < sizeof(dirty); i ++)
+    {
+        dirty[i] = 0x00;
+    }
+}
+
+int cnPageSeek(uintptr_t offset)
+{
+    if(offset >= sizeof(writes))
+    {
+        return 0;
+    }
+    writeOffset = offset;
+    return 1;
+}
+
+void cnPageWrite(unsigned len, const uint8_t data[len])
+{
+    for(unsigned i = 0; i < len && writeOffset < sizeof(writes); i ++)
+    {
+        writes[writeOffset] = data[i];
+        markDirty(writeOffset);
+        writeOffset ++;
+    }
+}
+
+void cnPageFill(uintptr_t offset, unsigned len, uint8_t byte)
+{
+    uintptr_t end = offset + len;
+    end = end < sizeof(writes) ? end : sizeof(writes);
+    for(; offset < end; offset ++)
+    {
+        writes[offset] = byte;
+        markDirty(offset);
+    }
+    writeOffset = end;
+}
+
+const uint8_t *cnPageData(void)
+{
+    return writes;
+}
+
+uint8_t *cnPageWriteHead(unsigned *outRoom)
+{
+    *outRoom = (unsigned)(sizeof(writes) - writeOffset);
+    return &writes[writeOffset];
+}
+
+void cnPageAdvance(unsigned len)
+{
+    for(unsigned i = 0; i < len && writeOffset < sizeof(writes); i ++)
+    {
+        markDirty(writeOffset);
+        writeOffset ++;
+    }
+}
+
+uint16_t cnPageCRC(void)
+{
+    return cnCRC16(sizeof(writes), writes);
+}
+
+int cnPageCommit(void)
+{
+    if(!cnFlashBeginWrite(pageAddr))
+    {
+        return 0;
+    }
+
+    // Fill in each run of dirty halfwords; a (partially) written page only
+    // costs as much as what was actually written
+    const unsigned N_HALFWORDS = sizeof(writes) / 2;
+    for(unsigned hw = 0; hw < N_HALFWORDS; hw ++)
+    {
+        if(isDirty(hw))
+        {
+            unsigned start = hw;
+            while(hw < N_HALFWORDS && isDirty(hw))
+            {
+                hw ++;
+            }
+            cnFlashFill(start * 2, (hw - start) * 2, &writes[start * 2]);
+        }
+    }
+    return cnFlashEndWrite();
+}
+
+#else
+
+// Direct fill mode: there is no copy of the page in RAM; writes are streamed
+// to the flash controller's own page buffer as they arrive, and the CRC of the
+// page is updated along the way. Writes must hence be sequential.
+
+/// CRC16 of all bytes before the write head.
+static uint16_t headCRC = CN_CRC16_INITVAL;
+
+/// The byte right before the write head, if the write head is at an odd
+/// offset (i.e. the low half of a word that is yet to be filled in).
+static uint8_t pendingLo = 0xFF;
+
+/// Set to true while the selected page can be written to.
+static int filling = 0;
+
+/// Appends `byte` to the page at the write head, advancing it.
+static void streamByte(uint8_t byte)
+{
+    headCRC = cnCRC16Update(headCRC, 1, &byte);
+    if(writeOffset & 1)
+    {
+        // The flash page buffer is all 0xFF after `cnFlashBeginWrite()`;
+        // erased words need not be filled in
+        if(pendingLo != 0xFF || byte != 0xFF)
+        {
+            const uint8_t word[2] = { pendingLo, byte };
+            cnFlashFill(writeOffset - 1, sizeof(word), word);
+        }
+    }
+    else
+    {
+        pendingLo = byte;
+    }
+    writeOffset ++;
+}
+
+void cnPageSelect(CNflashAddr addr)
+{
+    pageAddr = addr;
+    writeOffset = 0;
+    headCRC = CN_CRC16_INITVAL;
+    filling = cnFlashBeginWrite(addr);
+}
+
+int cnPageSeek(uintptr_t offset)
+{
+    if(!filling || offset >= CN_FLASH_PAGE_SIZE || offset < writeOffset)
+    {
+        return 0;
+    }
+    while(writeOffset < offset)
+    {
+        streamByte(0xFF);
+    }
+    return 1;
+}
+
+void cnPageWrite(unsigned len, const uint8_t data[len])
+{
+    for(unsigned i = 0; filling && i < len && writeOffset < CN_FLASH_PAGE_SIZE; i ++)
+    {
+        streamByte(data[i]);
+    }
+}
+
+void cnPageFill(uintptr_t offset, unsigned len, uint8_t byte)
+{
+    if(!cnPageSeek(offset))
+    {
+        return;
+    }
+    uintptr_t end = offset + len;
+    end = end < CN_FLASH_PAGE_SIZE ? end : CN_FLASH_PAGE_SIZE;
+    while(writeOffset < end)
+    {
+        streamByte(byte);
+    }
+}
+
+uint16_t cnPageCRC(void)
+{
+    // The rest of the page is still erased
+    uint16_t crc = headCRC;
+    const uint8_t erased = 0xFF;
+    for(uintptr_t offset = writeOffset; offset < CN_FLASH_PAGE_SIZE; offset ++)
+    {
+        crc = cnCRC16Update(crc, 1, &erased);
+    }
+    return crc;
+}
+
+int cnPageCommit(void)
+{
+    if(!filling)
+    {
+        return 0;
+    }
+    if((writeOffset & 1) && pendingLo != 0xFF)
+    {
+        // Flush the last, half-written word
+        const uint8_t word[2] = { pendingLo, 0xFF };
+        cnFlashFill(writeOffset - 1, sizeof(word), word);
+    }
+    filling = 0;
+    return cnFlashEndWrite();
+}
+
+#endif // CN_FLASH_DIRECT_FILL
@@ -0,0 +1,67 @@
+// CANnuccia/src/common/page.h - The page being written to by the master
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef PAGE_H
+#define PAGE_H
+
+#include <stdint.h>
+#include "common/flash.h"
+
+/// Selects the page in flash starting at `addr` for writing.
+/// The contents of the page are reset to all 0xFF (the erased state) and the
+/// write head is rewound to its first byte.
+void cnPageSelect(CNflashAddr addr);
+
+/// Returns the address of the first byte in flash of the selected page.
+CNflashAddr cnPageAddr(void);
+
+/// Moves the write head to `offset` bytes into the selected page.
+/// Returns true on success or false if `offset` is out of bounds.
+///
+/// With `CN_FLASH_DIRECT_FILL`: the write head can only be moved forward; the
+/// bytes that are skipped are left as 0xFF.
+int cnPageSeek(uintptr_t offset);
+
+/// Writes `len` bytes of `data` at the write head, advancing it.
+/// Bytes that would end up past the end of the page are discarded.
+void cnPageWrite(unsigned len, const uint8_t data[len]);
+
+/// Writes `len` repetitions of `byte` starting from `offset` bytes into the
+/// selected page, then moves the write head to the end of the run.
+/// Bytes that would end up past the end of the page are discarded.
+void cnPageFill(uintptr_t offset, unsigned len, uint8_t byte);
+
+#ifndef CN_FLASH_DIRECT_FILL
+
+/// Returns the contents of the selected page (`CN_FLASH_PAGE_SIZE` bytes), as
+/// they are going to be committed to flash.
+const uint8_t *cnPageData(void);
+
+/// Returns where in the selected page the write head points to, and sets
+/// `*outRoom` to the number of bytes left from there to the end of the page.
+/// Write up to `*outRoom` bytes there directly (e.g. via `cnCANRecvInto()`),
+/// then call `cnPageAdvance()`; this is the same as a `cnPageWrite()` of those
+/// bytes, minus a copy.
+uint8_t *cnPageWriteHead(unsigned *outRoom);
+
+/// Advances the write head by `len` bytes written to `cnPageWriteHead()`.
+void cnPageAdvance(unsigned len);
+
+#endif
+
+/// Returns the CRC16 of the whole contents of the selected page.
+uint16_t cnPageCRC(void);
+
+/// Commits the contents of the selected page to flash.
+/// Flash must be unlocked (see `cnFlashUnlock()`).
+/// Returns true on success or false on error.
+///
+/// With `CN_FLASH_DIRECT_FILL`: the page has to be selected and written to
+/// again before it can be committed a second time.
+int cnPageCommit(void);
+
+#endif // PAGE_H
@@ -0,0 +1,146 @@
+// CANnuccia/src/common/sha256.c - Implementation of common/sha256.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/sha256.h"
+
+#include "common/config.h"
+
+#if CN_WITH_DIGEST
+
+// See FIPS 180-4, section 6.2.
+// Written for size rather than speed: the message schedule is kept as a
+// rolling window of 16 words (64 bytes of stack instead of 256), and on AVR
+// the round constants stay in flash.
+
+#ifdef CN_PLATFORM_IS_AVR
+#   include <avr/pgmspace.h>
+#   define K_ATTR PROGMEM
+#   define K(i) pgm_read_dword(&K_[i])
+#else
+#   define K_ATTR
+#   define K(i) K_[i]
+#endif
+
+static const uint32_t K_[64] K_ATTR =
+{
+    0x428A2F98u, 0x71374491u, 0xB5C0FBCFu, 0xE9B5DBA5u, 0x3956C25Bu, 0x59F111F1u, 0x923F82A4u, 0xAB1C5ED5u,
+    0xD807AA98u, 0x12835B01u, 0x243185BEu, 0x550C7DC3u, 0x72BE5D74u, 0x80DEB1FEu, 0x9BDC06A7u, 0xC19BF174u,
+    0xE49B69C1u, 0xEFBE4786u, 0x0FC19DC6u, 0x240CA1CCu, 0x2DE92C6Fu, 0x4A7484AAu, 0x5CB0A9DCu, 0x76F988DAu,
+    0x983E5152u, 0xA831C66Du, 0xB00327C8u, 0xBF597FC7u, 0xC6E00BF3u, 0xD5A79147u, 0x06CA6351u, 0x14292967u,
+    0x27B70A85u, 0x2E1B2138u, 0x4D2C6DFCu, 0x53380D13u, 0x650A7354u, 0x766A0ABBu, 0x81C2C92Eu, 0x92722C85u,
+    0xA2BFE8A1u, 0xA81A664Bu, 0xC24B8B70u, 0xC76C51A3u, 0xD192E819u, 0xD6990624u, 0xF40E3585u, 0x106AA070u,
+    0x19A4C116u, 0x1E376C08u, 0x2748774Cu, 0x34B0BCB5u, 0x391C0CB3u, 0x4ED8AA4Au, 0x5B9CCA4Fu, 0x682E6FF3u,
+    0x748F82EEu, 0x78A5636Fu, 0x84C87814u, 0x8CC70208u, 0x90BEFFFAu, 0xA4506CEBu, 0xBEF9A3F7u, 0xC67178F2u,
+};
+
+/// Rotates `x` right by `n` bits.
+inline static uint32_t ror(uint32_t x, unsigned n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+/// Hashes `ctx->block` into `ctx->h`.
+static void compress(CNsha256 *ctx)
+{
+    uint32_t w[16];
+    for(unsigned i = 0; i < 16; i ++)
+    {
+        const uint8_t *b = &ctx->block[i * 4];
+        w[i] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    }
+
+    uint32_t v[8];
+    for(unsigned i = 0; i < 8; i ++)
+    {
+        v[i] = ctx->h[i];
+    }
+
+    for(unsigned t = 0; t < 64; t ++)
+    {
+        if(t >= 16)
+        {
+            // w[t % 16] still holds W(t - 16)
+            uint32_t w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+            uint32_t s0 = ror(w15, 7) ^ ror(w15, 18) ^ (w15 >> 3);
+            uint32_t s1 = ror(w2, 17) ^ ror(w2, 19) ^ (w2 >> 10);
+            w[t & 15] += s0 + w[(t - 7) & 15] + s1;
+        }
+
+        uint32_t a = v[0], e = v[4];
+        uint32_t t1 = v[7] + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25))
+                    + ((e & v[5]) ^ (~e & v[6])) + K(t) + w[t & 15];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22))
+                    + ((a & v[1]) ^ (a & v[2]) ^ (v[1] & v[2]));
+        for(unsigned i = 7; i > 0; i --)
+        {
+            v[i] = v[i - 1];
+        }
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+
+    for(unsigned i = 0; i < 8; i ++)
+    {
+        ctx->h[i] += v[i];
+    }
+}
+
+void cnSHA256Init(CNsha256 *ctx)
+{
+    static const uint32_t H0[8] =
+    {
+        0x6A09E667u, 0xBB67AE85u, 0x3C6EF372u, 0xA54FF53Au,
+        0x510E527Fu, 0x9B05688Cu, 0x1F83D9ABu, 0x5BE0CD19u,
+    };
+    for(unsigned i = 0; i < 8; i ++)
+    {
+        ctx->h[i] = H0[i];
+    }
+    ctx->len = 0;
+}
+
+void cnSHA256Update(CNsha256 *ctx, unsigned len, const uint8_t data[len])
+{
+    for(unsigned i = 0; i < len; i ++)
+    {
+        ctx->block[ctx->len % 64] = data[i];
+        ctx->len ++;
+        if(ctx->len % 64 == 0)
+        {
+            compress(ctx);
+        }
+    }
+}
+
+void cnSHA256Final(CNsha256 *ctx, uint8_t outDigest[static CN_SHA256_SIZE])
+{
+    // Pad with a single 1 bit, then zeroes up to 8 bytes before the end of a
+    // block, then append the message length in bits (big endian)
+    uint32_t len = ctx->len;
+    const uint8_t one = 0x80, zero = 0x00;
+    cnSHA256Update(ctx, 1, &one);
+    while(ctx->len % 64 != 56)
+    {
+        cnSHA256Update(ctx, 1, &zero);
+    }
+    const uint8_t lenBytes[8] =
+    {
+        0x00, 0x00, 0x00, (uint8_t)(len >> 29),
+        (uint8_t)(len >> 21), (uint8_t)(len >> 13), (uint8_t)(len >> 5), (uint8_t)(len << 3),
+    };
+    cnSHA256Update(ctx, sizeof(lenBytes), lenBytes);
+
+    for(unsigned i = 0; i < 8; i ++)
+    {
+        outDigest[i * 4 + 0] = (uint8_t)(ctx->h[i] >> 24);
+        outDigest[i * 4 + 1] = (uint8_t)(ctx->h[i] >> 16);
+        outDigest[i * 4 + 2] = (uint8_t)(ctx->h[i] >> 8);
+        outDigest[i * 4 + 3] = (uint8_t)ctx->h[i];
+    }
+}
+
+#endif // CN_WITH_DIGEST
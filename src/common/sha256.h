@@ -0,0 +1,35 @@
+// CANnuccia/src/common/sha256.h - Streaming SHA-256
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+
+/// The size of a SHA-256 digest, in bytes.
+#define CN_SHA256_SIZE 32
+
+/// The state of a SHA-256 computation, see `cnSHA256Init()`.
+typedef struct CNsha256
+{
+    uint32_t h[8]; ///< The intermediate hash value.
+    uint32_t len; ///< Number of bytes hashed so far.
+    uint8_t block[64]; ///< The current, partially filled in, input block.
+
+} CNsha256;
+
+/// Starts a new SHA-256 computation in `ctx`.
+void cnSHA256Init(CNsha256 *ctx);
+
+/// Hashes the next `len` bytes of `data` into `ctx`.
+void cnSHA256Update(CNsha256 *ctx, unsigned len, const uint8_t data[len]);
+
+/// Ends the SHA-256 computation in `ctx`, writing its digest to `outDigest`.
+/// `ctx` has to be `cnSHA256Init()`ed again before being reused.
+void cnSHA256Final(CNsha256 *ctx, uint8_t outDigest[static CN_SHA256_SIZE]);
+
+#endif // SHA256_H
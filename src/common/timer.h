@@ -29,4 +29,11 @@ int cnTimerStart(uint32_t delayUs, int oneshot, CNtimeoutFunc onTimeout);
 /// This aborts any pending calls to the timeout function.
 void cnTimerStop(void);
 
+/// Busy-waits for (at least) `delayUs` microseconds.
+/// Does not interfere with the timer started via `cnTimerStart()`.
+///
+/// On STM32: uses SysTick, counting system clock cycles.
+/// On AVR: uses `_delay_us()` in a loop.
+void cnDelayUs(uint16_t delayUs);
+
 #endif // TIMER_H
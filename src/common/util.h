@@ -9,23 +9,27 @@
 #define UTIL_H
 
 #include <stdint.h>
+#include "common/cc.h"
+
+// (the byte order helpers are always inlined, so that they can be used by
+// `CN_RAMFUNC`s)
 
 /// Reads a little-endian U16 from 2 bytes.
-inline static uint16_t cnReadU16LE(const uint8_t bytes[static 2])
+inline static CN_ALWAYS_INLINE uint16_t cnReadU16LE(const uint8_t bytes[static 2])
 {
     return bytes[0]
             | (uint16_t)(bytes[1] << 8);
 }
 
 /// Converts a little-endian U16 to 2 bytes.
-inline static void cnWriteU16LE(uint8_t outBytes[static 2], uint16_t u16)
+inline static CN_ALWAYS_INLINE void cnWriteU16LE(uint8_t outBytes[static 2], uint16_t u16)
 {
     outBytes[0] = (u16 & 0x00FFu);
     outBytes[1] = (u16 & 0xFF00u) >> 8;
 }
 
 /// Reads a little-endian U32 from 4 bytes.
-inline static uint32_t cnReadU32LE(const uint8_t bytes[static 4])
+inline static CN_ALWAYS_INLINE uint32_t cnReadU32LE(const uint8_t bytes[static 4])
 {
     return bytes[0]
             | (uint32_t)bytes[1] << 8
@@ -34,7 +38,7 @@ inline static uint32_t cnReadU32LE(const uint8_t bytes[static 4])
 }
 
 /// Converts a little-endian U32 to 4 bytes.
-inline static void cnWriteU32LE(uint8_t outBytes[static 4], uint32_t u32)
+inline static CN_ALWAYS_INLINE void cnWriteU32LE(uint8_t outBytes[static 4], uint32_t u32)
 {
     outBytes[0] = (u32 & 0x000000FFu);
     outBytes[1] = (u32 & 0x0000FF00u) >> 8;
@@ -71,7 +75,13 @@ inline static int cnLog2I(unsigned n)
 /// The polynomial used by `cnCRC16()` (CRC16/XMODEM).
 #define CN_CRC16_POLYNOMIAL 0x1021
 
+/// Updates the CRC16/XMODEM `crc` with the next `len` bytes of `data`.
+uint16_t cnCRC16Update(uint16_t crc, unsigned len, const uint8_t data[len]);
+
 /// Calculates the CRC16/XMODEM of a byte buffer.
-uint16_t cnCRC16(unsigned len, const uint8_t data[len]);
+inline static uint16_t cnCRC16(unsigned len, const uint8_t data[len])
+{
+    return cnCRC16Update(CN_CRC16_INITVAL, len, data);
+}
 
 #endif // UTIL_H
@@ -0,0 +1,30 @@
+# CANnuccia/src/linux/Linux.cmake - Settings for the Linux (SocketCAN) port
+#
+# Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+# Included by src/CMakeLists.txt when building natively on Linux (no toolchain
+# file): CANnuccia runs as a process, talking over SocketCAN interfaces and
+# emulating the flash of a STM32F103C8 in a file (see linux/flash.c).
+
+set(LINUX_BOOTLOADER_SIZE 4096 CACHE STRING "The size reserved to the bootloader at the start of the emulated flash, in bytes (a multiple of the page size)")
+set(LINUX_CAN_BUSES 2 CACHE STRING "The number of CAN buses (SocketCAN interfaces) to use")
+# Relay messages for devices behind the second bus (see CN_WITH_GATEWAY in
+# common/config.h)
+set(CN_GATEWAY OFF CACHE BOOL "Act as a gateway to the devices on the second CAN bus")
+
+add_definitions(
+    -DCN_FLASH_PAGE_SIZE=0x400u # 1kB pages, as on STM32F103C8
+    -DCN_FLASH_PAGE_MASK=0xFFFFFC00u
+    -DCN_FLASH_BOOTLOADER_SIZE=${LINUX_BOOTLOADER_SIZE}u
+    -DCN_E_MACHINE=0x0028u # AARCH32, so that STM32 images can be uploaded as they are
+    -DCN_PLATFORM_IS_LINUX=1
+    -DCN_CAN_BUSES=${LINUX_CAN_BUSES}
+    -D_DEFAULT_SOURCE
+)
+if(CN_GATEWAY)
+    add_definitions(-DCN_WITH_GATEWAY=1)
+endif()
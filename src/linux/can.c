@@ -0,0 +1,357 @@
+// CANnuccia/src/linux/can.c - Linux (SocketCAN) implementation of common/can.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/can.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "common/handoff.h"
+
+// Each bus is a SocketCAN interface: bus `n` is the interface named by the
+// CN_CAN<n> environment variable, or "vcan<n>" if it is not set.
+// Each lane is a raw CAN socket bound to that interface, with the lane's
+// filters set on it; the control lane's socket is also used to send.
+// Sent frames are queued by the kernel, so there is no TX queue here.
+
+const unsigned CN_CAN_RATE = 1000000u; // (only reported; set by `ip link` on real interfaces)
+
+/// How long `cnCANBusRecv()` waits for a message when there is none, in ms;
+/// keeps the message pump from spinning at 100% CPU.
+#define RECV_WAIT_MS 1
+
+/// The state of a bus.
+typedef struct Bus
+{
+    int sockets[2]; ///< Raw CAN sockets, indexed by `CN_CAN_LANE_*`; -1 if not open.
+    struct can_filter filters[2][CN_CAN_CONTROL_FILTERS]; ///< Filters set on each lane.
+    unsigned nFilters[2]; ///< Number of valid entries in `filters`, per lane.
+    struct can_frame peeked; ///< The frame last returned by `cnCANBusPeek()`.
+    int hasPeeked; ///< True if `peeked` was not received yet.
+
+} Bus;
+
+static Bus buses[CN_CAN_BUSES] =
+{
+    [0 ... CN_CAN_BUSES - 1] = { { -1, -1 }, { { { 0, 0 } } }, { 0, 0 }, { 0 }, 0 },
+};
+
+/// The filter set with `cnCANInit()`, see `cnCANHandoff()`.
+static uint32_t filterId = 0, filterMask = 0;
+
+/// Converts a CAN id in the format of `cnCANSend()` to a SocketCAN id.
+static canid_t toCanId(uint32_t id)
+{
+    canid_t canId = (id & 0x00000004u) ? (((id >> 3) & CAN_EFF_MASK) | CAN_EFF_FLAG)
+                                       : ((id >> 21) & CAN_SFF_MASK);
+    if(id & CN_CAN_RTR)
+    {
+        canId |= CAN_RTR_FLAG;
+    }
+    return canId;
+}
+
+/// Converts a SocketCAN id to a CAN id in the format of `cnCANRecv()`.
+static uint32_t fromCanId(canid_t canId)
+{
+    uint32_t id = (canId & CAN_EFF_FLAG) ? (((canId & CAN_EFF_MASK) << 3) | 0x00000004u)
+                                         : ((canId & CAN_SFF_MASK) << 21);
+    if(canId & CAN_RTR_FLAG)
+    {
+        id |= CN_CAN_RTR;
+    }
+    return id;
+}
+
+/// Converts a filter (id, mask) pair in the format of `cnCANSetFilter()` to a
+/// SocketCAN filter.
+static struct can_filter toCanFilter(uint32_t id, uint32_t mask)
+{
+    struct can_filter filter;
+    filter.can_id = toCanId(id);
+    filter.can_mask = (id & 0x00000004u) ? ((mask >> 3) & CAN_EFF_MASK) : ((mask >> 21) & CAN_SFF_MASK);
+    if(mask & 0x00000004u)
+    {
+        filter.can_mask |= CAN_EFF_FLAG;
+    }
+    if(mask & CN_CAN_RTR)
+    {
+        filter.can_mask |= CAN_RTR_FLAG;
+    }
+    return filter;
+}
+
+/// Opens a raw CAN socket bound to the interface of bus `bus`, that receives
+/// nothing until filters are set. Returns the socket, or -1 on error.
+static int openSocket(unsigned bus)
+{
+    char envName[16], defaultIface[IFNAMSIZ];
+    snprintf(envName, sizeof(envName), "CN_CAN%u", bus);
+    snprintf(defaultIface, sizeof(defaultIface), "vcan%u", bus);
+    const char *iface = getenv(envName) ? getenv(envName) : defaultIface;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    if(snprintf(ifr.ifr_name, IFNAMSIZ, "%s", iface) >= IFNAMSIZ)
+    {
+        // (would be truncated to the name of another interface)
+        fprintf(stderr, "%s: interface name too long\n", iface);
+        return -1;
+    }
+
+    int sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if(sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    if(ioctl(sock, SIOCGIFINDEX, &ifr) < 0
+       || (addr.can_ifindex = ifr.ifr_ifindex,
+           bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+       || setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0)
+    {
+        perror(iface);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/// Closes all sockets of bus `bus`.
+static void closeBus(unsigned bus)
+{
+    for(unsigned lane = 0; lane < 2; lane ++)
+    {
+        if(buses[bus].sockets[lane] >= 0)
+        {
+            close(buses[bus].sockets[lane]);
+            buses[bus].sockets[lane] = -1;
+        }
+        buses[bus].nFilters[lane] = 0;
+    }
+    buses[bus].hasPeeked = 0;
+}
+
+int cnCANBusInit(unsigned bus, uint32_t id, uint32_t mask)
+{
+    if(bus >= CN_CAN_BUSES)
+    {
+        return 0;
+    }
+    for(unsigned lane = 0; lane < 2; lane ++)
+    {
+        if(buses[bus].sockets[lane] < 0 && (buses[bus].sockets[lane] = openSocket(bus)) < 0)
+        {
+            closeBus(bus);
+            return 0;
+        }
+    }
+    if(bus == 0)
+    {
+        filterId = id;
+        filterMask = mask;
+    }
+    return cnCANBusSetFilter(bus, CN_CAN_LANE_CONTROL, 0, id, mask);
+}
+
+int cnCANBusSetFilter(unsigned bus, unsigned lane, unsigned n, uint32_t id, uint32_t mask)
+{
+    unsigned maxFilters = (lane == CN_CAN_LANE_DATA) ? CN_CAN_DATA_FILTERS : CN_CAN_CONTROL_FILTERS;
+    if(bus >= CN_CAN_BUSES || lane > CN_CAN_LANE_DATA || n >= maxFilters
+       || buses[bus].sockets[lane] < 0)
+    {
+        return 0;
+    }
+
+    // Filters are set all at once on a socket; unset filters (below `n`)
+    // are made to match nothing
+    Bus *b = &buses[bus];
+    while(b->nFilters[lane] <= n)
+    {
+        b->filters[lane][b->nFilters[lane] ++] = toCanFilter(0xFFFFFFFCu, 0xFFFFFFFEu);
+    }
+    b->filters[lane][n] = toCanFilter(id, mask);
+    return setsockopt(b->sockets[lane], SOL_CAN_RAW, CAN_RAW_FILTER,
+                      b->filters[lane], b->nFilters[lane] * sizeof(struct can_filter)) == 0;
+}
+
+int cnCANBusSend(unsigned bus, uint32_t id, unsigned len, const uint8_t data[len])
+{
+    if(bus >= CN_CAN_BUSES || buses[bus].sockets[CN_CAN_LANE_CONTROL] < 0)
+    {
+        return -1;
+    }
+
+    struct can_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = toCanId(id);
+    frame.can_dlc = (uint8_t)(len > 8 ? 8 : len);
+    memcpy(frame.data, data, frame.can_dlc);
+
+    // (waits for the kernel's TX queue to make room, like the other targets
+    // wait for theirs - and gives up after about a second, like they do)
+    for(unsigned tries = 0;
+        write(buses[bus].sockets[CN_CAN_LANE_CONTROL], &frame, sizeof(frame)) != sizeof(frame);
+        tries ++)
+    {
+        if((errno != ENOBUFS && errno != EAGAIN && errno != EINTR) || tries >= 10000u)
+        {
+            return -1;
+        }
+        usleep(100);
+    }
+    return frame.can_dlc;
+}
+
+void cnCANBusFlush(unsigned bus)
+{
+    // Frames are handed to the kernel by `cnCANBusSend()` already
+    (void)bus;
+}
+
+int cnCANBusPeek(unsigned bus, uint32_t *recvId)
+{
+    if(bus >= CN_CAN_BUSES || buses[bus].sockets[0] < 0)
+    {
+        return -1;
+    }
+    Bus *b = &buses[bus];
+    if(b->hasPeeked)
+    {
+        *recvId = fromCanId(b->peeked.can_id);
+        return b->peeked.can_dlc;
+    }
+
+    struct pollfd fds[2] =
+    {
+        { buses[bus].sockets[CN_CAN_LANE_CONTROL], POLLIN, 0 },
+        { buses[bus].sockets[CN_CAN_LANE_DATA], POLLIN, 0 },
+    };
+    if(poll(fds, 2, RECV_WAIT_MS) <= 0)
+    {
+        return -1;
+    }
+
+    // Control lane first
+    for(unsigned lane = 0; lane < 2; lane ++)
+    {
+        // (frames can only be read from a socket whole, so the frame is kept
+        // aside until `cnCANBusRecvInto()`)
+        if((fds[lane].revents & POLLIN)
+           && read(fds[lane].fd, &b->peeked, sizeof(b->peeked)) == sizeof(b->peeked))
+        {
+            b->peeked.can_dlc = b->peeked.can_dlc <= 8 ? b->peeked.can_dlc : 8;
+            b->hasPeeked = 1;
+            *recvId = fromCanId(b->peeked.can_id);
+            return b->peeked.can_dlc;
+        }
+    }
+    return -1;
+}
+
+int cnCANBusRecvInto(unsigned bus, unsigned maxLen, uint8_t data[maxLen])
+{
+    uint32_t recvId;
+    if(cnCANBusPeek(bus, &recvId) < 0)
+    {
+        return -1;
+    }
+    Bus *b = &buses[bus];
+    unsigned len = b->peeked.can_dlc < maxLen ? b->peeked.can_dlc : maxLen;
+    memcpy(data, b->peeked.data, len);
+    b->hasPeeked = 0;
+    return (int)len;
+}
+
+int cnCANBusRecv(unsigned bus, uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+{
+    if(cnCANBusPeek(bus, recvId) < 0)
+    {
+        return -1;
+    }
+    return cnCANBusRecvInto(bus, maxLen, data);
+}
+
+int cnCANInit(uint32_t id, uint32_t mask)
+{
+    return cnCANBusInit(0, id, mask);
+}
+
+int cnCANSetFilter(unsigned lane, unsigned n, uint32_t id, uint32_t mask)
+{
+    return cnCANBusSetFilter(0, lane, n, id, mask);
+}
+
+int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len])
+{
+    return cnCANBusSend(0, id, len, data);
+}
+
+void cnCANFlush(void)
+{
+    cnCANBusFlush(0);
+}
+
+int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+{
+    return cnCANBusRecv(0, recvId, maxLen, data);
+}
+
+int cnCANPeek(uint32_t *recvId)
+{
+    return cnCANBusPeek(0, recvId);
+}
+
+int cnCANRecvInto(unsigned maxLen, uint8_t data[maxLen])
+{
+    return cnCANBusRecvInto(0, maxLen, data);
+}
+
+int cnCANSetLoopback(int on)
+{
+    // The data lane's socket receives what the control lane's sends already
+    // (as SocketCAN loops sent frames back to other sockets); the control
+    // lane's has to be asked to receive its own
+    int recvOwn = on ? 1 : 0;
+    return buses[0].sockets[CN_CAN_LANE_CONTROL] >= 0
+           && setsockopt(buses[0].sockets[CN_CAN_LANE_CONTROL], SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS,
+                         &recvOwn, sizeof(recvOwn)) == 0;
+}
+
+void cnCANHandoff(volatile struct CNhandoff *handoff)
+{
+    // Sockets can not outlive the process, so there is nothing to leave
+    // running; only describe what was set up
+    handoff->sysClockHz = 0;
+    handoff->canClockHz = 0;
+    handoff->canRate = CN_CAN_RATE;
+    handoff->canBitTiming = 0;
+    handoff->canFilterId = filterId;
+    handoff->canFilterMask = filterMask;
+    handoff->devIdFlags = 0;
+    cnCANDeinit();
+}
+
+void cnCANDeinit(void)
+{
+    for(unsigned bus = 0; bus < CN_CAN_BUSES; bus ++)
+    {
+        closeBus(bus);
+    }
+}
@@ -0,0 +1,31 @@
+// CANnuccia/src/linux/debug.c - Linux implementation of common/debug.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/debug.h"
+
+#include <stdio.h>
+
+// The debug "LED" is a line on stderr each time it changes.
+
+int cnDebugInit(void)
+{
+    return 1;
+}
+
+void cnDebugLed(int on)
+{
+    fprintf(stderr, "[cn] LED %s\n", on ? "on" : "off");
+}
+
+#if CN_WITH_STARTUP_BENCH
+
+void cnDebugBenchStamp(unsigned n)
+{
+    fprintf(stderr, "[cn] bench stamp %u\n", n);
+}
+
+#endif // CN_WITH_STARTUP_BENCH
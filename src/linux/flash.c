@@ -0,0 +1,296 @@
+// CANnuccia/src/linux/flash.c - Linux implementation of common/flash.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/flash.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common/handoff.h"
+
+// Flash is emulated by a file (named by the CN_FLASH_FILE environment
+// variable, or "cn_flash.bin"), laid out like the flash of a STM32F103C8:
+// 64kB of 1kB pages at 0x08000000, the first `CN_FLASH_BOOTLOADER_SIZE` bytes
+// belonging to the bootloader and the page journal in the last page.
+// The file is loaded on unlock; each committed page and each change to the
+// journal is written back to it right away, like to real flash, so that an
+// upload interrupted by killing the process can be resumed.
+
+#define FLASH_START 0x08000000u
+#define FLASH_SIZE 0x10000u
+
+/// The hand-off record; on Linux it is just a variable (see common/handoff.h).
+CNhandoff cnLinuxHandoff;
+
+/// The contents of flash; erased flash reads as all ones.
+static uint8_t flash[FLASH_SIZE];
+
+/// True after the contents of flash were loaded from the file.
+static int loaded = 0;
+
+/// True if flash is unlocked.
+static int unlocked = 0;
+
+/// The address of the page currently being programmed.
+static CNflashAddr curPageAddr = 0;
+
+/// Returns the path of the flash file.
+static const char *flashPath(void)
+{
+    const char *path = getenv("CN_FLASH_FILE");
+    return path ? path : "cn_flash.bin";
+}
+
+/// Loads the contents of flash from the file, unless already done; a missing
+/// or short file reads as erased flash.
+static void loadFlash(void)
+{
+    if(loaded)
+    {
+        return;
+    }
+    memset(flash, 0xFF, sizeof(flash));
+    FILE *file = fopen(flashPath(), "rb");
+    if(file)
+    {
+        size_t n = fread(flash, 1, sizeof(flash), file);
+        (void)n;
+        fclose(file);
+    }
+    loaded = 1;
+}
+
+/// Writes the contents of flash back to the file.
+static int storeFlash(void)
+{
+    FILE *file = fopen(flashPath(), "wb");
+    if(!file)
+    {
+        perror(flashPath());
+        return 0;
+    }
+    int ok = fwrite(flash, sizeof(flash), 1, file) == 1;
+    return (fclose(file) == 0) && ok;
+}
+
+/// Returns the emulated flash memory at (virtual) address `addr`.
+static uint8_t *flashPtr(CNflashAddr addr)
+{
+    return &flash[addr - FLASH_START];
+}
+
+/// Writes the page at `pageAddr` back to the file (or all of flash, if the
+/// file does not exist yet).
+static int storePage(CNflashAddr pageAddr)
+{
+    FILE *file = fopen(flashPath(), "r+b");
+    if(!file)
+    {
+        return storeFlash();
+    }
+    int ok = fseek(file, (long)(pageAddr - FLASH_START), SEEK_SET) == 0
+             && fwrite(flashPtr(pageAddr), CN_FLASH_PAGE_SIZE, 1, file) == 1;
+    return (fclose(file) == 0) && ok;
+}
+
+#if CN_WITH_JOURNAL
+
+/// The page journal lives in the last page of flash, which is never handed
+/// out to the user program.
+#define JOURNAL_ADDR (FLASH_START + FLASH_SIZE - CN_FLASH_PAGE_SIZE)
+
+/// Layout of the journal page, the same as on STM32.
+/// An erased journal has no image, no digest and no committed pages;
+/// committing page `n` programs `marks[n]` to zero.
+struct Journal
+{
+    uint16_t imageIdLo;
+    uint16_t imageIdHi;
+    uint16_t digestPages; ///< Programmed last, after `digest`.
+    uint16_t digest[CN_SHA256_SIZE / 2];
+    uint16_t marks[(CN_FLASH_PAGE_SIZE - 6 - CN_SHA256_SIZE) / 2];
+};
+#define JOURNAL ((struct Journal *)flashPtr(JOURNAL_ADDR))
+
+#endif // CN_WITH_JOURNAL
+
+
+CNflashAddr cnFlashStart(void)
+{
+    return FLASH_START;
+}
+
+CNflashAddr cnFlashSize(void)
+{
+    return FLASH_SIZE;
+}
+
+int cnFlashPageWriteable(CNflashAddr addr)
+{
+    CNflashAddr minAddr = FLASH_START + CN_FLASH_BOOTLOADER_SIZE;
+#if CN_WITH_JOURNAL
+    CNflashAddr maxAddr = JOURNAL_ADDR; // (the journal page is not writeable)
+#else
+    CNflashAddr maxAddr = FLASH_START + FLASH_SIZE;
+#endif
+    return addr >= minAddr && (addr + CN_FLASH_PAGE_SIZE) <= maxAddr;
+}
+
+int cnFlashUnlock(void)
+{
+    loadFlash();
+    unlocked = 1;
+    return 1;
+}
+
+int cnFlashLock(void)
+{
+    if(unlocked)
+    {
+        unlocked = 0;
+        return storeFlash();
+    }
+    return 1;
+}
+
+int cnFlashBeginWrite(CNflashAddr addr)
+{
+    if(!unlocked || !cnFlashPageWriteable(addr & CN_FLASH_PAGE_MASK))
+    {
+        return 0;
+    }
+    memset(flashPtr(addr & CN_FLASH_PAGE_MASK), 0xFF, CN_FLASH_PAGE_SIZE);
+    curPageAddr = addr & CN_FLASH_PAGE_MASK;
+    return 1;
+}
+
+unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
+{
+    if(!curPageAddr || offset + size > CN_FLASH_PAGE_SIZE)
+    {
+        return 0;
+    }
+
+    // (like NOR flash, programming can only clear bits)
+    uint8_t *dest = flashPtr(curPageAddr + offset);
+    for(unsigned i = 0; i < size; i ++)
+    {
+        dest[i] &= data[i];
+    }
+    return size;
+}
+
+int cnFlashEndWrite(void)
+{
+    if(!curPageAddr)
+    {
+        return 0;
+    }
+    int stored = storePage(curPageAddr);
+    curPageAddr = 0;
+    return stored;
+}
+
+void cnFlashRead(CNflashAddr addr, unsigned len, uint8_t out[len])
+{
+    loadFlash();
+    memcpy(out, flashPtr(addr), len);
+}
+
+#if CN_WITH_JOURNAL
+
+uint32_t cnJournalImageId(void)
+{
+    loadFlash();
+    return JOURNAL->imageIdLo | ((uint32_t)JOURNAL->imageIdHi << 16);
+}
+
+int cnJournalReset(uint32_t imageId)
+{
+    if(!unlocked || curPageAddr)
+    {
+        return 0;
+    }
+    memset(JOURNAL, 0xFF, CN_FLASH_PAGE_SIZE);
+    JOURNAL->imageIdLo = (uint16_t)(imageId & 0xFFFFu);
+    JOURNAL->imageIdHi = (uint16_t)(imageId >> 16);
+    return storePage(JOURNAL_ADDR);
+}
+
+int cnJournalMark(unsigned page)
+{
+    const unsigned N_MARKS = sizeof(JOURNAL->marks) / sizeof(JOURNAL->marks[0]);
+    if(page >= N_MARKS || !unlocked || curPageAddr)
+    {
+        return 0;
+    }
+    JOURNAL->marks[page] = 0x0000u;
+    return storePage(JOURNAL_ADDR);
+}
+
+int cnJournalMarked(unsigned page)
+{
+    const unsigned N_MARKS = sizeof(JOURNAL->marks) / sizeof(JOURNAL->marks[0]);
+    loadFlash();
+    return page < N_MARKS && JOURNAL->marks[page] == 0x0000u;
+}
+
+#if CN_WITH_DIGEST
+
+int cnJournalSetDigest(unsigned nPages, const uint8_t digest[static CN_SHA256_SIZE])
+{
+    if(!unlocked || curPageAddr || JOURNAL->digestPages != 0xFFFFu)
+    {
+        return 0;
+    }
+    memcpy(JOURNAL->digest, digest, CN_SHA256_SIZE); // (little endian halfwords, as on STM32)
+    JOURNAL->digestPages = (uint16_t)nPages;
+    return storePage(JOURNAL_ADDR);
+}
+
+unsigned cnJournalDigest(uint8_t outDigest[static CN_SHA256_SIZE])
+{
+    loadFlash();
+    unsigned nPages = JOURNAL->digestPages;
+    if(nPages == 0xFFFFu)
+    {
+        return 0;
+    }
+    memcpy(outDigest, JOURNAL->digest, CN_SHA256_SIZE);
+    return nPages;
+}
+
+#endif // CN_WITH_DIGEST
+
+#endif // CN_WITH_JOURNAL
+
+uint8_t cnReadDevId(void)
+{
+    const char *devId = getenv("CN_DEV_ID");
+    return devId ? (uint8_t)strtoul(devId, NULL, 0) : 0xFF;
+}
+
+void cnReadUid(uint8_t outUid[static CN_UID_SIZE])
+{
+    // Up to `CN_UID_SIZE` bytes in hex, first byte first, from `CN_UID`; the
+    // rest is zero
+    const char *uid = getenv("CN_UID");
+    memset(outUid, 0x00, CN_UID_SIZE);
+    for(unsigned i = 0; uid && i < CN_UID_SIZE && uid[i * 2] && uid[i * 2 + 1]; i ++)
+    {
+        const char byte[3] = { uid[i * 2], uid[i * 2 + 1], '\0' };
+        outUid[i] = (uint8_t)strtoul(byte, NULL, 16);
+    }
+}
+
+__attribute__((noreturn)) void cnJumpToProgram(void)
+{
+    // There is no user program to jump to; report what would have been run
+    printf("Jumping to user program at 0x%08X\n", FLASH_START + CN_FLASH_BOOTLOADER_SIZE);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,66 @@
+// CANnuccia/src/linux/timer.c - Linux implementation of common/timer.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/timer.h"
+
+#include <stddef.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+// The timer is the process' real-time interval timer; its SIGALRM handler
+// stands in for the timer ISR of the other targets.
+
+/// The function to run on timer timeout, as set by `cnTimerStart()`.
+static CNtimeoutFunc timeoutFunc = NULL;
+
+static void onAlarm(int signum)
+{
+    (void)signum;
+    if(timeoutFunc)
+    {
+        timeoutFunc();
+    }
+}
+
+int cnTimerStart(uint32_t delayUs, int oneshot, CNtimeoutFunc onTimeout)
+{
+    if(delayUs == 0 || !onTimeout)
+    {
+        // Invalid args
+        return 0;
+    }
+
+    timeoutFunc = onTimeout;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onAlarm;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_value.tv_sec = delayUs / 1000000u;
+    timer.it_value.tv_usec = delayUs % 1000000u;
+    timer.it_interval = oneshot ? (struct timeval){ 0, 0 } : timer.it_value;
+    return setitimer(ITIMER_REAL, &timer, NULL) == 0;
+}
+
+void cnTimerStop(void)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_REAL, &timer, NULL);
+    timeoutFunc = NULL;
+}
+
+void cnDelayUs(uint16_t delayUs)
+{
+    struct timespec delay = { 0, (long)delayUs * 1000L };
+    while(nanosleep(&delay, &delay) != 0) { }
+}
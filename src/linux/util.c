@@ -0,0 +1,27 @@
+// CANnuccia/src/linux/util.c - Linux implementation of common/util.h
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "common/util.h"
+
+uint16_t cnCRC16Update(uint16_t crc16, unsigned len, const uint8_t data[len])
+{
+    // CRC16/XMODEM. See: http://mdfs.net/Info/Comp/Comms/CRC16.htm
+    unsigned crc = crc16;
+    for(const uint8_t *it = data; it < (data + len); it ++)
+    {
+        crc ^= (unsigned)(*it << 8);
+        for(int i = 0; i < 8; i ++)
+        {
+            crc <<= 1;
+            if(crc & 0x10000u)
+            {
+                crc = (crc ^ CN_CRC16_POLYNOMIAL) & 0xFFFFu;
+            }
+        }
+    }
+    return (uint16_t)crc;
+}
@@ -10,6 +10,50 @@ set(ARM_CPU "cortex-m3" CACHE STRING "The type of ARM core to compile for")
 set(ARM_PREFIX "arm-none-eabi" CACHE STRING "The prefix of the ARM crosscompiler toolchain")
 set(STM32_PART "stm32f103c8" CACHE STRING "The STM32 chip's part name")
 
+# A minimal build leaves out all optional features (see common/config.h) so
+# that the bootloader fits in two 1kB pages, returning the other two to the
+# user program.
+set(CN_MINIMAL OFF CACHE BOOL "Size-optimized build with optional features left out")
+if(CN_MINIMAL)
+    set(STM32_DEFAULT_BOOTLOADER_SIZE 2048)
+else()
+    set(STM32_DEFAULT_BOOTLOADER_SIZE 4096)
+endif()
+# Records how long it takes from reset to listening for CAN messages and to
+# jumping to the user program in backup registers (see common/debug.h)
+set(STM32_STARTUP_BENCH OFF CACHE BOOL "Record startup time benchmark figures in backup registers")
+
+set(STM32_BOOTLOADER_SIZE ${STM32_DEFAULT_BOOTLOADER_SIZE} CACHE STRING "The size reserved to the bootloader at the start of flash, in bytes (a multiple of the page size)")
+
+# Flash geometry, from the flash size code of the part (the last character of
+# its name; the size itself is in the part's linker script): low- and
+# medium-density devices (up to 128kB) have 1kB pages, high- and XL-density
+# devices 2kB pages. XL-density devices (768kB and 1MB) also have a second
+# flash bank, with its own registers.
+string(TOLOWER "${STM32_PART}" STM32_PART_LOWER)
+string(REGEX MATCH ".$" STM32_FLASH_CODE "${STM32_PART_LOWER}")
+if(STM32_FLASH_CODE MATCHES "^[cdefg]$")
+    set(STM32_PAGE_SIZE 2048)
+else()
+    set(STM32_PAGE_SIZE 1024)
+endif()
+math(EXPR STM32_PAGE_MASK "0xFFFFFFFF & ~(${STM32_PAGE_SIZE} - 1)" OUTPUT_FORMAT HEXADECIMAL)
+# RAM size, also from the flash size code; the stack and the hand-off record
+# are at the end of RAM (see common/handoff.h)
+if(STM32_FLASH_CODE STREQUAL "4")
+    set(STM32_RAM_SIZE 6144)
+elseif(STM32_FLASH_CODE STREQUAL "6")
+    set(STM32_RAM_SIZE 10240)
+elseif(STM32_FLASH_CODE MATCHES "^[8b]$")
+    set(STM32_RAM_SIZE 20480)
+elseif(STM32_FLASH_CODE STREQUAL "c")
+    set(STM32_RAM_SIZE 49152)
+elseif(STM32_FLASH_CODE MATCHES "^[de]$")
+    set(STM32_RAM_SIZE 65536)
+else()
+    set(STM32_RAM_SIZE 98304)
+endif()
+
 set(CMAKE_SYSTEM_NAME Generic)
 set(CMAKE_SYSTEM_PROCESSOR arm-stm32)
 
@@ -21,10 +65,12 @@ set(CMAKE_CXX_COMPILER "${ARM_PREFIX}-g++")
 set(CMAKE_CXX_COMPILER_TARGET "${ARM_PREFIX}")
 set(CMAKE_CXX_COMPILER_ID GNU)
 set(CMAKE_CXX_COMPILER_FORCED YES)
+set(CMAKE_NM "${ARM_PREFIX}-nm")
+set(CMAKE_SIZE "${ARM_PREFIX}-size")
 
-set(CMAKE_C_FLAGS_DEBUG "-g -Og -mthumb -mcpu=${ARM_CPU} -flto -fstrict-volatile-bitfields")
+set(CMAKE_C_FLAGS_DEBUG "-g -Og -mthumb -mcpu=${ARM_CPU} -flto -fstrict-volatile-bitfields -ffunction-sections -fdata-sections")
 set(CMAKE_CXX_FLAGS_DEBUG "${CMAKE_C_FLAGS_DEBUG}")
-set(CMAKE_C_FLAGS_RELEASE "-Os -mthumb -mcpu=${ARM_CPU} -flto -fstrict-volatile-bitfields")
+set(CMAKE_C_FLAGS_RELEASE "-Os -mthumb -mcpu=${ARM_CPU} -flto -fstrict-volatile-bitfields -ffunction-sections -fdata-sections")
 set(CMAKE_CXX_FLAGS_RELEASE "${CMAKE_C_FLAGS_RELEASE}")
 
 # SELF_DIR: the directory where this toolchain file resides
@@ -34,20 +80,32 @@ set(CMAKE_EXE_LINKER_FLAGS_LIST
     -mthumb
     -mcpu=${ARM_CPU}
     "-T${SELF_DIR}/ld/${STM32_PART}.ld"
+    "-Wl,--defsym=_cn_ram_size=${STM32_RAM_SIZE}" # (checked against the linker script)
     -nostdlib
     -nostartfiles
     -flto
+    -Wl,--gc-sections
 )
 string(REPLACE ";" " " CMAKE_EXE_LINKER_FLAGS "${CMAKE_EXE_LINKER_FLAGS_LIST}")
 
 # #define core macros required to build CANnuccia
-# FIXME: High-density (> 128kB) devices have 2kB pages, not 1kB
-# FIXME IMPORTANT: Make sure the bootloader actually fits in CN_FLASH_BOOTLOADER_SIZE!!
+# NOTE: Whether the bootloader actually fits in CN_FLASH_BOOTLOADER_SIZE is
+#       checked after each build (see src/SizeReport.cmake)
 # FIXME: This should likely be moved out of the toolchain file to somewhere better!
 add_definitions(
-    -DCN_FLASH_PAGE_SIZE=0x400u # 1kB pages
-    -DCN_FLASH_PAGE_MASK=0xFFFFFC00u
-    -DCN_FLASH_BOOTLOADER_SIZE=0x1000u # 4kB reserved to CANnuccia
+    -DCN_FLASH_PAGE_SIZE=${STM32_PAGE_SIZE}u
+    -DCN_FLASH_PAGE_MASK=${STM32_PAGE_MASK}u
+    -DCN_FLASH_BOOTLOADER_SIZE=${STM32_BOOTLOADER_SIZE}u # ${STM32_BOOTLOADER_SIZE} reserved to CANnuccia
     -DCN_E_MACHINE=0x0028u # AARCH32
     -DCN_PLATFORM_IS_STM32=1
+    -DCN_STM32_RAM_SIZE=${STM32_RAM_SIZE}u
 )
+if(STM32_FLASH_CODE MATCHES "^[fg]$")
+    add_definitions(-DCN_STM32_XL_DENSITY=1)
+endif()
+if(CN_MINIMAL)
+    add_definitions(-DCN_MINIMAL=1)
+endif()
+if(STM32_STARTUP_BENCH)
+    add_definitions(-DCN_WITH_STARTUP_BENCH=1)
+endif()
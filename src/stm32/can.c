@@ -7,14 +7,21 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "common/can.h"
 
+#include "common/can_queue.h"
+#include "common/cc.h"
+#include "common/handoff.h"
+#include "common/util.h"
+
 // See the STM32F10X manual: RCC, AFIO & pin remapping, and bxCAN
 // CAN == CAN1 (CAN2 is present only on connectivity line MCUs)
 
+#define RCC_APB2RSTR (*(volatile uint32_t *)0x4002100C)
+#define RCC_APB1RSTR (*(volatile uint32_t *)0x40021010)
 #define RCC_APB1ENR (*(volatile uint32_t *)0x4002101C)
-#define RCC_APB1ENR_CANEN 0x02000000u
+#define RCC_APB1ENR_CANEN 0x02000000u // (same bit in RCC_APB1RSTR)
 #define RCC_APB2ENR (*(volatile uint32_t *)0x40021018)
-#define RCC_APB2ENR_IOPBEN 0x00000008u
-#define RCC_APB2ENR_AFIOEN 0x00000001u
+#define RCC_APB2ENR_IOPBEN 0x00000008u // (same bit in RCC_APB2RSTR)
+#define RCC_APB2ENR_AFIOEN 0x00000001u // (same bit in RCC_APB2RSTR)
 #define AFIO_MAPR (*(volatile uint32_t *)0x40010004)
 #define AFIO_MAPR_CAN1_PA11A12 0x00000000u // Map CAN1_RX to PA11, CAN1_TX to PA12
 #define AFIO_MAPR_CAN1_PB8B9 0x00004000u // Map CAN1_RX to PB8, CAN1_TX to PB9
@@ -60,10 +67,12 @@ struct Can
     struct CanFilter FILTER[28];
 };
 #define CAN1 ((volatile struct Can *)0x40006400)
+#define CAN_BTR_SILM 0x80000000u
 #define CAN_BTR_LBKM 0x40000000u
 #define CAN_TIR_TXRQ 0x00000001u
 #define CAN_MCR_ABOM 0x00000040u
 #define CAN_MCR_AWUM 0x00000020u
+#define CAN_MCR_TXFP 0x00000004u
 #define CAN_MCR_SLEEP 0x00000002u
 #define CAN_MCR_INRQ 0x00000001u
 #define CAN_MSR_SLAK 0x00000002u
@@ -72,6 +81,13 @@ struct Can
 #define CAN_TSR_TME1 0x08000000u
 #define CAN_TSR_TME0 0x04000000u
 #define CAN_TSR_CODE 0x03000000u
+#define CAN_TSR_RQCP2 0x00010000u
+#define CAN_TSR_RQCP1 0x00000100u
+#define CAN_TSR_RQCP0 0x00000001u
+#define CAN_TSR_TME (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)
+#define CAN_IER_FMPIE1 0x00000010u
+#define CAN_IER_FMPIE0 0x00000002u
+#define CAN_IER_TMEIE 0x00000001u
 #define CAN_FMR_FINIT 0x00000001u
 #define CAN_DTR_DLC 0x0000000Fu
 #define CAN_RFR_RFOM 0x00000020u
@@ -79,18 +95,39 @@ struct Can
 #define CAN_RFR_FULL 0x00000008u
 #define CAN_RFR_FMP 0x00000003u
 
+// USB_HP_CAN_TX interrupt is #19 -> set the 19th bit of ISER0;
+// USB_LP_CAN_RX0 is #20, CAN_RX1 is #21
+#define CAN_TX_IRQN 19
+#define CAN_RX0_IRQN 20
+#define CAN_RX1_IRQN 21
+#define NVIC_ISER0 (*(volatile uint32_t *)0xE000E100)
+
+extern void enableSysClock(void); // from "stm32/startup.c"
+
 
 const unsigned CN_CAN_RATE = 1000000; // (1Mbps, matches BTR's value)
 
+/// The clock of the APB1 bus, which feeds bxCAN (see `enableSysClock()`).
+#define CAN_CLOCK_HZ 36000000u
+
 
-/// Sets/changes CAN1 filter number `n` to the given 32-bit id & mask pair.
-inline static void initCANFilter(unsigned n, uint32_t id, uint32_t mask)
+/// Sets/changes CAN1 filter number `n` to the given 32-bit id & mask pair,
+/// routing the messages that it matches to FIFO `fifo` (0 or 1).
+/// Filter init mode (`CAN_FMR_FINIT`) must be on.
+inline static void initCANFilter(unsigned n, uint32_t id, uint32_t mask, unsigned fifo)
 {
     const uint32_t fltBit = (1u << n);
     CAN1->FA1R &= ~fltBit; // CAN1 filter n is not active
     CAN1->FM1R &= ~fltBit; // CAN1 filter n in mask mode
     CAN1->FS1R |= fltBit; // CAN1 filter n is 32-bit (not 16-bit)
-    CAN1->FFA1R &= ~fltBit; // CAN1 filter n assigned to FIFO 0
+    if(fifo)
+    {
+        CAN1->FFA1R |= fltBit; // CAN1 filter n assigned to FIFO 1
+    }
+    else
+    {
+        CAN1->FFA1R &= ~fltBit; // CAN1 filter n assigned to FIFO 0
+    }
     CAN1->FILTER[n].R1 = id;
     CAN1->FILTER[n].R2 = mask;
     CAN1->FA1R |= fltBit; // CAN1 filter n is active
@@ -99,13 +136,98 @@ inline static void initCANFilter(unsigned n, uint32_t id, uint32_t mask)
 /// Set to true after the first time `cnCANInit()` is called.
 static int busInited = 0;
 
+/// The id and mask last passed to `cnCANInit()`.
+static uint32_t filterId = 0, filterMask = 0;
+
+/// Messages queued by `cnCANSend()`, waiting for a free TX mailbox.
+static CNcanFrame txFrames[CN_CAN_TXQ_LEN];
+static CNcanQueue txQueue = CN_CAN_QUEUE_INIT(txFrames);
+
+/// Messages received on each lane (indexed by `CN_CAN_LANE_*`, which is also
+/// the number of the lane's FIFO), moved out of the FIFOs by the RX ISRs.
+/// The FIFOs only hold 3 messages each and the main loop stalls while flash is
+/// being erased or programmed; the ISRs (in RAM) do not.
+static CNcanFrame rxFrames[2][CN_CAN_RXQ_LEN];
+static CNcanQueue rxQueues[2] =
+{
+    CN_CAN_QUEUE_INIT(rxFrames[CN_CAN_LANE_CONTROL]),
+    CN_CAN_QUEUE_INIT(rxFrames[CN_CAN_LANE_DATA]),
+};
+
+/// Moves as many queued messages as possible to free TX mailboxes.
+static CN_RAMFUNC void txDrain(void)
+{
+    const CNcanFrame *frame;
+    while((CAN1->TSR & CAN_TSR_TME) && (frame = cnCANQueueFront(&txQueue)))
+    {
+        uint32_t mailboxId = (CAN1->TSR & CAN_TSR_CODE) >> 24; // First empty mailbox, 0..2
+        volatile struct CanMailbox *mailbox = &CAN1->OUTBOX[mailboxId];
+        mailbox->IR = frame->id & ~CAN_TIR_TXRQ; // Set id, IDE and RTR; ensure TXRQ is 0 for now
+        mailbox->DTR = frame->len & CAN_DTR_DLC; // Set Data Length Code
+        mailbox->DLR = cnReadU32LE(frame->data); // Payload bytes 0..3
+        mailbox->DHR = cnReadU32LE(frame->data + 4); // Payload bytes 4..7
+        mailbox->IR |= CAN_TIR_TXRQ; // Trigger transmission
+
+        cnCANQueuePop(&txQueue);
+    }
+}
+
+/// The ISR registered in startup.c's vector table; called when a TX mailbox
+/// becomes empty.
+CN_RAMFUNC void canTxHandler(void)
+{
+    CAN1->TSR = CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2; // Acknowledge the interrupt
+    txDrain();
+}
+
+/// Moves as many messages as possible from FIFO `fifo` to `rxQueues[fifo]`.
+/// If the queue fills up, the FIFO's interrupt is disabled - and the messages
+/// left in the FIFO - until `cnCANRecv()` makes room.
+static CN_RAMFUNC void rxDrain(unsigned fifo)
+{
+    volatile uint32_t *RFR = fifo ? &CAN1->RF1R : &CAN1->RF0R;
+    volatile const struct CanMailbox *inbox = &CAN1->INBOX[fifo];
+    CNcanFrame *frame;
+    while(*RFR & CAN_RFR_FMP)
+    {
+        if(!(frame = cnCANQueueBack(&rxQueues[fifo])))
+        {
+            CAN1->IER &= ~(fifo ? CAN_IER_FMPIE1 : CAN_IER_FMPIE0);
+            return;
+        }
+        unsigned len = inbox->DTR & CAN_DTR_DLC;
+        frame->id = inbox->IR; // (CAN id, IDE, RTR)
+        frame->len = (uint8_t)(len <= 8 ? len : 8);
+        cnWriteU32LE(frame->data, inbox->DLR); // (byte by byte; `data` is unaligned)
+        cnWriteU32LE(frame->data + 4, inbox->DHR);
+        cnCANQueuePush(&rxQueues[fifo]);
+
+        *RFR |= CAN_RFR_RFOM; // Release the message from the FIFO
+        while(*RFR & CAN_RFR_RFOM) { }
+    }
+}
+
+/// The ISRs registered in startup.c's vector table; called when FIFO 0 or 1
+/// have messages pending.
+CN_RAMFUNC void canRx0Handler(void)
+{
+    rxDrain(0);
+}
+
+CN_RAMFUNC void canRx1Handler(void)
+{
+    rxDrain(1);
+}
+
 int cnCANInit(uint32_t id, uint32_t mask)
 {
+    filterId = id;
+    filterMask = mask;
+
     if(busInited)
     {
-        // CAN already inited; just disable, edit and re-enable filter 0
-        initCANFilter(0, id, mask);
-        return 1;
+        // CAN already inited; just change the filter
+        return cnCANSetFilter(CN_CAN_LANE_CONTROL, 0, id, mask);
     }
     // Else: need to init CAN from scratch
 
@@ -117,21 +239,22 @@ int cnCANInit(uint32_t id, uint32_t mask)
                        // Set PB9 as push-pull output (CNF9=10=(AF push/pull), MODE9=01=(output, max 10MHz))
     RCC_APB1ENR |= RCC_APB1ENR_CANEN; // Enable clock source for CAN1
 
-    // TODO IMPLEMENT: enable CAN1 interrupts on msg received + sent?
-
     CAN1->MCR |= CAN_MCR_INRQ; // Ask CAN1 to enter init mode
     while(!(CAN1->MSR & CAN_MSR_INAK)) { } // Wait for CAN1 to actually enter init mode
 
-    CAN1->FMR |= CAN_FMR_FINIT; // Enter filter init mode
-    initCANFilter(0, id, mask);
-    CAN1->FMR &= ~CAN_FMR_FINIT; // Exit filter init mode
+    cnCANSetFilter(CN_CAN_LANE_CONTROL, 0, id, mask);
 
     CAN1->MCR |= CAN_MCR_AWUM | CAN_MCR_ABOM; // Auto wakeup on message rx, auto bus-off on 128 errors
-    // TODO: set other CAN options if needed (NART, RFLM, TXFP...)
+    CAN1->MCR |= CAN_MCR_TXFP; // Send TX mailboxes in the order they were filled in, not by id
+    // TODO: set other CAN options if needed (NART, RFLM...)
+
+    // Only now bring the system clock up to 72MHz, as BTR depends on it; the
+    // crystal has been warming up since reset (see stm32/startup.c)
+    enableSysClock();
 
-    // Set BTR here to change the CAN baud rate; optionally set CAN_BTR_LBKM to
-    // enable loopback for debugging. Assumes a 72MHz clock & target CAN rate
-    // matching `CN_CAN_RATE` as defined above.
+    // Set BTR here to change the CAN baud rate (see `cnCANSetLoopback()` for
+    // loopback mode). Assumes a 72MHz clock & target CAN rate matching
+    // `CN_CAN_RATE` as defined above.
     // -> http://www.bittiming.can-wiki.info/?CLK=72&ctype=bxCAN&SamplePoint=87.5&SJW=1&calc=1 <-
     CAN1->BTR = 0x00050008u;
 
@@ -139,102 +262,216 @@ int cnCANInit(uint32_t id, uint32_t mask)
     while(CAN1->MSR & CAN_MSR_INAK) { } // Wait for CAN1 to exiting init mode
     CAN1->MCR &= ~CAN_MCR_SLEEP; // Wake CAN1 from sleep. It should now sync...
 
+    CAN1->IER |= CAN_IER_TMEIE; // Interrupt when a TX mailbox becomes empty...
+    CAN1->IER |= CAN_IER_FMPIE0 | CAN_IER_FMPIE1; // ...or when a FIFO has messages pending...
+    NVIC_ISER0 |= (1 << CAN_TX_IRQN) | (1 << CAN_RX0_IRQN) | (1 << CAN_RX1_IRQN); // ...and enable the interrupt vectors
+
     busInited = 1;
     return 1;
 }
 
+int cnCANSetFilter(unsigned lane, unsigned n, uint32_t id, uint32_t mask)
+{
+    // Filters 0..1 are the data lane's and route to FIFO 1; filters 2..5 are
+    // the control lane's and route to FIFO 0
+    unsigned filter;
+    if(lane == CN_CAN_LANE_DATA && n < CN_CAN_DATA_FILTERS)
+    {
+        filter = n;
+    }
+    else if(lane == CN_CAN_LANE_CONTROL && n < CN_CAN_CONTROL_FILTERS)
+    {
+        filter = CN_CAN_DATA_FILTERS + n;
+    }
+    else
+    {
+        return 0;
+    }
+
+    CAN1->FMR |= CAN_FMR_FINIT; // Enter filter init mode
+    initCANFilter(filter, id, mask, lane == CN_CAN_LANE_DATA);
+    CAN1->FMR &= ~CAN_FMR_FINIT; // Exit filter init mode
+    return 1;
+}
+
+int cnCANSetLoopback(int on)
+{
+    if(!busInited)
+    {
+        return 0;
+    }
+
+    // BTR can only be written to in init mode
+    CAN1->MCR |= CAN_MCR_INRQ;
+    while(!(CAN1->MSR & CAN_MSR_INAK)) { }
+    if(on)
+    {
+        CAN1->BTR |= CAN_BTR_LBKM | CAN_BTR_SILM; // (loopback + silent: TX stays recessive)
+    }
+    else
+    {
+        CAN1->BTR &= ~(CAN_BTR_LBKM | CAN_BTR_SILM);
+    }
+    CAN1->MCR &= ~CAN_MCR_INRQ;
+    while(CAN1->MSR & CAN_MSR_INAK) { }
+    return 1;
+}
+
+void cnCANHandoff(volatile struct CNhandoff *handoff)
+{
+    CAN1->IER = 0x00000000u; // Disable all CAN interrupts, the user program sets up its own
+
+    if(busInited)
+    {
+        // Leave only the filter described by the record active (control
+        // filter 0, routing to FIFO 0): the other lanes' filters were the
+        // bootloader's own
+        CAN1->FMR |= CAN_FMR_FINIT;
+        CAN1->FA1R = 0x00000000u;
+        initCANFilter(CN_CAN_DATA_FILTERS, filterId, filterMask, 0);
+        CAN1->FMR &= ~CAN_FMR_FINIT;
+
+        // Drop the data lane messages still in FIFO 1
+        while(CAN1->RF1R & CAN_RFR_FMP)
+        {
+            CAN1->RF1R |= CAN_RFR_RFOM;
+            while(CAN1->RF1R & CAN_RFR_RFOM) { }
+        }
+    }
+
+    handoff->sysClockHz = 72000000u;
+    handoff->canClockHz = CAN_CLOCK_HZ;
+    handoff->canRate = CN_CAN_RATE;
+    handoff->canBitTiming = CAN1->BTR;
+    handoff->canFilterId = filterId;
+    handoff->canFilterMask = filterMask;
+    handoff->devIdFlags = busInited ? CN_HANDOFF_CAN_UP : 0;
+}
+
+void cnCANDeinit(void)
+{
+    // Reset bxCAN, AFIO (undoing the CAN1 remapping) and GPIO port B, then
+    // stop their clocks
+    RCC_APB1RSTR |= RCC_APB1ENR_CANEN;
+    RCC_APB1RSTR &= ~RCC_APB1ENR_CANEN;
+    RCC_APB1ENR &= ~RCC_APB1ENR_CANEN;
+    RCC_APB2RSTR |= RCC_APB2ENR_IOPBEN | RCC_APB2ENR_AFIOEN;
+    RCC_APB2RSTR &= ~(RCC_APB2ENR_IOPBEN | RCC_APB2ENR_AFIOEN);
+    RCC_APB2ENR &= ~(RCC_APB2ENR_IOPBEN | RCC_APB2ENR_AFIOEN);
+
+    busInited = 0;
+}
+
 int cnCANSend(uint32_t id, unsigned len, const uint8_t data[len])
 {
-    if(!(CAN1->TSR & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)))
+    // Queue full: wait for `canTxHandler()` to make room, but give up
+    // eventually if messages can't be sent (i.e. no one ACKs them)
+    CNcanFrame *frame;
+    for(uint32_t spins = 0; !(frame = cnCANQueueBack(&txQueue)); spins ++)
     {
-        // All TX mailboxes are full, can't send message
-        return -1;
+        if(spins >= 1000000u)
+        {
+            return -1;
+        }
     }
 
-    uint32_t mailboxId = (CAN1->TSR & CAN_TSR_CODE) >> 24; // First empty mailbox, 0..2
-    CAN1->OUTBOX[mailboxId].IR = id & ~CAN_TIR_TXRQ; // Set id, IDE and RTR; ensure TXRQ is 0 for now
     len = len <= 8 ? len : 8; // *Truncate length to 8*!
-    CAN1->OUTBOX[mailboxId].DTR = len & CAN_DTR_DLC; // Set Data Length Code
-
-    // Copy data to DLR and DHR
-    // WARNING: The ARM core does NOT support unaligned access; copying byte
-    //          arrays directly will corrupt the data - need the ugly switch
-    //          below or a `memcpy()`!
-    volatile uint32_t *DHR = &CAN1->OUTBOX[mailboxId].DHR, *DLR = &CAN1->OUTBOX[mailboxId].DLR;
-    *DHR = 0;
-    *DLR = 0;
-    switch(len)
-    {
-    case 8:
-    default:
-        *DHR |= ((uint32_t)data[7] << 24);
-    case 7:
-        *DHR |= ((uint32_t)data[6] << 16);
-    case 6:
-        *DHR |= ((uint32_t)data[5] << 8);
-    case 5:
-        *DHR |= data[4];
-    case 4:
-        *DLR |= ((uint32_t)data[3] << 24);
-    case 3:
-        *DLR |= ((uint32_t)data[2] << 16);
-    case 2:
-        *DLR |= ((uint32_t)data[1] << 8);
-    case 1:
-        *DLR |= data[0];
-    case 0:
-        break;
-    }
-
-    CAN1->OUTBOX[mailboxId].IR |= CAN_TIR_TXRQ; // Trigger transmission
+    frame->id = id;
+    frame->len = (uint8_t)len;
+    for(unsigned i = 0; i < len; i ++)
+    {
+        frame->data[i] = data[i];
+    }
+
+    // Queue the message, then send it out right away if a mailbox is free.
+    // The TX interrupt is masked meanwhile so that `canTxHandler()` does not
+    // drain the queue at the same time.
+    CAN1->IER &= ~CAN_IER_TMEIE;
+    cnCANQueuePush(&txQueue);
+    txDrain();
+    CAN1->IER |= CAN_IER_TMEIE;
+
     return (int)len;
 }
 
-int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+void cnCANFlush(void)
 {
-    // assert(recvId);
-    // NOTE: Code always reads FIFO 0 - TODO: make it work also for FIFO 1
+    // Give up eventually if messages can't be sent (i.e. no one ACKs them)
+    for(uint32_t spins = 0; spins < 1000000u; spins ++)
+    {
+        if(cnCANQueueEmpty(&txQueue) && (CAN1->TSR & CAN_TSR_TME) == CAN_TSR_TME)
+        {
+            break;
+        }
+    }
+}
+
+/// Returns the lane of the next message to be received: the control lane
+/// (FIFO 0) first, the data lane (FIFO 1) second.
+inline static CN_ALWAYS_INLINE unsigned rxLane(void)
+{
+    return cnCANQueueEmpty(&rxQueues[CN_CAN_LANE_CONTROL]) ? CN_CAN_LANE_DATA : CN_CAN_LANE_CONTROL;
+}
+
+/// The lane of the message last returned by `cnCANPeek()`, or -1 if none.
+/// (A control message can be queued by `canRx0Handler()` after a data message
+/// was peeked at, so `rxLane()` can not be asked again on receive)
+static int peekedLane = -1;
 
-    if(!(CAN1->RF0R & CAN_RFR_FMP))
+CN_RAMFUNC int cnCANPeek(uint32_t *recvId)
+{
+    unsigned lane = rxLane();
+    const CNcanFrame *frame = cnCANQueueFront(&rxQueues[lane]);
+    if(!frame)
     {
-        // No messages pending on FIFO 0
+        // No messages pending on either lane
+        peekedLane = -1;
         return -1;
     }
+    peekedLane = (int)lane;
+    if(recvId)
+    {
+        *recvId = frame->id;
+    }
+    return frame->len;
+}
 
-    *recvId = CAN1->INBOX[0].IR; // Fetch FIFO 0 (CAN id, IDE, RTR)
-    unsigned payloadLen = CAN1->INBOX[0].DTR & CAN_DTR_DLC; // Fetch FIFO 0 payload length
-    maxLen = maxLen < payloadLen ? maxLen : payloadLen; // Truncate payload length to `maxLen`
-
-    // Copy data out of FIFO 0's DLR and DHR
-    // WARNING: The ARM core does NOT support unaligned access; copying byte
-    //          arrays directly will corrupt the data - need the ugly switch
-    //          below or a `memcpy()`!
-    volatile const uint32_t *DHR = &CAN1->INBOX[0].DHR, *DLR = &CAN1->INBOX[0].DLR;
-    switch(maxLen)
-    {
-    case 8:
-    default:
-        data[7] = (uint8_t)((*DHR & 0xFF000000u) >> 24);
-    case 7:
-        data[6] = (uint8_t)((*DHR & 0x00FF0000u) >> 16);
-    case 6:
-        data[5] = (uint8_t)((*DHR & 0x0000FF00u) >> 8);
-    case 5:
-        data[4] = (uint8_t)(*DHR & 0x000000FFu);
-    case 4:
-        data[3] = (uint8_t)((*DLR & 0xFF000000u) >> 24);
-    case 3:
-        data[2] = (uint8_t)((*DLR & 0x00FF0000u) >> 16);
-    case 2:
-        data[1] = (uint8_t)((*DLR & 0x0000FF00u) >> 8);
-    case 1:
-        data[0] = (uint8_t)(*DLR & 0x000000FFu);
-    case 0:
-        break;
-    }
-
-    // Message processed, clear it from FIFO 0
-    CAN1->RF0R |= CAN_RFR_RFOM;
+CN_RAMFUNC int cnCANRecvInto(unsigned maxLen, uint8_t data[maxLen])
+{
+    if(peekedLane < 0 && cnCANPeek(0) < 0)
+    {
+        return -1;
+    }
+    // (the front message of a queue can only change by being received, so
+    // this is the one `cnCANPeek()` returned)
+    unsigned lane = (unsigned)peekedLane;
+    const CNcanFrame *frame = cnCANQueueFront(&rxQueues[lane]);
+    peekedLane = -1;
+
+    // The payload was already copied out of the mailbox registers into the
+    // queue slot by `rxDrain()`; this copies it from there to its destination
+    // without going through an intermediate buffer
+    maxLen = maxLen < frame->len ? maxLen : frame->len; // Truncate payload length to `maxLen`
+    for(unsigned i = 0; i < maxLen; i ++)
+    {
+        data[i] = frame->data[i];
+    }
+    cnCANQueuePop(&rxQueues[lane]);
+
+    // There is room in the queue again; resume moving messages out of the
+    // FIFO, in case `rxDrain()` had to stop
+    CAN1->IER |= (lane == CN_CAN_LANE_DATA) ? CAN_IER_FMPIE1 : CAN_IER_FMPIE0;
 
     return (int)maxLen;
 }
+
+CN_RAMFUNC int cnCANRecv(uint32_t *recvId, unsigned maxLen, uint8_t data[maxLen])
+{
+    // assert(recvId);
+
+    if(cnCANPeek(recvId) < 0)
+    {
+        return -1;
+    }
+    return cnCANRecvInto(maxLen, data);
+}
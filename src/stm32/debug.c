@@ -28,3 +28,58 @@ void cnDebugLed(int on)
 {
     GPIOC_BSRR = on ? 0x20000000u : 0x00002000u; // Turn PC13 on or off (active low)
 }
+
+#if CN_WITH_STARTUP_BENCH
+
+// See the ARMv7-M Architecture Reference Manual (DWT) and the STM32F10X
+// manual (PWR and BKP sections)
+#define DEMCR (*(volatile uint32_t *)0xE000EDFC)
+#define DEMCR_TRCENA 0x01000000u
+#define DWT_CTRL (*(volatile uint32_t *)0xE0001000)
+#define DWT_CTRL_CYCCNTENA 0x00000001u
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define RCC_APB1ENR (*(volatile uint32_t *)0x4002101C)
+#define RCC_APB1ENR_PWREN 0x10000000u
+#define RCC_APB1ENR_BKPEN 0x08000000u
+#define PWR_CR (*(volatile uint32_t *)0x40007000)
+#define PWR_CR_DBP 0x00000100u
+#define BKP_DR(n) (*(volatile uint32_t *)(0x40006C00 + 4 * (n))) // (n = 1..10)
+
+/// The value of the cycle counter when the system clock was switched from the
+/// internal 8MHz oscillator to the 72MHz PLL, or 0 if it has not been yet.
+static uint32_t switchCycles = 0;
+
+/// Called by `resetHandler()` first thing (before .data and .bss are set up!)
+void benchReset(void)
+{
+    DEMCR |= DEMCR_TRCENA; // Enable the DWT
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA; // Start counting cycles
+}
+
+/// Called by `enableSysClock()` right after switching to the PLL.
+void benchClockSwitched(void)
+{
+    switchCycles = DWT_CYCCNT;
+}
+
+void cnDebugBenchStamp(unsigned n)
+{
+    uint32_t cycles = DWT_CYCCNT;
+    uint32_t us;
+    if(switchCycles)
+    {
+        us = switchCycles / 8 + (cycles - switchCycles) / 72;
+    }
+    else
+    {
+        us = cycles / 8;
+    }
+
+    RCC_APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN; // Enable clock source for PWR and BKP
+    PWR_CR |= PWR_CR_DBP; // Allow writes to the backup domain
+    BKP_DR(2 * n + 1) = us & 0xFFFFu;
+    BKP_DR(2 * n + 2) = us >> 16;
+}
+
+#endif // CN_WITH_STARTUP_BENCH
@@ -8,9 +8,11 @@
 #include "common/flash.h"
 
 #include <stdint.h>
+#include "common/cc.h"
 
 // See the STM32F10x Programming Manual, PM0075
-// Assuming target is a medium-density (64kB) device
+// XL-density devices (768kB and 1MB of flash, `CN_STM32_XL_DENSITY`) have a
+// second flash bank, from 512kB on, with its own set of registers
 
 struct Flash
 {
@@ -23,6 +25,14 @@ struct Flash
     uint32_t _; // (reserved)
     uint32_t OBR;
     uint32_t WRPR;
+#ifdef CN_STM32_XL_DENSITY
+    uint32_t _2[8]; // (reserved)
+    uint32_t KEYR2;
+    uint32_t _3; // (reserved)
+    uint32_t SR2;
+    uint32_t CR2;
+    uint32_t AR2;
+#endif
 };
 #define FLASH ((volatile struct Flash *)0x40022000)
 
@@ -33,23 +43,63 @@ struct Flash
 #define FLASH_CR_PER 0x00000002u
 #define FLASH_CR_PG 0x00000001u
 #define FLASH_SR_BSY 0x00000001u
+#define FLASH_BANK2_ADDR 0x08080000u
+
+#define UID_BASE ((const volatile uint8_t *)0x1FFFF7E8)
+
+#define RCC_APB2RSTR (*(volatile uint32_t *)0x4002100C)
+#define RCC_APB2ENR (*(volatile uint32_t *)0x40021018)
+#define RCC_APB2ENR_IOPCEN 0x00000010u // (same bit in RCC_APB2RSTR)
 
 #define SCB_VTOR (*(volatile uint32_t *)0xE000ED08)
+#define NVIC_ICER0 (*(volatile uint32_t *)0xE000E180)
+#define NVIC_ICER1 (*(volatile uint32_t *)0xE000E184)
 
 extern char _flash_start, _flash_end; // (defined in the linker script)
 
+#if CN_WITH_JOURNAL
+
+/// The page journal lives in the last page of flash, which is never handed
+/// out to the user program.
+#define JOURNAL_ADDR ((uintptr_t)&_flash_end - CN_FLASH_PAGE_SIZE)
+
+/// Layout of the journal page.
+/// Erased flash reads as all ones, so an erased journal has no image, no
+/// digest and no committed pages; committing page `n` programs `marks[n]` to
+/// zero.
+struct Journal
+{
+    uint16_t imageIdLo;
+    uint16_t imageIdHi;
+    uint16_t digestPages; ///< Programmed last, after `digest`.
+    uint16_t digest[CN_SHA256_SIZE / 2];
+    uint16_t marks[(CN_FLASH_PAGE_SIZE - 6 - CN_SHA256_SIZE) / 2];
+};
+#define JOURNAL ((volatile const struct Journal *)JOURNAL_ADDR)
+
+#endif // CN_WITH_JOURNAL
+
+
+CNflashAddr cnFlashStart(void)
+{
+    return (CNflashAddr)&_flash_start;
+}
 
-uintptr_t cnFlashSize(void)
+CNflashAddr cnFlashSize(void)
 {
     // NOTE: Could also query the flash size register
-    return (uintptr_t)(&_flash_end - &_flash_start);
+    return (CNflashAddr)(&_flash_end - &_flash_start);
 }
 
-int cnFlashPageWriteable(uintptr_t addr)
+int cnFlashPageWriteable(CNflashAddr addr)
 {
-    uintptr_t minAddr = (uintptr_t)(&_flash_start) + CN_FLASH_BOOTLOADER_SIZE;
-    uintptr_t maxAddr = (uintptr_t)(&_flash_end);
-    return addr >= minAddr && (addr + CN_FLASH_PAGE_SIZE) < maxAddr;
+    CNflashAddr minAddr = (CNflashAddr)(&_flash_start) + CN_FLASH_BOOTLOADER_SIZE;
+#if CN_WITH_JOURNAL
+    CNflashAddr maxAddr = JOURNAL_ADDR; // (the journal page is not writeable)
+#else
+    CNflashAddr maxAddr = (CNflashAddr)(&_flash_end);
+#endif
+    return addr >= minAddr && (addr + CN_FLASH_PAGE_SIZE) <= maxAddr;
 }
 
 int cnFlashUnlock(void)
@@ -57,6 +107,14 @@ int cnFlashUnlock(void)
     // Write KEY1 then KEY2 to FLASH_KEYR to unlock FLASH_CR
     FLASH->KEYR = FLASH_KEY1;
     FLASH->KEYR = FLASH_KEY2;
+#ifdef CN_STM32_XL_DENSITY
+    FLASH->KEYR2 = FLASH_KEY1;
+    FLASH->KEYR2 = FLASH_KEY2;
+    if(FLASH->CR2 & FLASH_CR_LOCK)
+    {
+        return 0;
+    }
+#endif
 
     if(FLASH->CR & FLASH_CR_LOCK)
     {
@@ -68,20 +126,87 @@ int cnFlashUnlock(void)
 
 int cnFlashLock(void)
 {
+#ifdef CN_STM32_XL_DENSITY
+    FLASH->CR2 |= FLASH_CR_LOCK;
+#endif
     FLASH->CR |= FLASH_CR_LOCK;
     return (FLASH->CR & FLASH_CR_LOCK);
 }
 
 /// The address of the page currently being programmed.
-static uintptr_t curPageAddr = 0;
+static CNflashAddr curPageAddr = 0;
+
+// The CPU stalls on any fetch from flash while flash is busy; all functions
+// that start a flash operation and wait for it run from RAM, so that
+// interrupts (i.e. CAN reception, see stm32/can.c) are still served meanwhile.
 
 /// Spinlocks until flash is busy (`FLASH_SR_BSY`).
-inline static void waitForFlash(void)
+/// Only to be called from `CN_RAMFUNC`s (it is always inlined into them).
+inline static CN_ALWAYS_INLINE void waitForFlash(void)
 {
     while(FLASH->SR & FLASH_SR_BSY) { }
+#ifdef CN_STM32_XL_DENSITY
+    while(FLASH->SR2 & FLASH_SR_BSY) { }
+#endif
+}
+
+/// Returns the control register of the flash bank that `addr` is in.
+inline static CN_ALWAYS_INLINE volatile uint32_t *bankCR(uintptr_t addr)
+{
+#ifdef CN_STM32_XL_DENSITY
+    if(addr >= FLASH_BANK2_ADDR)
+    {
+        return &FLASH->CR2;
+    }
+#endif
+    (void)addr;
+    return &FLASH->CR;
+}
+
+/// Returns the address register of the flash bank that `addr` is in.
+inline static CN_ALWAYS_INLINE volatile uint32_t *bankAR(uintptr_t addr)
+{
+#ifdef CN_STM32_XL_DENSITY
+    if(addr >= FLASH_BANK2_ADDR)
+    {
+        return &FLASH->AR2;
+    }
+#endif
+    (void)addr;
+    return &FLASH->AR;
+}
+
+/// Erases the page in flash starting at `addr`.
+/// Flash must be unlocked.
+static CN_RAMFUNC void erasePage(uintptr_t addr)
+{
+    // FIXME IMPLEMENT: verify the page has been really cleared by reading it
+    volatile uint32_t *cr = bankCR(addr);
+    waitForFlash();
+    *cr |= FLASH_CR_PER;
+    *bankAR(addr) = addr;
+    *cr |= FLASH_CR_STRT;
+    waitForFlash();
+    *cr &= ~FLASH_CR_PER;
 }
 
-int cnFlashBeginWrite(uintptr_t addr)
+#if CN_WITH_JOURNAL
+
+/// Programs the single halfword at `addr` in flash to `value`.
+/// Flash must be unlocked and no page write must be in progress.
+static CN_RAMFUNC void programHalfword(uintptr_t addr, uint16_t value)
+{
+    volatile uint32_t *cr = bankCR(addr);
+    waitForFlash();
+    *cr |= FLASH_CR_PG;
+    *(volatile uint16_t *)addr = value;
+    waitForFlash();
+    *cr &= ~FLASH_CR_PG;
+}
+
+#endif // CN_WITH_JOURNAL
+
+CN_RAMFUNC int cnFlashBeginWrite(CNflashAddr addr)
 {
     if(FLASH->CR & FLASH_CR_LOCK)
     {
@@ -92,22 +217,16 @@ int cnFlashBeginWrite(uintptr_t addr)
     // Clear page
     // TODO IMPLEMENT: bootloader protection (refuse to clear/write to pages
     //                 that belong to the bootloader, check `addr`)
-    // FIXME IMPLEMENT: verify the page has been really cleared by reading it
-    waitForFlash();
-    FLASH->CR |= FLASH_CR_PER;
-    FLASH->AR = addr;
-    FLASH->CR |= FLASH_CR_STRT;
-    waitForFlash();
-    FLASH->CR &= ~FLASH_CR_PER;
+    erasePage(addr);
 
     // Start programming operation
-    FLASH->CR |= FLASH_CR_PG;
+    *bankCR(addr) |= FLASH_CR_PG;
 
     curPageAddr = addr;
     return 1;
 }
 
-unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
+CN_RAMFUNC unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
 {
     if(!curPageAddr)
     {
@@ -119,10 +238,15 @@ unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
     volatile uint16_t *destHW = (volatile uint16_t *)(curPageAddr + offset);
     const uint16_t *srcHW = (const uint16_t *)data;
     unsigned bytesWritten;
-    for(bytesWritten = 0; bytesWritten < size; bytesWritten += 2)
+    for(bytesWritten = 0; bytesWritten < size; bytesWritten += 2, destHW ++, srcHW ++)
     {
-        waitForFlash();
-        *destHW++ = *srcHW++;
+        // The page was erased by `cnFlashBeginWrite()`: halfwords that are to
+        // stay erased need not be programmed (~52us each)
+        if(*srcHW != 0xFFFFu)
+        {
+            waitForFlash();
+            *destHW = *srcHW;
+        }
     }
     waitForFlash();
 
@@ -131,7 +255,7 @@ unsigned cnFlashFill(uintptr_t offset, unsigned size, const uint8_t data[size])
     return bytesWritten;
 }
 
-int cnFlashEndWrite(void)
+CN_RAMFUNC int cnFlashEndWrite(void)
 {
     if(!curPageAddr)
     {
@@ -140,27 +264,142 @@ int cnFlashEndWrite(void)
     }
 
     waitForFlash();
-    FLASH->CR &= ~FLASH_CR_PG;
+    *bankCR(curPageAddr) &= ~FLASH_CR_PG;
 
     curPageAddr = 0;
     return 1;
 }
 
+void cnFlashRead(CNflashAddr addr, unsigned len, uint8_t out[len])
+{
+    const uint8_t *src = (const uint8_t *)addr;
+    for(unsigned i = 0; i < len; i ++)
+    {
+        out[i] = src[i];
+    }
+}
+
+#if CN_WITH_JOURNAL
+
+uint32_t cnJournalImageId(void)
+{
+    return JOURNAL->imageIdLo | ((uint32_t)JOURNAL->imageIdHi << 16);
+}
+
+int cnJournalReset(uint32_t imageId)
+{
+    if((FLASH->CR & FLASH_CR_LOCK) || curPageAddr)
+    {
+        // Flash locked or a page write is in progress
+        return 0;
+    }
+
+    // Erasing the page drops both the old image id and all of its marks at
+    // once; the new image id is only written afterwards, so a reset that
+    // gets interrupted leaves an empty journal behind
+    erasePage(JOURNAL_ADDR);
+    programHalfword((uintptr_t)&JOURNAL->imageIdLo, (uint16_t)(imageId & 0xFFFFu));
+    programHalfword((uintptr_t)&JOURNAL->imageIdHi, (uint16_t)(imageId >> 16));
+    return cnJournalImageId() == imageId;
+}
+
+int cnJournalMark(unsigned page)
+{
+    const unsigned N_MARKS = sizeof(JOURNAL->marks) / sizeof(JOURNAL->marks[0]);
+    if(page >= N_MARKS || (FLASH->CR & FLASH_CR_LOCK) || curPageAddr)
+    {
+        return 0;
+    }
+    if(JOURNAL->marks[page] != 0x0000u)
+    {
+        // (halfwords can only be programmed once after an erase)
+        programHalfword((uintptr_t)&JOURNAL->marks[page], 0x0000u);
+    }
+    return JOURNAL->marks[page] == 0x0000u;
+}
+
+int cnJournalMarked(unsigned page)
+{
+    const unsigned N_MARKS = sizeof(JOURNAL->marks) / sizeof(JOURNAL->marks[0]);
+    return page < N_MARKS && JOURNAL->marks[page] == 0x0000u;
+}
+
+#if CN_WITH_DIGEST
+
+int cnJournalSetDigest(unsigned nPages, const uint8_t digest[static CN_SHA256_SIZE])
+{
+    if((FLASH->CR & FLASH_CR_LOCK) || curPageAddr || JOURNAL->digestPages != 0xFFFFu)
+    {
+        // Flash locked, a page write is in progress or a digest was already
+        // stored (halfwords can only be programmed once after an erase)
+        return 0;
+    }
+    for(unsigned i = 0; i < CN_SHA256_SIZE / 2; i ++)
+    {
+        programHalfword((uintptr_t)&JOURNAL->digest[i], (uint16_t)(digest[i * 2] | (digest[i * 2 + 1] << 8)));
+    }
+    programHalfword((uintptr_t)&JOURNAL->digestPages, (uint16_t)nPages);
+    return JOURNAL->digestPages == nPages;
+}
+
+unsigned cnJournalDigest(uint8_t outDigest[static CN_SHA256_SIZE])
+{
+    unsigned nPages = JOURNAL->digestPages;
+    if(nPages == 0xFFFFu)
+    {
+        return 0;
+    }
+    for(unsigned i = 0; i < CN_SHA256_SIZE / 2; i ++)
+    {
+        outDigest[i * 2] = (uint8_t)JOURNAL->digest[i];
+        outDigest[i * 2 + 1] = (uint8_t)(JOURNAL->digest[i] >> 8);
+    }
+    return nPages;
+}
+
+#endif // CN_WITH_DIGEST
+
+#endif // CN_WITH_JOURNAL
+
 uint8_t cnReadDevId(void)
 {
     return (FLASH->OBR & 0x0003FC00) >> 10; // data0: [10..17]
 }
 
+void cnReadUid(uint8_t outUid[static CN_UID_SIZE])
+{
+    for(unsigned i = 0; i < CN_UID_SIZE; i ++)
+    {
+        outUid[i] = UID_BASE[i];
+    }
+}
+
 
 typedef void(*ResetHandler)(void);
 
 __attribute__((noreturn)) void cnJumpToProgram(void)
 {
-    // FIXME IMPLEMENT: The code should undo all modifications done to system
-    //                  registers before jumping to the user program. In particular:
-    //                  - Disable GPIO ports (debug LED + bxCAN), AFIO, TIM2, other devices
-    //                  - Disable all enabled interrupts (TIM2, bxCAN...)
-    //                  - Reset the internal oscillator as clock source (no PLL)
+    // NOTE: bxCAN and TIM2 are taken care of by common code before getting here
+    //       (see `cnCANHandoff()`, `cnCANDeinit()` and `cnTimerStop()`).
+#if CN_WITH_HANDOFF
+    // The 72MHz PLL is deliberately left on as the system clock, as described
+    // by the hand-off record, so that user programs do not have to wait for
+    // the crystal and PLL to start a second time.
+#else
+    // Reset GPIO port C (debug LED) and stop its clock
+    RCC_APB2RSTR |= RCC_APB2ENR_IOPCEN;
+    RCC_APB2RSTR &= ~RCC_APB2ENR_IOPCEN;
+    RCC_APB2ENR &= ~RCC_APB2ENR_IOPCEN;
+
+    // Back to the internal oscillator as clock source (no PLL)
+    extern void disableSysClock(void); // from "stm32/startup.c"
+    disableSysClock();
+#endif
+
+    // Disable all of the bootloader's interrupts (TIM2, bxCAN TX...), as they
+    // are at reset; the user program's vector table is about to take over.
+    NVIC_ICER0 = 0xFFFFFFFFu;
+    NVIC_ICER1 = 0xFFFFFFFFu;
 
     // The vector table of the user program is right after the bootloader's end.
     uintptr_t vtAddr = ((uintptr_t)&_flash_start) + CN_FLASH_BOOTLOADER_SIZE;
@@ -31,6 +31,8 @@
 // *****************************************************************************
 
 #include "common/cc.h"
+#include "common/config.h"
+#include "common/handoff.h"
 #include <stdint.h>
 
 
@@ -44,12 +46,34 @@
 #define RCC_CFGR (*(volatile uint32_t *)0x40021004)
 #define FLASH_ACR (*(volatile uint32_t *)0x40022000)
 #define FLASH_ACR_PRFTBE 0x00000010u
+#define SCB_VTOR (*(volatile uint32_t *)0xE000ED08)
 
-/// Enables the 8MHz external crystal to get a 72MHz PLL clock
-// See: https://www.stm32duino.com/viewtopic.php?t=4190
-static void enableHSE(void)
+#define RCC_CFGR_SWS_MASK 0x0000000Cu
+#define RCC_CFGR_SWS_PLL 0x00000008u
+
+/// Starts the 8MHz external crystal, without waiting for it to stabilize.
+/// Called right after reset, so that the crystal warms up while the rest of
+/// the bootloader is being initialized; see `enableSysClock()`.
+inline static void startHSE(void)
 {
     RCC_CR |= RCC_CR_HSEON; // Enable external crystal
+}
+
+/// Switches the system clock to 72MHz (PLL from the 8MHz external crystal).
+/// Runs from the internal 8MHz RC oscillator up to that point. Does nothing if
+/// the PLL is already the system clock.
+/// Called by peripheral drivers that depend on the exact clock frequency (CAN
+/// bit timing, timer periods) right before they need it; the later this
+/// happens, the less time is spent waiting for the crystal.
+// See: https://www.stm32duino.com/viewtopic.php?t=4190
+void enableSysClock(void)
+{
+    if((RCC_CFGR & RCC_CFGR_SWS_MASK) == RCC_CFGR_SWS_PLL)
+    {
+        return;
+    }
+
+    startHSE(); // (in case it was not started already)
     while(!(RCC_CR & RCC_CR_HSERDY)) { } // Wait for crystal...
 
     FLASH_ACR = FLASH_ACR_PRFTBE | 0x2; // Flash prefetch on, 2 flash wait states (clock > 48MHz)
@@ -59,9 +83,25 @@ static void enableHSE(void)
     while(!(RCC_CR & RCC_CR_PLLRDY)) { } // Wait for PLL...
 
     RCC_CFGR |= 0x2; // Set PLL as system clock source
-    while(!(RCC_CFGR & 0x8)) { } // Wait for clock source to change...
+    while((RCC_CFGR & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_PLL) { } // Wait for clock source to change...
+
+#if CN_WITH_STARTUP_BENCH
+    extern void benchClockSwitched(void); // from "stm32/debug.c"
+    benchClockSwitched();
+#endif
 }
 
+/// Switches the system clock back to the internal 8MHz RC oscillator and
+/// stops the PLL and the external crystal, as they are at chip reset.
+void disableSysClock(void)
+{
+    RCC_CFGR &= ~0x3u; // Set HSI as system clock source
+    while(RCC_CFGR & RCC_CFGR_SWS_MASK) { } // Wait for clock source to change...
+
+    RCC_CR &= ~(RCC_CR_PLLON | RCC_CR_HSEON); // Disable PLL and external crystal
+    RCC_CFGR = 0x00000000u; // Reset all prescalers and PLL settings
+    FLASH_ACR = FLASH_ACR_PRFTBE; // Flash prefetch on, 0 flash wait states (reset value)
+}
 
 /// An ISR that spinlocks forever.
 /// Used as a fallback for when no real ISR is implemented.
@@ -74,45 +114,64 @@ CN_NORETURN void hcf(void)
 
 int main(void);
 
+static void relocateIsrs(void);
+
 /// Executed every time the chip is reset.
 /// NOTE: `ENTRY(resetHandler)` in the linker script
 CN_NORETURN void resetHandler(void)
 {
+    // Get the crystal going first thing, it takes a while to stabilize
+    startHSE();
+
+#if CN_WITH_STARTUP_BENCH
+    extern void benchReset(void); // from "stm32/debug.c"
+    benchReset();
+#endif
+
     // v- Defined in linker script -v
-    extern char _data_start; // ORIGIN(.data)
-    extern char _data_end; // ORIGIN(.data) + LENGTH(.data)
-    extern char _data_load_addr; // LOADADDR(.data)
-    extern char _bss_start; // ORIGIN(.bss)
-    extern char _bss_end; // ORIGIN(.bss) + LENGTH(.bss)
+    // (all of them are 4-byte aligned)
+    extern uint32_t _data_start; // ORIGIN(.data)
+    extern uint32_t _data_end; // ORIGIN(.data) + LENGTH(.data)
+    extern uint32_t _data_load_addr; // LOADADDR(.data)
+    extern uint32_t _bss_start; // ORIGIN(.bss)
+    extern uint32_t _bss_end; // ORIGIN(.bss) + LENGTH(.bss)
 
     // Enable 8-byte stack alignment to comply with AAPCS
     //BIT_SET(SCB->CCR, BIT_9);
 
-    // Copy .data from FLASH to RAM
-    char *src = &_data_load_addr, *dst = &_data_start, *end = &_data_end;
+    // Copy .data from FLASH to RAM, one word at a time
+    const uint32_t *src = &_data_load_addr;
+    uint32_t *dst = &_data_start, *end = &_data_end;
     while(dst < end)
     {
         *dst++ = *src++;
     }
 
-    // Zero-fill .bss on RAM
+    // Zero-fill .bss on RAM, one word at a time
     dst = &_bss_start; end = &_bss_end;
     while(dst < end)
     {
         *dst++ = 0;
     }
 
-    enableHSE();
+    // Interrupts are only enabled later on, but vectors have to be fetched
+    // from RAM by then (see `relocateIsrs()`)
+    relocateIsrs();
 
+    // NOTE: The system clock is switched to the PLL later on, see `enableSysClock()`
     main();
     hcf();
 }
 
 /// The stack's start address. Stack starts at the bottom of RAM and grows up.
-/// 0x20005000: RAM bottom (0x20000000) + RAM size (0x5000, i.e. 20KB)
-#define STACK_START_ADDR 0x20005000
+/// The end of RAM (0x20000000 + `CN_STM32_RAM_SIZE`, which depends on the
+/// part), minus the space for the hand-off record (see common/handoff.h)
+#define STACK_START_ADDR CN_HANDOFF_ADDR
 
 extern void tim2Handler(void); // from "stm32/timer.c"
+extern void canTxHandler(void); // from "stm32/can.c"
+extern void canRx0Handler(void); // from "stm32/can.c"
+extern void canRx1Handler(void); // from "stm32/can.c"
 
 /// ARM Cortex-M3 Interrupt vector table.
 typedef void(*ISR)(void);
@@ -157,9 +216,9 @@ ISR isrs[] CN_SECTION(".isrs") =
     hcf,                  // DMA1_Channel6 
     hcf,                  // DMA1_Channel7 
     hcf,                  // ADC1_2        
-    hcf,                  // USB_HP_CAN_TX 
-    hcf,                  // USB_LP_CAN_RX0
-    hcf,                  // CAN_RX1       
+    canTxHandler,         // USB_HP_CAN_TX 
+    canRx0Handler,        // USB_LP_CAN_RX0
+    canRx1Handler,        // CAN_RX1       
     hcf,                  // CAN_SCE       
     hcf,                  // EXTI9_5       
     hcf,                  // TIM1_BRK      
@@ -167,6 +226,9 @@ ISR isrs[] CN_SECTION(".isrs") =
     hcf,                  // TIM1_TRG_COM  
     hcf,                  // TIM1_CC       
     tim2Handler,          // TIM2
+#ifndef CN_MINIMAL
+    // (no interrupt past TIM2 is ever enabled by the bootloader; a minimal
+    // build saves flash by leaving their vectors out)
     hcf,                  // TIM3          
     hcf,                  // TIM4          
     hcf,                  // I2C1_EV       
@@ -206,7 +268,25 @@ ISR isrs[] CN_SECTION(".isrs") =
     hcf,                  // CAN2_RX1      
     hcf,                  // CAN2_SCE      
     hcf,                  // OTG_FS        
+#endif
 };
 
 
 
+
+/// A copy of `isrs` in RAM; VTOR points to it while the bootloader runs, as
+/// fetching a vector from flash would hold an interrupt up for as long as a
+/// flash erase (~20ms) or program operation is in progress.
+/// (VTOR needs the table aligned to its size, rounded up to a power of two)
+static ISR ramIsrs[sizeof(isrs) / sizeof(isrs[0])] __attribute__((aligned(512)));
+
+/// Copies the vector table to RAM and switches to it.
+static void relocateIsrs(void)
+{
+    for(unsigned i = 0; i < sizeof(isrs) / sizeof(isrs[0]); i ++)
+    {
+        ramIsrs[i] = isrs[i];
+    }
+    SCB_VTOR = (uint32_t)ramIsrs;
+    __asm__ __volatile__("DSB");
+}
@@ -8,6 +8,7 @@
 #include "common/timer.h"
 
 #include <stddef.h>
+#include "common/cc.h"
 
 // TIM2..5 are present on all STM32F10x and are general-purpose 16-bit timers
 // See STM32's reference manual, general-purpose timers section
@@ -53,14 +54,24 @@ struct Tim
 #define NVIC_ICER0 (*(volatile uint32_t *)0xE000E180)
 #define NVIC_ICPR0 (*(volatile uint32_t *)0xE000E280)
 
+// SysTick, see the Cortex-M3 Programming Manual, PM0056
+#define SYST_CSR (*(volatile uint32_t *)0xE000E010)
+#define SYST_RVR (*(volatile uint32_t *)0xE000E014)
+#define SYST_CVR (*(volatile uint32_t *)0xE000E018)
+#define SYST_CSR_COUNTFLAG 0x00010000u
+#define SYST_CSR_CLKSOURCE 0x00000004u // (processor clock, not HCLK / 8)
+#define SYST_CSR_ENABLE 0x00000001u
+
 #define CLOCK_FREQ_MHZ 72
 
+extern void enableSysClock(void); // from "stm32/startup.c"
+
 
 /// The function to run on timer timeout, as set by `cnTimerStart()`.
 static CNtimeoutFunc timeoutFunc = NULL;
 
 /// The ISR registered in startup.c's vector table.
-void tim2Handler(void)
+CN_RAMFUNC void tim2Handler(void)
 {
     TIM2->SR &= ~TIM_SR_UIF; // Clear UIF or the code will get stuck in this ISR!
     timeoutFunc();
@@ -74,6 +85,8 @@ int cnTimerStart(uint32_t delayUs, int oneshot, CNtimeoutFunc onTimeout)
         return 0;
     }
 
+    enableSysClock(); // (the calculations below assume a 72MHz clock)
+
     RCC_APB1ENR |= RCC_APB1ENR_TIM2ENR; // Enable TIM2's clock
     TIM2->CR1 &= ~TIM_CR1_CEN; // Ensure TIM2's counter is stopped
     TIM2->CR1 |= TIM_CR1_DIR; // TIM2 counts down
@@ -129,3 +142,20 @@ void cnTimerStop(void)
     NVIC_ICER0 |= (1 << TIM2_IRQN); // Disable the TIM2 interrupt vector
     RCC_APB1ENR &= ~RCC_APB1ENR_TIM2ENR; // Disable TIM2's clock
 }
+
+void cnDelayUs(uint16_t delayUs)
+{
+    if(delayUs == 0)
+    {
+        return;
+    }
+
+    enableSysClock(); // (so that there are `CLOCK_FREQ_MHZ` cycles per us)
+
+    // At most 65535 * 72 cycles, which fits in SysTick's 24-bit counter
+    SYST_RVR = (uint32_t)delayUs * CLOCK_FREQ_MHZ - 1;
+    SYST_CVR = 0; // (also clears COUNTFLAG)
+    SYST_CSR = SYST_CSR_CLKSOURCE | SYST_CSR_ENABLE; // (no interrupt)
+    while(!(SYST_CSR & SYST_CSR_COUNTFLAG)) { }
+    SYST_CSR = 0;
+}
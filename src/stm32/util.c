@@ -7,14 +7,14 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 #include "common/util.h"
 
-uint16_t cnCRC16(unsigned len, const uint8_t data[len])
+uint16_t cnCRC16Update(uint16_t crc16, unsigned len, const uint8_t data[len])
 {
     // CRC16/XMODEM. See: http://mdfs.net/Info/Comp/Comms/CRC16.htm
     // NOTE: STM32's hardware CRC module can only calculate CRC32/Ethernet so
     //       it can't be used for this CRC16 :(
     // NOTE: int is 32-bit so masking the lowest 16 bits is needed. It also
     //       likely is faster to work on vs. uint16_t
-    int crc = CN_CRC16_INITVAL;
+    int crc = crc16;
     for(const uint8_t *it = data; it < (data + len); it ++)
     {
         crc ^= (*it << 8);
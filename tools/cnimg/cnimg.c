@@ -0,0 +1,331 @@
+// CANnuccia/tools/cnimg/cnimg.c - Converts ELF programs to CANnuccia images
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#include "cnimg.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common/sha256.h"
+
+/// The flash map of a target device.
+typedef struct Target
+{
+    const char *name;
+    uint16_t eMachine; ///< Expected ELF machine type (`CN_E_MACHINE`).
+    uint32_t pageSize; ///< `CN_FLASH_PAGE_SIZE`.
+    uint32_t flashStart, flashEnd; ///< All of flash.
+    uint32_t appStart, appEnd; ///< The part of flash the user program can be written to.
+
+} Target;
+
+/// Targets supported by CANnuccia, with their default bootloader size
+/// (and, on STM32, the page journal in the last page of flash).
+static const Target TARGETS[] =
+{
+    { "stm32f103c8", 40, 1024, 0x08000000u, 0x08010000u, 0x08001000u, 0x0800FC00u },
+    { "stm32f103zg", 40, 2048, 0x08000000u, 0x08100000u, 0x08001000u, 0x080FF800u },
+    { "atmega328p",  83, 128,  0x00000000u, 0x00008000u, 0x00000000u, 0x00007000u },
+    { "atmega1280",  83, 256,  0x00000000u, 0x00020000u, 0x00000000u, 0x0001F000u },
+    { "atmega2560",  83, 256,  0x00000000u, 0x00040000u, 0x00000000u, 0x0003F000u },
+};
+
+/// Reads a little endian U16 from `bytes`.
+static uint16_t readU16LE(const uint8_t *bytes)
+{
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+/// Reads a little endian U32 from `bytes`.
+static uint32_t readU32LE(const uint8_t *bytes)
+{
+    return bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+/// Writes `u16` to `outBytes`, little endian.
+static void writeU16LE(uint8_t *outBytes, uint16_t u16)
+{
+    outBytes[0] = (uint8_t)u16;
+    outBytes[1] = (uint8_t)(u16 >> 8);
+}
+
+/// Writes `u32` to `outBytes`, little endian.
+static void writeU32LE(uint8_t *outBytes, uint32_t u32)
+{
+    for(unsigned i = 0; i < 4; i ++)
+    {
+        outBytes[i] = (uint8_t)(u32 >> (i * 8));
+    }
+}
+
+/// Calculates the CRC16/XMODEM of a byte buffer, like the device does.
+static uint16_t crc16(unsigned len, const uint8_t *data)
+{
+    uint16_t crc = 0x0000;
+    for(unsigned i = 0; i < len; i ++)
+    {
+        crc ^= (uint16_t)(data[i] << 8);
+        for(unsigned bit = 0; bit < 8; bit ++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/// Reads the whole file at `path` to a newly-allocated buffer.
+/// Returns NULL on error.
+static uint8_t *readFile(const char *path, size_t *outSize)
+{
+    FILE *file = fopen(path, "rb");
+    if(!file)
+    {
+        perror(path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = size > 0 ? malloc((size_t)size) : NULL;
+    if(!data || fread(data, 1, (size_t)size, file) != (size_t)size)
+    {
+        fprintf(stderr, "%s: could not read file\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *outSize = (size_t)size;
+    return data;
+}
+
+/// Copies all loadable segments of the ELF32 little endian program in `elf`
+/// to `flash` (a copy of the whole flash of `target`), marking the pages they
+/// touch in `used`.
+/// Returns true on success or false on error.
+static int loadElf(const uint8_t *elf, size_t elfSize, const Target *target,
+                   uint8_t *flash, uint8_t *used)
+{
+    if(elfSize < 52 || memcmp(elf, "\x7F" "ELF", 4) != 0)
+    {
+        fprintf(stderr, "Not an ELF file\n");
+        return 0;
+    }
+    if(elf[4] != 1 || elf[5] != 1)
+    {
+        fprintf(stderr, "Not a 32-bit little endian ELF file\n");
+        return 0;
+    }
+    uint16_t eMachine = readU16LE(elf + 18);
+    if(eMachine != target->eMachine)
+    {
+        fprintf(stderr, "ELF machine type is %u, expected %u for %s\n",
+                eMachine, target->eMachine, target->name);
+        return 0;
+    }
+
+    uint32_t phOff = readU32LE(elf + 28);
+    uint16_t phEntSize = readU16LE(elf + 42), phNum = readU16LE(elf + 44);
+    if(phEntSize < 32 || phOff + (uint64_t)phNum * phEntSize > elfSize)
+    {
+        fprintf(stderr, "Invalid ELF program headers\n");
+        return 0;
+    }
+
+    for(unsigned i = 0; i < phNum; i ++)
+    {
+        const uint8_t *ph = elf + phOff + i * phEntSize;
+        uint32_t type = readU32LE(ph), offset = readU32LE(ph + 4);
+        uint32_t addr = readU32LE(ph + 12), fileSize = readU32LE(ph + 16); // (p_paddr: load address)
+        if(type != 1 || fileSize == 0) // (only PT_LOAD segments with contents)
+        {
+            continue;
+        }
+        if(offset + (uint64_t)fileSize > elfSize)
+        {
+            fprintf(stderr, "ELF segment %u out of file bounds\n", i);
+            return 0;
+        }
+        if(addr >= target->flashEnd || addr + (uint64_t)fileSize <= target->flashStart)
+        {
+            // Not in flash at all (e.g. EEPROM contents or fuses on AVR)
+            fprintf(stderr, "Skipping ELF segment %u at 0x%08X (not in flash)\n", i, addr);
+            continue;
+        }
+        if(addr < target->appStart || addr + (uint64_t)fileSize > target->appEnd)
+        {
+            fprintf(stderr, "ELF segment %u (0x%08X..0x%08X) is out of the user program's flash (0x%08X..0x%08X)\n",
+                    i, addr, addr + fileSize, target->appStart, target->appEnd);
+            return 0;
+        }
+
+        memcpy(flash + (addr - target->flashStart), elf + offset, fileSize);
+        for(uint32_t page = (addr - target->flashStart) / target->pageSize;
+            page <= (addr + fileSize - 1 - target->flashStart) / target->pageSize;
+            page ++)
+        {
+            used[page] = 1;
+        }
+    }
+    return 1;
+}
+
+/// Writes the .cni image of the pages marked in `used` to `path`.
+/// Returns true on success or false on error.
+static int writeImage(const char *path, const Target *target,
+                      const uint8_t *flash, const uint8_t *used)
+{
+    uint32_t nFlashPages = (target->flashEnd - target->flashStart) / target->pageSize;
+    uint32_t nPages = 0;
+    CNsha256 sha;
+    cnSHA256Init(&sha);
+    for(uint32_t page = 0; page < nFlashPages; page ++)
+    {
+        if(used[page])
+        {
+            uint8_t addrBytes[4];
+            writeU32LE(addrBytes, target->flashStart + page * target->pageSize);
+            cnSHA256Update(&sha, sizeof(addrBytes), addrBytes);
+            cnSHA256Update(&sha, target->pageSize, flash + page * target->pageSize);
+            nPages ++;
+        }
+    }
+
+    uint8_t header[sizeof(CNimgHeader)] = { 0 };
+    uint8_t *digest = header + offsetof(CNimgHeader, digest);
+    cnSHA256Final(&sha, digest);
+    uint32_t imageId = readU32LE(digest);
+    imageId = imageId != 0xFFFFFFFFu ? imageId : 0xFFFFFFFEu;
+    writeU32LE(header + offsetof(CNimgHeader, magic), CN_IMG_MAGIC);
+    writeU16LE(header + offsetof(CNimgHeader, headerSize), sizeof(CNimgHeader));
+    writeU16LE(header + offsetof(CNimgHeader, eMachine), target->eMachine);
+    writeU32LE(header + offsetof(CNimgHeader, pageSize), target->pageSize);
+    writeU32LE(header + offsetof(CNimgHeader, nPages), nPages);
+    writeU32LE(header + offsetof(CNimgHeader, imageId), imageId);
+
+    FILE *file = fopen(path, "wb");
+    if(!file)
+    {
+        perror(path);
+        return 0;
+    }
+    int ok = fwrite(header, sizeof(header), 1, file) == 1;
+    for(uint32_t page = 0; ok && page < nFlashPages; page ++)
+    {
+        if(used[page])
+        {
+            const uint8_t *contents = flash + page * target->pageSize;
+            uint8_t record[sizeof(CNimgPage)] = { 0 };
+            writeU32LE(record + offsetof(CNimgPage, addr), target->flashStart + page * target->pageSize);
+            writeU16LE(record + offsetof(CNimgPage, crc), crc16(target->pageSize, contents));
+            ok = fwrite(record, sizeof(record), 1, file) == 1
+                 && fwrite(contents, target->pageSize, 1, file) == 1;
+        }
+    }
+    ok = (fclose(file) == 0) && ok;
+    if(!ok)
+    {
+        fprintf(stderr, "%s: could not write file\n", path);
+        return 0;
+    }
+
+    printf("%s: %u pages of %u bytes, image id 0x%08X, SHA-256 ", path, nPages, target->pageSize, imageId);
+    for(unsigned i = 0; i < CN_SHA256_SIZE; i ++)
+    {
+        printf("%02x", digest[i]);
+    }
+    printf("\n");
+    return 1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <program.elf> <image.cni>\n"
+            "Options:\n"
+            "  -t <target>   Target device: stm32f103c8 (default), stm32f103zg,\n"
+            "                atmega328p, atmega1280 or atmega2560\n"
+            "  -m <machine>  Override the expected ELF machine type\n"
+            "  -a <address>  Override the first address of the user program's flash\n"
+            "                (e.g. 0x08000800 on STM32 or a 2kB bootloader)\n"
+            "  -A <address>  Override the end of the user program's flash (exclusive)\n"
+            "                (e.g. 0x7800 on AVR for a 2kB bootloader)\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    Target target = TARGETS[0];
+    int opt;
+    while((opt = getopt(argc, argv, "t:m:a:A:h")) != -1)
+    {
+        switch(opt)
+        {
+        case 't':
+        {
+            unsigned i;
+            for(i = 0; i < sizeof(TARGETS) / sizeof(TARGETS[0]); i ++)
+            {
+                if(strcmp(optarg, TARGETS[i].name) == 0)
+                {
+                    target = TARGETS[i];
+                    break;
+                }
+            }
+            if(i == sizeof(TARGETS) / sizeof(TARGETS[0]))
+            {
+                fprintf(stderr, "Unknown target: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'm':
+            target.eMachine = (uint16_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            target.appStart = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'A':
+            target.appEnd = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(target.appStart % target.pageSize || target.appEnd % target.pageSize
+       || target.appStart < target.flashStart || target.appEnd > target.flashEnd
+       || target.appStart >= target.appEnd)
+    {
+        fprintf(stderr, "Invalid user program flash range\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t elfSize = 0;
+    uint8_t *elf = readFile(argv[optind], &elfSize);
+    uint32_t flashSize = target.flashEnd - target.flashStart;
+    uint8_t *flash = malloc(flashSize);
+    uint8_t *used = calloc(flashSize / target.pageSize, 1);
+    int ok = elf && flash && used;
+    if(ok)
+    {
+        memset(flash, 0xFF, flashSize); // (erased flash)
+        ok = loadElf(elf, elfSize, &target, flash, used)
+             && writeImage(argv[optind + 1], &target, flash, used);
+    }
+    free(used);
+    free(flash);
+    free(elf);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,61 @@
+// CANnuccia/tools/cnimg/cnimg.h - The CANnuccia image (.cni) container format
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// A .cni file holds a program, already cut into the flash pages that have to be
+// uploaded to a device: a `CNimgHeader`, followed by `nPages` page records,
+// sorted by address. Each page record is a `CNimgPage` followed by `pageSize`
+// bytes of page contents.
+//
+// All fields are little endian and naturally aligned, so that (on little
+// endian hosts) a master can memory-map a .cni file and stream its pages as
+// they are, with no preprocessing:
+// - PROG_REQ with `imageId`
+// - for each page record: SELECT_PAGE `addr`, WRITEs, CHECK_WRITES (against
+//   `crc`), COMMIT_WRITES
+// - PROG_DONE; the IMAGE_DIGEST reply matches `digest` if the pages were
+//   committed once each, in order.
+#ifndef CNIMG_H
+#define CNIMG_H
+
+#include <stdint.h>
+
+/// "CNI1"
+#define CN_IMG_MAGIC 0x31494E43u
+
+/// The header of a .cni file.
+typedef struct CNimgHeader
+{
+    uint32_t magic; ///< `CN_IMG_MAGIC`.
+    uint16_t headerSize; ///< `sizeof(CNimgHeader)`; page records start right after it.
+    uint16_t eMachine; ///< ELF machine type of the program, see `CN_E_MACHINE`.
+    uint32_t pageSize; ///< Size of a flash page, in bytes.
+    uint32_t nPages; ///< Number of page records.
+
+    /// The image id to send with PROG_REQ, so that the page journal of the
+    /// device can track the upload: the first 4 bytes of `digest` (as a U32 LE),
+    /// never `0xFFFFFFFF` (which marks an empty journal).
+    uint32_t imageId;
+
+    uint32_t reserved[3]; ///< All zero.
+
+    /// SHA-256 of all page records, each hashed as its address (U32 LE)
+    /// followed by its contents - as computed by the device (see IMAGE_DIGEST).
+    uint8_t digest[32];
+
+} CNimgHeader;
+
+/// The header of a page record in a .cni file.
+typedef struct CNimgPage
+{
+    uint32_t addr; ///< Address of the first byte of the page in flash.
+    uint16_t crc; ///< CRC16/XMODEM of the page contents, as per CHECK_WRITES.
+    uint16_t reserved; ///< Zero.
+
+} CNimgPage;
+
+#endif // CNIMG_H
@@ -0,0 +1,155 @@
+// CANnuccia/tools/isotpbench/isotpbench.c - Throughput test of ISO-TP segmentation
+//
+// Copyright (c) 2019, Paolo Jovon <paolo.jovon@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+//
+// Sends pages of random data from a `CNisotpTx` to a `CNisotpRx` (as used by
+// ISOTP_WRITE on the devices) frame by frame, flow control included, checks
+// that each page is reassembled intact and reports how fast that went - and
+// how long the same frames take on a real CAN bus.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common/isotp.h"
+
+/// Bits on the wire of a CAN frame with `len` data bytes, without stuffing:
+/// SOF + arbitration + control + data + CRC + ACK + EOF + interframe space.
+static unsigned frameBits(unsigned len, int extIds)
+{
+    return (extIds ? 67u : 47u) + 8u * len;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "  -p <bytes>    Page (message) size, up to 4095 (default: 1024)\n"
+            "  -n <pages>    Number of pages to send (default: 100000)\n"
+            "  -b <frames>   Block size advertised by the receiver (default: 3)\n"
+            "  -r <bit/s>    CAN bit rate to estimate bus time for (default: 1000000)\n"
+            "  -s            Estimate for 11-bit instead of 29-bit CAN ids\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned pageSize = 1024, nPages = 100000, blockSize = 3, bitRate = 1000000;
+    int extIds = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "p:n:b:r:sh")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p':
+            pageSize = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            nPages = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            blockSize = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            bitRate = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            extIds = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(pageSize == 0 || pageSize > CN_ISOTP_MAX_LEN || blockSize > 0xFF || bitRate == 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *page = malloc(pageSize), *received = malloc(pageSize);
+    if(!page || !received)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    srand(1234);
+    for(unsigned i = 0; i < pageSize; i ++)
+    {
+        page[i] = (uint8_t)rand();
+    }
+
+    CNisotpRx rx;
+    cnIsoTpRxInit(&rx, pageSize, (uint8_t)blockSize, 0);
+    unsigned long long frames = 0, fcFrames = 0, bits = 0;
+    double start = now();
+    for(unsigned n = 0; n < nPages; n ++)
+    {
+        page[n % pageSize] ^= (uint8_t)n; // (a different page each time)
+
+        CNisotpTx tx;
+        cnIsoTpTxInit(&tx, pageSize, page);
+        unsigned receivedLen = 0, flags = 0;
+        while(!(flags & CN_ISOTP_RX_DONE))
+        {
+            uint8_t frame[8], fc[3];
+            unsigned frameLen = cnIsoTpTxFrame(&tx, frame);
+            if(frameLen == 0)
+            {
+                fprintf(stderr, "Sender stalled at byte %u of page %u\n", tx.sent, n);
+                return EXIT_FAILURE;
+            }
+            frames ++;
+            bits += frameBits(frameLen, extIds);
+
+            const uint8_t *payload;
+            unsigned payloadLen;
+            flags = cnIsoTpRxFrame(&rx, frameLen, frame, &payload, &payloadLen);
+            if(flags & CN_ISOTP_RX_ERROR)
+            {
+                fprintf(stderr, "Receiver error at byte %u of page %u\n", receivedLen, n);
+                return EXIT_FAILURE;
+            }
+            memcpy(received + receivedLen, payload, payloadLen);
+            receivedLen += payloadLen;
+            if(flags & CN_ISOTP_RX_SEND_FC)
+            {
+                unsigned fcLen = cnIsoTpFlowControl(&rx, fc);
+                cnIsoTpTxFlowControl(&tx, fcLen, fc);
+                fcFrames ++;
+                bits += frameBits(fcLen, extIds);
+            }
+        }
+        if(receivedLen != pageSize || memcmp(received, page, pageSize) != 0)
+        {
+            fprintf(stderr, "Page %u reassembled wrong\n", n);
+            return EXIT_FAILURE;
+        }
+    }
+    double elapsed = now() - start;
+
+    double bytes = (double)pageSize * nPages;
+    double busSeconds = (double)bits / bitRate;
+    printf("%u pages of %u bytes, block size %u: %llu data frames, %llu flow control frames\n",
+           nPages, pageSize, blockSize, frames, fcFrames);
+    printf("Host:  %.3f s, %.1f MB/s, %.1f Mframes/s\n",
+           elapsed, bytes / elapsed / 1e6, (frames + fcFrames) / elapsed / 1e6);
+    printf("Bus:   %.1f kB/s of payload at %u bit/s with %s ids (payload is %.1f%% of the bits; no bit stuffing)\n",
+           bytes / busSeconds / 1e3, bitRate, extIds ? "29-bit" : "11-bit", 100.0 * bytes * 8 / bits);
+    free(received);
+    free(page);
+    return EXIT_SUCCESS;
+}